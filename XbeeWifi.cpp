@@ -13,7 +13,9 @@
  * Instructions		See xbeewifi.h
  */
 #include "XbeeWifi.h"
+#ifndef ARCH_HOST
 #include <Arduino.h>
+#endif
 
 // Debugging...
 // Uncomment the following line to enable debug output to serial
@@ -30,6 +32,20 @@
 #define XBEE_DEBUG(x)
 #endif
 
+// Statistics, like debug, compile to nothing unless enabled
+#ifdef XBEE_ENABLE_STATS
+#define XBEE_STAT(x) (x)
+#else
+#define XBEE_STAT(x)
+#endif
+
+// Tracing too
+#ifdef XBEE_ENABLE_TRACE
+#define XBEE_TRACE(event, type, len, result) trace((event), (type), (len), (result))
+#else
+#define XBEE_TRACE(event, type, len, result)
+#endif
+
 // The following codes are returned by the rx_frame method, and used internally within this module
 #define RX_SUCCESS 0
 #define RX_FAIL_WAITING_FOR_ATN -1
@@ -37,12 +53,123 @@
 #define RX_FAIL_TRUNCATED -3
 #define RX_FAIL_CHECKSUM -4
 
+// States and flags of asynchronous AT requests
+#define AT_REQ_QUEUED	0x01
+#define AT_REQ_SENT	0x02
+#define AT_REQ_REMOTE	0x01
+#define AT_REQ_APPLY	0x02
+#define AT_REQ_FANOUT	0x04
+
+// Steps of a node through a remote profile sync
+#define SYNC_FREE	0x00
+#define SYNC_READ	0x01	// Reading the setting
+#define SYNC_WRITE	0x02	// Writing the setting, which differed
+#define SYNC_WRITE_ONLY	0x03	// Writing the write only setting
+#define SYNC_APPLY	0x04
+#define SYNC_COMMIT	0x05
+#define SYNC_DONE	0x06
+
+// Decoding of the fixed size header at the start of inbound frames
+// Each frame type has a layout, a list of fields giving where a value sits in the
+// header and where it goes in the record (s_rxinfo or s_sample) being filled in
+#define HDR_BYTES	0	// Bytes copied as they are
+#define HDR_U16		1	// Big endian 16 bit value
+
+typedef struct {
+	uint8_t offset;		// Offset of the value in the header (after frame type)
+	uint8_t len;		// Length of the value in the header
+	uint8_t kind;		// HDR_BYTES / HDR_U16
+	uint8_t dest;		// Offset of the value in the record
+} s_hdrfield;
+
+typedef struct {
+	uint8_t type;			// API frame type
+	uint8_t hdrlen;			// Length of the fixed header
+	uint8_t count;			// Number of fields
+	const s_hdrfield *fields;	// The fields
+} s_hdrlayout;
+
+#ifndef XBEE_OMIT_RX_DATA
+static const s_hdrfield rx_ipv4_fields[] XBEE_PROGMEM = {
+	{ 0,	4,	HDR_BYTES,	offsetof(s_rxinfo, source_addr) },
+	{ 4,	2,	HDR_U16,	offsetof(s_rxinfo, dest_port) },
+	{ 6,	2,	HDR_U16,	offsetof(s_rxinfo, source_port) },
+	{ 8,	1,	HDR_BYTES,	offsetof(s_rxinfo, protocol) },
+};
+#ifndef XBEE_OMIT_COMPAT_MODE
+static const s_hdrfield rx64_fields[] XBEE_PROGMEM = {
+	{ 3,	4,	HDR_BYTES,	offsetof(s_rxinfo, source_addr) },
+};
+#endif
+#endif
+#ifndef XBEE_OMIT_RX_SAMPLE
+static const s_hdrfield sample_fields[] XBEE_PROGMEM = {
+	{ 4,	4,	HDR_BYTES,	offsetof(s_sample, source_addr) },
+	{ 11,	2,	HDR_U16,	offsetof(s_sample, digital_mask) },
+	{ 13,	1,	HDR_BYTES,	offsetof(s_sample, analog_mask) },
+};
+#endif
+
+static const s_hdrlayout hdr_layouts[] XBEE_PROGMEM = {
+#ifndef XBEE_OMIT_RX_DATA
+	{ XBEE_API_FRAME_RX_IPV4,		0x0A,	4,	rx_ipv4_fields },
+#ifndef XBEE_OMIT_COMPAT_MODE
+	{ XBEE_API_FRAME_RX64_INDICATOR,	0x0A,	1,	rx64_fields },
+#endif
+#endif
+#ifndef XBEE_OMIT_RX_SAMPLE
+	{ XBEE_API_FRAME_IO_DATA_SAMPLE_RX,	0x0E,	3,	sample_fields },
+#endif
+};
+
+// Longest header of any layout, for sizing header buffers
+#define HDR_MAX 0x0E
+
+// The readings following an IO sample header, digital and then one per analog channel
+#define SAMPLE_DATA_MAX (2 + 2 * XBEE_ANALOG_CHANNELS)
+
+// Fetch the header layout for a frame type, returns false if there is none
+static bool hdr_layout(uint8_t type, s_hdrlayout *layout)
+{
+	for (unsigned int i = 0; i < sizeof(hdr_layouts) / sizeof(s_hdrlayout); i++) {
+		XBEE_PGM_COPY(layout, &hdr_layouts[i], sizeof(s_hdrlayout));
+		if (layout->type == type) return true;
+	}
+	return false;
+}
+
+// Decode the fields of a header (of which hdrlen bytes are present) into record
+// Fields falling beyond hdrlen are left untouched
+static void hdr_decode(const s_hdrlayout *layout, const uint8_t *hdr, unsigned int hdrlen, void *record)
+{
+	uint8_t *dest = (uint8_t *) record;
+	for (uint8_t i = 0; i < layout->count; i++) {
+		s_hdrfield field;
+		XBEE_PGM_COPY(&field, &layout->fields[i], sizeof(s_hdrfield));
+		if (field.offset + field.len > hdrlen) continue;
+		if (field.kind == HDR_U16) {
+			uint16_t value = ((uint16_t) hdr[field.offset] << 8) | hdr[field.offset + 1];
+			memcpy(dest + field.dest, &value, sizeof(value));
+		} else {
+			memcpy(dest + field.dest, hdr + field.offset, field.len);
+		}
+	}
+}
+
 // Constructor (default)
-XbeeWifi::XbeeWifi() : 
+XbeeWifi::XbeeWifi(uint8_t *arena, int arena_size) : 
 	last_status(XBEE_MODEM_STATUS_RESET),
 #ifndef XBEE_OMIT_RX_DATA
 	rx_seq(0), 
 	ip_data_func(NULL), 
+	ip_stream_func(NULL),
+	rx_stream_remaining(0),
+	rx_stream_cs(0),
+	rx_stream_active(false),
+	rx_stream_ok(false),
+#endif
+#ifndef XBEE_OMIT_RX_ROUTES
+	rx_route_func(NULL),
 #endif
 	modem_status_func(NULL), 
 #ifndef XBEE_OMIT_SCAN
@@ -50,35 +177,306 @@ XbeeWifi::XbeeWifi() :
 #endif
 #ifndef XBEE_OMIT_RX_SAMPLE
 	sample_func(NULL),
+#endif
+#ifndef XBEE_OMIT_SAMPLE_STORE
+	sample_sources(NULL),
+	sample_source_count(0),
+	sample_decimation(1),
 #endif
 	next_atid(0),
+#ifndef XBEE_OMIT_TX_ASYNC
+	tx_pending_count(0),
+	tx_status_func(NULL),
+#endif
+#ifndef XBEE_OMIT_AT_ASYNC
+	at_request_count(0),
+#endif
 	callback_depth(0),
 #ifdef ARCH_ATMEGA
 	spcr_copy(SPCR),
 	spsr_copy(SPSR),
 #endif
 	spiRunning(false),
-	spiLocked(false)
+	spiLocked(0),
+	spi_guard_us(XBEE_SPI_GUARD_US),
+	spi_end_us(0)
+{
+#ifndef XBEE_OMIT_TX_ASYNC
+	memset(tx_pending_id, 0, sizeof(tx_pending_id));
+#endif
+#ifndef XBEE_OMIT_AT_ASYNC
+	memset(at_requests, 0, sizeof(at_requests));
+	memset(&fanout, 0, sizeof(fanout));
+	memset(sync_nodes, 0, sizeof(sync_nodes));
+#endif
+#ifndef XBEE_OMIT_TX_QUEUE
+	memset(tx_queues, 0, sizeof(tx_queues));
+	tx_queue_count = 0;
+	tx_queue_max = 0;
+	tx_queue_age = XBEE_TX_QUEUE_AGE_MS;
+#endif
+#ifndef XBEE_OMIT_RX_ROUTES
+	memset(rx_routes, 0, sizeof(rx_routes));
+#endif
+#ifndef XBEE_OMIT_ATN_INTERRUPT
+	atn_irq = false;
+	atn_flag = false;
+#endif
+	rf_payload = 0;
+#ifndef XBEE_OMIT_FRAGMENTS
+	frag_tx_id = 0;
+#ifndef XBEE_OMIT_RX_DATA
+	frag_buf = NULL;
+	frag_active = false;
+#endif
+#endif
+#ifndef XBEE_OMIT_RX_POOL
+	rx_pool = NULL;
+	rx_pool_used = 0;
+#endif
+#ifdef ARCH_SAM
+	spi_div = SPI_BUS_DIVISOR;	// The SPI controller is configured with this by init
+#else
+	spi_set_div(SPI_BUS_DIVISOR);
+#endif
+	// The arena, ours or the caller's. Without one every borrow fails, and IP data is dropped
+	this->arena = arena;
+	this->arena_size = arena_size;
+	arena_top = 0;
+	arena_owned = false;
+	if (!arena && arena_size > 0) {
+		this->arena = (uint8_t *) malloc(arena_size);
+		arena_owned = true;
+	}
+	if (!this->arena) this->arena_size = 0;
+#ifdef XBEE_ENABLE_MEMSTATS
+	reset_memstats();
+#endif
+#ifdef XBEE_ENABLE_STATS
+	reset_stats();
+#endif
+#ifdef XBEE_ENABLE_TRACE
+	clear_trace();
+#endif
+#ifndef XBEE_OMIT_AT_CACHE
+	memset(at_cache_len, 0xFF, sizeof(at_cache_len));
+	reset_at_cache_stats();
+#endif
+}
+
+// Destructor, releasing the arena if we allocated it
+XbeeWifi::~XbeeWifi()
+{
+	if (arena_owned) free(arena);
+}
+
+// Lend a working buffer from the arena
+// Buffers are lent and returned in stack order, so this is just a matter of moving the top
+uint8_t *XbeeWifi::arena_borrow(int len, uint8_t path)
+{
+	if (len > arena_free()) {
+		XBEE_DEBUG(Serial.println(F("****** Arena exhausted")));
+#ifdef XBEE_ENABLE_MEMSTATS
+		memstats[path].failures++;
+#endif
+		return NULL;
+	}
+	uint8_t *buf = arena + arena_top;
+	arena_top += len;
+
+#ifdef XBEE_ENABLE_MEMSTATS
+	// Stack depth is measured from the outermost borrow, the first call into the library
+	// that needed a buffer, and assumes the stack grows downward
+	uint8_t marker;
+	uintptr_t sp = (uintptr_t) &marker;
+	if (buf == arena) stack_base = sp;
+	s_memstats *stats = &memstats[path];
+	stats->borrows++;
+	if (arena_top > stats->arena_peak) stats->arena_peak = arena_top;
+	if (stack_base > sp && stack_base - sp > stats->stack_peak) stats->stack_peak = stack_base - sp;
+#endif
+	return buf;
+}
+
+// Return a working buffer (and any borrowed after it) to the arena
+void XbeeWifi::arena_return(uint8_t *buf)
+{
+	if (buf) arena_top = buf - arena;
+}
+
+// Bytes of arena available to borrow
+int XbeeWifi::arena_free()
+{
+	return arena_size - arena_top;
+}
+
+#ifdef XBEE_ENABLE_MEMSTATS
+// Peak memory use for a call path
+void XbeeWifi::get_memstats(uint8_t path, s_memstats *stats)
+{
+	if (path < XBEE_PATHS) {
+		*stats = memstats[path];
+	} else {
+		memset(stats, 0, sizeof(s_memstats));
+	}
+}
+
+// Start measuring afresh
+void XbeeWifi::reset_memstats()
+{
+	memset(memstats, 0, sizeof(memstats));
+}
+
+// Memory held for the life of the object
+void XbeeWifi::get_memfootprint(s_memfootprint *fp)
+{
+	fp->object = sizeof(XbeeWifi);
+	fp->arena = arena_size;
+	fp->arena_allocated = arena_owned;
+}
+#endif
+
+#ifdef XBEE_ENABLE_STATS
+// Copy out the statistics
+void XbeeWifi::get_stats(s_stats *out)
+{
+	*out = counters;
+}
+
+// Zero the statistics
+void XbeeWifi::reset_stats()
+{
+	memset(&counters, 0, sizeof(counters));
+}
+
+// Class under which a received frame type is counted
+static uint8_t stats_rx_class(uint8_t type)
+{
+	switch(type) {
+		case XBEE_API_FRAME_RX_IPV4		:
+		case XBEE_API_FRAME_RX64_INDICATOR	: return XBEE_STATS_RX_IP;
+		case XBEE_API_FRAME_IO_DATA_SAMPLE_RX	: return XBEE_STATS_RX_SAMPLE;
+		case XBEE_API_FRAME_MODEM_STATUS	: return XBEE_STATS_RX_MODEM_STATUS;
+		case XBEE_API_FRAME_TX_STATUS		: return XBEE_STATS_RX_TX_STATUS;
+		case XBEE_API_FRAME_ATCMD_RESP		:
+		case XBEE_API_FRAME_REMOTE_CMD_RESP	: return XBEE_STATS_RX_AT_RESP;
+		default					: return XBEE_STATS_RX_OTHER;
+	}
+}
+#endif
+
+#ifdef XBEE_ENABLE_TRACE
+// Record an event in the trace ring, overwriting the oldest once full
+void XbeeWifi::trace(uint8_t event, uint8_t type, uint16_t len, uint8_t result)
+{
+	s_trace *rec = &trace_ring[trace_head];
+	rec->time_us = micros();
+	rec->len = len;
+	rec->event = event;
+	rec->type = type;
+	rec->result = result;
+	if (++trace_head == XBEE_TRACE_RECORDS) trace_head = 0;
+	if (trace_count < XBEE_TRACE_RECORDS) trace_count++;
+}
+
+// Write value as digits hex digits
+static void trace_hex(Print &out, uint32_t value, uint8_t digits)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	out.write(' ');
+	while (digits--) out.write(hex[(value >> (digits * 4)) & 0x0F]);
+}
+
+// Dump the trace ring as text, oldest record first
+void XbeeWifi::dump_trace(Print &out, bool clear)
+{
+	uint8_t index = (trace_head + XBEE_TRACE_RECORDS - trace_count) % XBEE_TRACE_RECORDS;
+	for (uint8_t n = 0; n < trace_count; n++) {
+		s_trace *rec = &trace_ring[index];
+		out.write('X');
+		out.write('T');
+		trace_hex(out, rec->time_us, 8);
+		trace_hex(out, rec->event, 2);
+		trace_hex(out, rec->type, 2);
+		trace_hex(out, rec->len, 4);
+		trace_hex(out, rec->result, 2);
+		out.write('\r');
+		out.write('\n');
+		if (++index == XBEE_TRACE_RECORDS) index = 0;
+	}
+	if (clear) clear_trace();
+}
+
+// Empty the trace ring
+void XbeeWifi::clear_trace()
 {
+	trace_head = 0;
+	trace_count = 0;
 }
+#endif
 
 // Write a buffer of given length to SPI
 // Writing multiple bytes from a single function is optimal from a SPI bus usage perspective
 void XbeeWifi::write(const uint8_t *data, int len)
 {
-	uint8_t rxbyte;
 	XBEE_DEBUG(Serial.print(F("Write")));
 	XBEE_DEBUG(Serial.println(len, DEC));
 
-	// Output data
-	for (int i = 0; i < len; i++) {
 #ifdef XBEE_ENABLE_DEBUG
-                if (digitalRead(pin_atn) == LOW) Serial.println("ATN Asserted during write");
+	if (atn_asserted()) Serial.println("ATN Asserted during write");
+	for (int i = 0; i < len; i++) {
+		Serial.print(F("OUT 0x"));
+		Serial.println(data[i], HEX);
+	}
+#endif
+
+	// Output data, discarding whatever comes back
+	transfer(data, NULL, len);
+}
+
+// Write len bytes from data to SPI while accumulating the checksum
+// This is the transmit kernel for frame payloads, the checksum is summed while the
+// previous byte is clocked so the payload is only walked once
+uint8_t XbeeWifi::write_sum(const uint8_t *data, int len, uint8_t cs)
+{
+	if (len <= 0) return cs;
+	XBEE_STAT(counters.spi_bytes += len);
+	XBEE_DEBUG(Serial.print(F("Write")));
+	XBEE_DEBUG(Serial.println(len, DEC));
+#ifdef ARCH_ATMEGA
+	uint8_t out = data[0];
+	SPDR = out;
+	cs += out;
+	for (int i = 1; i < len; i++) {
+		out = data[i];
+		cs += out;
+		while(!(SPSR & (1<<SPIF))) { };
+		(void) SPDR;
+		SPDR = out;
+	}
+	while(!(SPSR & (1<<SPIF))) { };
+	(void) SPDR;
 #endif
-		XBEE_DEBUG(Serial.print(F("OUT 0x")));
-		XBEE_DEBUG(Serial.println(data[i], HEX));
-		rxbyte = rxtx(data[i]);
+#ifdef ARCH_SAM
+	uint32_t pcs = SPI_PCS(spi_ch);
+	for (int i = 0; i < len; i++) {
+		uint8_t out = data[i];
+		cs += out;
+		while ((SPI_INTERFACE->SPI_SR & SPI_SR_TDRE) == 0) { };
+		SPI_INTERFACE->SPI_TDR = pcs | (uint32_t) out;
+		if (i > 0) {
+			while ((SPI_INTERFACE->SPI_SR & SPI_SR_RDRF) == 0) { };
+			(void) SPI_INTERFACE->SPI_RDR;
+		}
 	}
+	while ((SPI_INTERFACE->SPI_SR & SPI_SR_RDRF) == 0) { };
+	(void) SPI_INTERFACE->SPI_RDR;
+#endif
+#ifdef ARCH_HOST
+	for (int i = 0; i < len; i++) cs += data[i];
+	xbee_host_spi_transfer(data, NULL, len);
+#endif
+	return cs;
 }
 
 // Set up for SPI operation, assert chip select
@@ -87,14 +485,17 @@ void XbeeWifi::spiStart()
 	if (spiRunning) return;
 	spiRunning = true;
 	XBEE_DEBUG(Serial.println("SPI Start"));
-	delay(1);
+	// Respect the guard time since chip select was last released
+	if (spi_guard_us > 0) {
+		while ((unsigned long) (micros() - spi_end_us) < spi_guard_us) { };
+	}
 #ifdef ARCH_ATMEGA
 	spcr_copy = SPCR;
 	spsr_copy = SPSR;
-	SPCR = XBEE_SPCR;
-	SPSR = XBEE_SPSR;
+	SPCR = spi_spcr;
+	SPSR = spi_spsr;
 #endif
-	digitalWrite(pin_cs, LOW);
+	cs_select(true);
 #if NOP_COUNT > 0
 	for (int i = 0 ; i < NOP_COUNT; i++) __asm__("nop\n\t");
 #endif
@@ -109,36 +510,223 @@ void XbeeWifi::spiEnd()
 #endif
 	spiRunning = false;
 	XBEE_DEBUG(Serial.println("SPI End"));
-	digitalWrite(pin_cs, HIGH);
+	cs_select(false);
 #ifdef ARCH_ATMEGA
 	SPCR = spcr_copy;
 	SPSR = spsr_copy;
 #endif
+	if (spi_guard_us > 0) spi_end_us = micros();
+}
+
+// Set the chip select guard time
+void XbeeWifi::set_spi_guard(unsigned int us)
+{
+	spi_guard_us = us;
+}
+
+// Set the SPI clock to the fastest available rate not above hz
+bool XbeeWifi::set_spi_clock(unsigned long hz)
+{
+	if (hz == 0) return false;
+#ifdef ARCH_ATMEGA
+	uint16_t div = 2;
+	while (div <= 128 && XBEE_SPI_MASTER_HZ / div > hz) div <<= 1;
+	if (div > 128) return false;
+#else
+	unsigned long div = (XBEE_SPI_MASTER_HZ + hz - 1) / hz;
+	if (div > 255) return false;
+#endif
+	spi_set_div(div);
+	return true;
+}
+
+// The SPI clock in use
+unsigned long XbeeWifi::get_spi_clock()
+{
+	return XBEE_SPI_MASTER_HZ / spi_div;
+}
+
+// Apply a divisor. It takes effect from the next SPI session
+void XbeeWifi::spi_set_div(uint16_t div)
+{
+	spi_div = div;
+#ifdef ARCH_ATMEGA
+	// SPR1:0 divide by 4, 16, 64 or 128, and SPI2X doubles the rate
+	spi_spcr = (1 << SPE) | (1 << MSTR);
+	spi_spsr = 0x00;
+	switch(div) {
+		case 2		: spi_spsr = (1 << SPI2X);			break;
+		case 4		:						break;
+		case 8		: spi_spcr |= (1 << SPR0); spi_spsr = (1 << SPI2X);	break;
+		case 32		: spi_spcr |= (1 << SPR1); spi_spsr = (1 << SPI2X);	break;
+		case 64		: spi_spcr |= (1 << SPR1);			break;
+		case 128	: spi_spcr |= (1 << SPR1) | (1 << SPR0);	break;
+		default		: spi_spcr |= (1 << SPR0); spi_div = 16;	break;
+	}
+#endif
+#ifdef ARCH_SAM
+	SPI_ConfigureNPCS(SPI_INTERFACE, spi_ch, 0x02 | SPI_CSR_SCBR(spi_div) | SPI_CSR_DLYBCT(1));
+#endif
+#ifdef ARCH_HOST
+	xbee_host_spi_clock(XBEE_SPI_MASTER_HZ / div);
+#endif
+}
+
+// Next faster divisor
+// On AVR that is half the divisor, elsewhere about 15% faster each step
+uint16_t XbeeWifi::spi_faster_div(uint16_t div)
+{
+#ifdef ARCH_ATMEGA
+	return div > 2 ? div >> 1 : 0;
+#else
+	if (div <= 1) return 0;
+	uint16_t next = div - div / 8;
+	return next < div ? next : div - 1;
+#endif
+}
+
+// Find the fastest reliable SPI clock
+unsigned long XbeeWifi::calibrate_spi_clock(unsigned long max_hz, uint8_t trials)
+{
+	// The reference reply, taken at the starting rate
+	// Queries go through at_cmd, not at_query, so that each really crosses the bus
+	uint8_t ref[8];
+	int reflen;
+	if (!at_cmd(XBEE_AT_DIAG_FIRMWARE_VERSION, NULL, 0, ref, &reflen, false, sizeof(ref)) || !spi_trial(ref, reflen, trials)) {
+		XBEE_DEBUG(Serial.println(F("****** SPI calibration failed at the starting rate")));
+		return 0;
+	}
+
+	uint16_t good = spi_div;
+	uint16_t div = spi_div;
+	while ((div = spi_faster_div(div)) != 0 && XBEE_SPI_MASTER_HZ / div <= max_hz) {
+		spi_set_div(div);
+		if (!spi_trial(ref, reflen, trials)) {
+			XBEE_DEBUG(Serial.print(F("SPI calibration failed at divisor ")));
+			XBEE_DEBUG(Serial.println(div, DEC));
+			break;
+		}
+		good = div;
+	}
+
+	// A failed trial may have left the bus out of step, bring it back at the good rate
+	if (good != spi_div) {
+		spi_set_div(good);
+		spiStart();
+		flush_spi();
+		spiEnd();
+	}
+	return get_spi_clock();
+}
+
+// Check AT queries against the reference reply
+bool XbeeWifi::spi_trial(const uint8_t *ref, int reflen, uint8_t trials)
+{
+	uint8_t reply[8];
+	int len;
+	while (trials--) {
+		if (!at_cmd(XBEE_AT_DIAG_FIRMWARE_VERSION, NULL, 0, reply, &len, false, sizeof(reply))) return false;
+		if (len != reflen || memcmp(reply, ref, len)) return false;
+	}
+	return true;
 }
 
-uint8_t XbeeWifi::rxtx(uint8_t data)
+// Clock n bytes through the SPI bus
+// Each platform keeps the next outgoing byte staged while the current one is shifting
+// so that the bus is not left idle between bytes of a block
+void XbeeWifi::transfer(const uint8_t *tx, uint8_t *rx, int n)
 {
-	uint8_t rx;
+	if (n <= 0) return;
+	XBEE_STAT(counters.spi_bytes += n);
 #ifdef ARCH_ATMEGA
-	SPDR = data;
+	// Prime the shift register with the first byte, then fetch each next byte
+	// while the previous one is clocked out
+	SPDR = tx ? tx[0] : 0x00;
+	for (int i = 1; i < n; i++) {
+		uint8_t out = tx ? tx[i] : 0x00;
+		while(!(SPSR & (1<<SPIF))) { };
+		uint8_t in = SPDR;
+		SPDR = out;
+		if (rx) rx[i - 1] = in;
+	}
 	while(!(SPSR & (1<<SPIF))) { };
-	rx = SPDR;
+	uint8_t last = SPDR;
+	if (rx) rx[n - 1] = last;
 #endif
 #ifdef ARCH_SAM
+	// The transmit holding register frees as soon as a byte moves into the shifter
+	// so the next byte can be queued before the previous one has been received
+	uint32_t pcs = SPI_PCS(spi_ch);
 	while ((SPI_INTERFACE->SPI_SR & SPI_SR_TDRE) == 0) { };
-	SPI_INTERFACE->SPI_TDR = ((uint32_t) SPI_PCS(spi_ch) | (uint32_t) data);
+	SPI_INTERFACE->SPI_TDR = pcs | (uint32_t) (tx ? tx[0] : 0x00);
+	for (int i = 1; i < n; i++) {
+		while ((SPI_INTERFACE->SPI_SR & SPI_SR_TDRE) == 0) { };
+		SPI_INTERFACE->SPI_TDR = pcs | (uint32_t) (tx ? tx[i] : 0x00);
+		while ((SPI_INTERFACE->SPI_SR & SPI_SR_RDRF) == 0) { };
+		uint8_t in = (SPI_INTERFACE->SPI_RDR & 0xFF);
+		if (rx) rx[i - 1] = in;
+	}
 	while ((SPI_INTERFACE->SPI_SR & SPI_SR_RDRF) == 0) { };
-	rx = (SPI_INTERFACE->SPI_RDR & 0xFF);
+	uint8_t last = (SPI_INTERFACE->SPI_RDR & 0xFF);
+	if (rx) rx[n - 1] = last;
+#endif
+#ifdef ARCH_HOST
+	// Handed straight to the host harness (simulated module)
+	xbee_host_spi_transfer(tx, rx, n);
 #endif
-	return rx;
 }
 
-// Read a buffer of given length from SPI
-// Reading multiple bytes in a single function is again optimal
+// Read len bytes from SPI into data while accumulating the checksum
+// This is the receive kernel for frame payloads, the checksum is summed while the
+// next byte is clocked so the payload is only touched once
+uint8_t XbeeWifi::read_sum(uint8_t *data, int len, uint8_t cs)
+{
+	if (len <= 0) return cs;
+	XBEE_STAT(counters.spi_bytes += len);
+#ifdef ARCH_ATMEGA
+	SPDR = 0x00;
+	for (int i = 1; i < len; i++) {
+		while(!(SPSR & (1<<SPIF))) { };
+		uint8_t in = SPDR;
+		SPDR = 0x00;
+		data[i - 1] = in;
+		cs += in;
+	}
+	while(!(SPSR & (1<<SPIF))) { };
+	uint8_t last = SPDR;
+	data[len - 1] = last;
+	cs += last;
+#endif
+#ifdef ARCH_SAM
+	uint32_t pcs = SPI_PCS(spi_ch);
+	while ((SPI_INTERFACE->SPI_SR & SPI_SR_TDRE) == 0) { };
+	SPI_INTERFACE->SPI_TDR = pcs;
+	for (int i = 1; i < len; i++) {
+		while ((SPI_INTERFACE->SPI_SR & SPI_SR_TDRE) == 0) { };
+		SPI_INTERFACE->SPI_TDR = pcs;
+		while ((SPI_INTERFACE->SPI_SR & SPI_SR_RDRF) == 0) { };
+		uint8_t in = (SPI_INTERFACE->SPI_RDR & 0xFF);
+		data[i - 1] = in;
+		cs += in;
+	}
+	while ((SPI_INTERFACE->SPI_SR & SPI_SR_RDRF) == 0) { };
+	uint8_t last = (SPI_INTERFACE->SPI_RDR & 0xFF);
+	data[len - 1] = last;
+	cs += last;
+#endif
+#ifdef ARCH_HOST
+	xbee_host_spi_transfer(NULL, data, len);
+	for (int i = 0; i < len; i++) cs += data[i];
+#endif
+	return cs;
+}
+
+// Read a single byte from SPI
 uint8_t XbeeWifi::read()
 {
 	// A read is accomplished by transmitting a meaningless byte
-	uint8_t data = rxtx(0x00);
+	uint8_t data;
+	transfer(NULL, &data, 1);
 	XBEE_DEBUG(Serial.print("IN 0x"));
 	XBEE_DEBUG(Serial.println(data, HEX));
 
@@ -146,6 +734,22 @@ uint8_t XbeeWifi::read()
 	return data;
 }
 
+// Read a buffer of given length from SPI
+// Reading multiple bytes in a single call is again optimal
+// data may be NULL in which case the bytes are simply clocked through and discarded
+void XbeeWifi::read(uint8_t *data, int len)
+{
+	transfer(NULL, data, len);
+#ifdef XBEE_ENABLE_DEBUG
+	if (data) {
+		for (int i = 0; i < len; i++) {
+			Serial.print("IN 0x");
+			Serial.println(data[i], HEX);
+		}
+	}
+#endif
+}
+
 // Initialize the XBEE
 bool XbeeWifi::init(uint8_t cs, uint8_t atn, uint8_t reset, uint8_t dout)
 {
@@ -180,6 +784,14 @@ bool XbeeWifi::init(uint8_t cs, uint8_t atn, uint8_t reset, uint8_t dout)
 	pinMode(pin_atn, INPUT);
 	digitalWrite(pin_atn, HIGH);	// Pull-up
 
+#ifndef XBEE_NO_DIRECT_PINS
+	// Look up the ports once, chip select and ATN are then used without digitalWrite / digitalRead
+	cs_port = XBEE_PIN_OUT(pin_cs);
+	cs_mask = XBEE_PIN_MASK(pin_cs);
+	atn_port = XBEE_PIN_IN(pin_atn);
+	atn_mask = XBEE_PIN_MASK(pin_atn);
+#endif
+
 #ifdef ARCH_SAM
 	// Set up SPI
 	PIO_Configure(
@@ -217,7 +829,7 @@ bool XbeeWifi::init(uint8_t cs, uint8_t atn, uint8_t reset, uint8_t dout)
 
 	// Set up SPI control register
 	// 0x02 = SPI Mode 0 (CPOL = 0, CPHA = 0)
-	SPI_ConfigureNPCS(SPI_INTERFACE, spi_ch, 0x02 | SPI_CSR_SCBR(SPI_BUS_DIVISOR) | SPI_CSR_DLYBCT(1));
+	SPI_ConfigureNPCS(SPI_INTERFACE, spi_ch, 0x02 | SPI_CSR_SCBR(spi_div) | SPI_CSR_DLYBCT(1));
 #endif
 
 	// Do we have pin assignments for RESET and DOUT?
@@ -238,6 +850,9 @@ bool XbeeWifi::init(uint8_t cs, uint8_t atn, uint8_t reset, uint8_t dout)
 
 		// Stay in reset for 1/10 sec to ensure the device gets the message
 		delay(100);
+#ifndef XBEE_OMIT_AT_CACHE
+		clear_at_cache();
+#endif
 
 		// Take XBEE out of reset, still leaving DOUT LOW
 		// by tri-moding the reset pin and applying internal pullup
@@ -256,16 +871,19 @@ bool XbeeWifi::init(uint8_t cs, uint8_t atn, uint8_t reset, uint8_t dout)
 
 		// The reset / force SPI auto-queues a status frame
 		// so go ahead and read it
-		uint8_t buf[XBEE_BUFSIZE];
+		uint8_t *buf = arena_borrow(XBEE_BUFSIZE, XBEE_PATH_INIT);
+		if (!buf) return false;
 		uint8_t type;
 		unsigned int len;
 
 		// Normally rx_frame consumes and dispatches modem status frames separately
 		// however we explicitly request it to be returned in this case
 		int result = rx_frame(&type, &len, buf, XBEE_BUFSIZE, 5000L, true);
+		arena_return(buf);
 	
 		if (result == RX_SUCCESS && type == XBEE_API_FRAME_MODEM_STATUS) {
 			// Good status frame - we have an Xbee talking to us!
+			read_rf_payload();
 			return true;
 		} else {
 			XBEE_DEBUG(Serial.println(F("****** Failure rx status")));
@@ -274,14 +892,16 @@ bool XbeeWifi::init(uint8_t cs, uint8_t atn, uint8_t reset, uint8_t dout)
 	} else {
 		// Don't have assignments for RESET and DOUT so we have to assume
 		// that the XBee has already been correctly pre-configured for SPI
+		read_rf_payload();
 		return true;
 	}
 }
 
 // Transmit a SPI API frame
 // type should be the type of frame (XBEE_API_FRAME_.....)
-// data (of length len) should be all data within the frame, excluding frame id, length or checksum
-void XbeeWifi::tx_frame(uint8_t type, unsigned int len, uint8_t *data)
+// hdr and data (of length hdrlen and len) together should be all data within the frame, excluding
+// frame id, length or checksum. They are sent one after the other, without being copied together
+void XbeeWifi::tx_frame(uint8_t type, const uint8_t *hdr, int hdrlen, const uint8_t *data, int len)
 {
 	// Grab the SPI bus ASAP
 	spiStart();
@@ -289,30 +909,30 @@ void XbeeWifi::tx_frame(uint8_t type, unsigned int len, uint8_t *data)
 	// It is prudent to check for incoming frames cached, or otherwise we'd loose / corrupt
 	// them as we transmit ours. By locking the SPI bus we prevent it from being released
 	// after a packet is received (if a packet is received)
-	spiLocked = true;
+	spiLocked++;
 	process();
 
-	// Safe now to send our packet and we must also make sure and unlock the SPI
-	// bus so that when we deassert CS (spiEnd) later, it will in fact deassert
-	spiLocked = false;
-
-	// Calculate the proper checksum (sum of all bytes - type onward) subtracted from 0xFF
-	uint8_t cs = type;
-	for (unsigned int i = 0; i < len; i++) {
-		cs += data[i];
-	}
+	// Safe now to send our packet. Release our lock, so that unless an outer caller
+	// holds the session open, the spiEnd below will in fact deassert CS
+	spiLocked--;
+
+	// Set up the frame header
+	unsigned int total = hdrlen + len;
+	uint8_t start[4];
+	start[0] = 0x7e;			// Start indicator
+	start[1] = (((total + 1) >> 8) & 0xff);	// Length MSB
+	start[2] = ((total + 1) & 0xff);	// Length LSB
+	start[3] = type;			// API Frame Type
+
+	// Send, the checksum (sum of all bytes - type onward, subtracted from 0xFF)
+	// is accumulated as the content is written
+	XBEE_STAT(counters.tx_frames[XBEE_STATS_TX_AT]++);
+	XBEE_STAT(counters.tx_bytes[XBEE_STATS_TX_AT] += total + 5);
+	XBEE_TRACE(XBEE_TRACE_TX_FRAME, type, total, hdrlen > 0 ? hdr[0] : 0);
+	write(start, 4);			// Write frame header
+	uint8_t cs = write_sum(hdr, hdrlen, type);	// Write the content to SPI
+	cs = write_sum(data, len, cs);
 	cs = 0xff - cs;
-
-	// Set up the header
-	uint8_t hdr[4];
-	hdr[0] = 0x7e;				// Start indicator
-	hdr[1] = (((len + 1) >> 8) & 0xff);	// Length MSB
-	hdr[2] = ((len + 1) & 0xff);		// Length LSB
-	hdr[3] = type;				// API Frame Type
-
-	// Send
-	write(hdr, 4);				// Write header
-	write(data, len);			// Write the data to SPI
 	write(&cs, 1);				// And the checksum
 	spiEnd();
 }
@@ -343,9 +963,6 @@ int XbeeWifi::rx_frame(uint8_t *frame_type, unsigned int *len, uint8_t *data, in
 	do {
 		// Wait on ATN
 		if (!wait_atn(atn_wait_ms)) {
-			if (atn_wait_ms > 0) {
-				XBEE_DEBUG(Serial.println(F("****** Failed in rx_frame waiting for ATN")));
-			}
 			return RX_FAIL_WAITING_FOR_ATN;
 		}
 
@@ -353,22 +970,22 @@ int XbeeWifi::rx_frame(uint8_t *frame_type, unsigned int *len, uint8_t *data, in
 		spiStart();
 		in = read();
 		if (in != 0x7E) {
-			XBEE_DEBUG(Serial.println(F("****** Failed in rx_frame, invalid start byte")));
+			XBEE_STAT(counters.invalid_start++);
+			XBEE_TRACE(XBEE_TRACE_RX_FAIL, in, 0, XBEE_TRACE_FAIL_INVALID_START);
 			flush_spi();
 			spiEnd();
 			return RX_FAIL_INVALID_START_BYTE;
 		}
 	
-		// Read length (MSB and LSB) and combine
-		rxlen = ((read() << 8 | read()) - 1);	// -1 because we do not include type in our length
-		XBEE_DEBUG(Serial.print(F("rx_frame Length Of ")));
-		XBEE_DEBUG(Serial.print(rxlen, HEX));
-		XBEE_DEBUG(Serial.println(F(" bytes")));
+		// Read length (MSB and LSB) and frame type in one block
+		uint8_t hdr[3];
+		read(hdr, 3);
+		rxlen = ((hdr[0] << 8 | hdr[1]) - 1);	// -1 because we do not include type in our length
 	
-		// Read frame type
-		type = read();
-		XBEE_DEBUG(Serial.print(F("Read type 0x")));
-		XBEE_DEBUG(Serial.println(type, HEX));
+		type = hdr[2];
+		XBEE_STAT(counters.rx_frames[stats_rx_class(type)]++);
+		XBEE_STAT(counters.rx_bytes[stats_rx_class(type)] += rxlen + 5);
+		XBEE_TRACE(XBEE_TRACE_RX_FRAME, type, rxlen, 0);
 
 		uint8_t cs, cs_incoming;
 
@@ -411,18 +1028,34 @@ int XbeeWifi::rx_frame(uint8_t *frame_type, unsigned int *len, uint8_t *data, in
 			case XBEE_API_FRAME_TX_STATUS		:
 			case XBEE_API_FRAME_REMOTE_CMD_RESP	:
 			case XBEE_API_FRAME_ATCMD_RESP		:
+			{
 				// We want to handle and return this frame
+				// Without a buffer of the caller's (process), borrow one just big enough for it
+				// so that nothing is held from the arena while IP data is being received
+				uint8_t *frame = data;
+				unsigned int framesize = bufsize;
+				if (!frame) {
+					framesize = rxlen > XBEE_BUFSIZE ? XBEE_BUFSIZE : rxlen;
+					frame = arena_borrow(framesize, XBEE_PATH_PROCESS);
+					if (!frame) {
+						XBEE_TRACE(XBEE_TRACE_RX_FAIL, type, rxlen, XBEE_TRACE_FAIL_NO_BUFFER);
+						read(NULL, rxlen + 1);
+						break;
+					}
+				}
 
+				// Read as much as will fit into the buffer in one block
+				// and clock out (discarding) anything beyond that
+				// Checksum only matters if we have the whole frame
 				cs = type;
-				for (unsigned int i = 0 ; i < rxlen; i++) {
-					in = read();
-					cs += in;
-					if (i < (unsigned int) bufsize) {
-						data[i] = in;
-					} else {
-						truncated = true;
-					}
+				if (rxlen > framesize) {
+					read(frame, framesize);
+					read(NULL, rxlen - framesize);
+					truncated = true;
+				} else {
+					cs = read_sum(frame, rxlen, cs);
 				}
+
 				// Complete checksum calculation
 				cs = 0xFF - cs;
 
@@ -430,40 +1063,58 @@ int XbeeWifi::rx_frame(uint8_t *frame_type, unsigned int *len, uint8_t *data, in
 				cs_incoming = read();
 
 				// Set up returned values
-				*len = (rxlen > (unsigned int) bufsize) ? bufsize : rxlen;
+				*len = (rxlen > framesize) ? framesize : rxlen;
 				*frame_type = type;
-
-				// And report appropriate status in return value
 				spiEnd();
-				if (truncated) {
-					XBEE_DEBUG(Serial.println(F("****** RX fail, truncation")));
-					return RX_FAIL_TRUNCATED;
+
+				// TX status for an asynchronous transmission is reported through its
+				// own callback, and likewise responses to asynchronous AT requests go to
+				// their handlers. We carry on looking for the frame we were asked for
+				bool claimed = false;
+#ifndef XBEE_OMIT_TX_ASYNC
+				if (type == XBEE_API_FRAME_TX_STATUS && !truncated && cs == cs_incoming && rxlen >= 2 && tx_status_resolve(frame[0], frame[1])) claimed = true;
+#endif
+#ifndef XBEE_OMIT_AT_ASYNC
+				if (!claimed && (type == XBEE_API_FRAME_ATCMD_RESP || type == XBEE_API_FRAME_REMOTE_CMD_RESP) && !truncated && cs == cs_incoming && at_async_resolve(type, frame, rxlen)) claimed = true;
+#endif
+
+				// And report appropriate status
+				int result = RX_SUCCESS;
+				if (claimed) {
+					// Already handled
+				} else if (truncated) {
+					XBEE_STAT(counters.truncated++);
+					XBEE_TRACE(XBEE_TRACE_RX_FAIL, type, rxlen, XBEE_TRACE_FAIL_TRUNCATED);
+					result = RX_FAIL_TRUNCATED;
 				} else if (cs != cs_incoming) {
-					XBEE_DEBUG(Serial.println(F("****** RX fail, checksum")));
-					XBEE_DEBUG(Serial.print(F("RX CS 0x")));
-					XBEE_DEBUG(Serial.println(cs_incoming, HEX));
-					XBEE_DEBUG(Serial.print(F("CALC CS 0x")));
-					XBEE_DEBUG(Serial.println(cs, HEX));
-					return RX_FAIL_CHECKSUM;
-				} else {
-					return RX_SUCCESS;
+					XBEE_STAT(counters.checksum_errors++);
+					XBEE_TRACE(XBEE_TRACE_RX_FAIL, type, rxlen, XBEE_TRACE_FAIL_CHECKSUM);
+					result = RX_FAIL_CHECKSUM;
 				}
-				//break; (implied by returns)
 
-			default				:
-				// This is an unexpected (possibly new, unsupported) frame
-				// Drop it with debug
-				XBEE_DEBUG(Serial.print(F("**** RX DROP Unsupported frame, type : 0x")));
-				XBEE_DEBUG(Serial.println(type, HEX));
-				for (unsigned int i = 0 ; i < rxlen + 1; i++) {
-#ifdef XBEE_ENABLE_DEBUG
-					uint8_t dropped = read();
-					XBEE_DEBUG(Serial.print(F("Dropping : 0x")));
-					XBEE_DEBUG(Serial.println(dropped, HEX));
-#else
-					read();
+				if (frame != data) {
+					// Nobody is waiting for this frame. Active scan results are handled here,
+					// anything else is a stray and dropped
+#ifndef XBEE_OMIT_SCAN
+					if (!claimed && result == RX_SUCCESS && type == XBEE_API_FRAME_ATCMD_RESP) handleActiveScan(frame, *len);
 #endif
+					arena_return(frame);
+					*len = 0;
+					continue;
+				}
+				if (claimed) {
+					*len = 0;
+					continue;
 				}
+				return result;
+			}
+
+			default				:
+				// This is an unexpected (possibly new, unsupported) frame
+				// Drop it, recorded in the trace
+				XBEE_STAT(counters.unsupported++);
+				XBEE_TRACE(XBEE_TRACE_RX_FAIL, type, rxlen, XBEE_TRACE_FAIL_UNSUPPORTED);
+				read(NULL, rxlen + 1);
 				
 				break;
 		
@@ -539,9 +1190,10 @@ bool XbeeWifi::at_remcmd_noparm(uint8_t *ip, const char *atxx, bool apply)
 // parmval = the parameter value
 // parmlen = and it's length
 // returndata = buffer for returned data (or NULL if not interested)
-// returnlen = size of return data buffer
+// returnlen = length of the returned data (which may exceed what was copied)
 // queued = true means use the queued (non immediate) AT operation
-bool XbeeWifi::at_cmd(const char *atxx, const uint8_t *parmval, int parmlen, void *returndata, int *returnlen, bool queued)
+// returnmax = size of the return data buffer
+bool XbeeWifi::at_cmd(const char *atxx, const uint8_t *parmval, int parmlen, void *returndata, int *returnlen, bool queued, int returnmax)
 {
 	XBEE_DEBUG(Serial.print(F("Run AT Query ")));
 	XBEE_DEBUG(Serial.print(atxx[0]));
@@ -560,39 +1212,47 @@ bool XbeeWifi::at_cmd(const char *atxx, const uint8_t *parmval, int parmlen, voi
 		return false;
 	}
 
+#ifndef XBEE_OMIT_AT_CACHE
+	at_cache_command(atxx, parmlen);
+#endif
 
-	// If this is an immediate operation, increment the atid - mostly for debug reasons
-	if (!queued) {
-		next_atid++;
-		if (next_atid == 0) next_atid++;
+	// If this was immediate, then we are expecting an AT response
+	// Unless this was an AS (active scan) which we handle as a strange special case
+	// Borrow the buffer for it before sending, so we don't send what we can't take the answer to
+	bool response = !queued && (atxx[0] != 'A' || atxx[1] != 'S');
+	uint8_t *buf = NULL;
+	if (response) {
+		buf = arena_borrow(XBEE_BUFSIZE, XBEE_PATH_AT);
+		if (!buf) return false;
 	}
 
-	// Construct packet
-	uint8_t buf[XBEE_BUFSIZE];
-	buf[0] = queued ? 0x00 : next_atid;
-	buf[1] = atxx[0];
-	buf[2] = atxx[1];
-	memcpy(buf + 3, parmval, parmlen);
+	// If this is an immediate operation, increment the atid - mostly for debug reasons
+	if (!queued) next_frame_id();
+
+	// Construct packet header, the parameter follows it directly from the caller's buffer
+	uint8_t hdr[3];
+	hdr[0] = queued ? 0x00 : next_atid;
+	hdr[1] = atxx[0];
+	hdr[2] = atxx[1];
 
 	// Transmit
-	tx_frame(queued ? XBEE_API_FRAME_ATCMD_QUEUED : XBEE_API_FRAME_ATCMD, parmlen + 3, buf);
+	tx_frame(queued ? XBEE_API_FRAME_ATCMD_QUEUED : XBEE_API_FRAME_ATCMD, hdr, 3, parmval, parmlen);
 
-	// If this was immediate, then we are expecting an AT response
-	// Unless this was an AS (active scan) which we handle as a strange special case
-	if (!queued && (atxx[0] != 'A' || atxx[1] != 'S')) {
+	if (response) {
 		// AT response expected
 		uint8_t type;
 		unsigned int len;
 		int res;
+		bool ok = false;
 		if ((res = rx_frame(&type, &len, buf, XBEE_BUFSIZE)) == RX_SUCCESS) {
 			if (type == XBEE_API_FRAME_ATCMD_RESP && buf[0] == next_atid && buf[3] == 0) {
 				// Correct frame type and success code found
 				if (returndata != NULL) {
 					// Caller wants the parameter returned
 					*returnlen = (len - 4);
-					memcpy(returndata, buf + 4, *returnlen > XBEE_BUFSIZE ? XBEE_BUFSIZE : *returnlen);
+					memcpy(returndata, buf + 4, *returnlen > returnmax ? returnmax : *returnlen);
 				}
-				return true;
+				ok = true;
 			} else {
 				// Failure - either not the correct type of packet
 				// or wrong ATID or non success indication
@@ -603,9 +1263,8 @@ bool XbeeWifi::at_cmd(const char *atxx, const uint8_t *parmval, int parmlen, voi
 			XBEE_DEBUG(Serial.print(F("****** Failed AT CMD RESP, error ")));
 			XBEE_DEBUG(Serial.println(res, DEC));
 		}
-	
-		// Something failed, return false
-		return false;
+		arena_return(buf);
+		return ok;
 	} else {
 		// Was queued or was an active scan which we handle separately
 		// so we don't have a response to look for so we have to assume success
@@ -614,7 +1273,7 @@ bool XbeeWifi::at_cmd(const char *atxx, const uint8_t *parmval, int parmlen, voi
 }
 
 // This is the equivalent back end for AT command processing for remote nodes
-bool XbeeWifi::at_remcmd(uint8_t *ip, const char *atxx, const uint8_t *parmval, int parmlen, void *returndata, int *returnlen, bool apply)
+bool XbeeWifi::at_remcmd(uint8_t *ip, const char *atxx, const uint8_t *parmval, int parmlen, void *returndata, int *returnlen, bool apply, int returnmax)
 {
 	XBEE_DEBUG(Serial.print(F("Run AT Query, remote ")));
 	XBEE_DEBUG(Serial.print(atxx[0]));
@@ -627,22 +1286,24 @@ bool XbeeWifi::at_remcmd(uint8_t *ip, const char *atxx, const uint8_t *parmval,
 		return false;
 	}
 
+	// Borrow the buffer for the response before sending
+	uint8_t *buf = arena_borrow(XBEE_BUFSIZE, XBEE_PATH_AT);
+	if (!buf) return false;
+
 	// Increment ATID
-	next_atid++;
-	if (next_atid == 0) next_atid++;
-
-	// Construct packet
-	uint8_t buf[XBEE_BUFSIZE];
-	buf[0] = next_atid;
-	memset(buf + 1, 0, 4);
-	memcpy(buf + 5, ip, 4);
-	buf[9] = apply ? 0x02 : 0x00;
-	buf[10] = atxx[0];
-	buf[11] = atxx[1];
-	memcpy(buf + 12, parmval, parmlen);
+	next_frame_id();
+
+	// Construct packet header, the parameter follows it directly from the caller's buffer
+	uint8_t hdr[12];
+	hdr[0] = next_atid;
+	memset(hdr + 1, 0, 4);
+	memcpy(hdr + 5, ip, 4);
+	hdr[9] = apply ? 0x02 : 0x00;
+	hdr[10] = atxx[0];
+	hdr[11] = atxx[1];
 
 	// Transmit
-	tx_frame(XBEE_API_FRAME_REMOTE_CMD_REQ, parmlen + 12, buf);
+	tx_frame(XBEE_API_FRAME_REMOTE_CMD_REQ, hdr, 12, parmval, parmlen);
 
 	// If this was immediate, then we are expecting an AT response
 	// Unless this was an AS (active scan) which we handle as a strange special case
@@ -650,6 +1311,7 @@ bool XbeeWifi::at_remcmd(uint8_t *ip, const char *atxx, const uint8_t *parmval,
 	uint8_t type;
 	unsigned int len;
 	int res;
+	bool ok = false;
 	if ((res = rx_frame(&type, &len, buf, XBEE_BUFSIZE)) == RX_SUCCESS) {
 		if (type == XBEE_API_FRAME_REMOTE_CMD_RESP && 
 			buf[0] == next_atid && 
@@ -659,9 +1321,9 @@ bool XbeeWifi::at_remcmd(uint8_t *ip, const char *atxx, const uint8_t *parmval,
 			if (returndata != NULL) {
 				// Caller wants the parameter returned
 				*returnlen = (len - 12);
-				memcpy(returndata, buf + 12, *returnlen > XBEE_BUFSIZE ? XBEE_BUFSIZE : *returnlen);
+				memcpy(returndata, buf + 12, *returnlen > returnmax ? returnmax : *returnlen);
 			}
-			return true;
+			ok = true;
 		} else {
 			XBEE_DEBUG(Serial.println(F("****** Failed AT/REM CMD RESP")));
 		}
@@ -669,7 +1331,8 @@ bool XbeeWifi::at_remcmd(uint8_t *ip, const char *atxx, const uint8_t *parmval,
 		XBEE_DEBUG(Serial.print(F("****** Failed AT/REM CMD RESP, error ")));
 		XBEE_DEBUG(Serial.println(res, DEC));
 	}
-	return false;
+	arena_return(buf);
+	return ok;
 }
 
 // Query an AT for it's parameter value
@@ -679,12 +1342,29 @@ bool XbeeWifi::at_remcmd(uint8_t *ip, const char *atxx, const uint8_t *parmval,
 // if maxlen < parmlen then parmval will be truncated
 bool XbeeWifi::at_query(const char *atxx, uint8_t *parmval, int *parmlen, int maxlen)
 {
-	char retbuf[XBEE_BUFSIZE];
-	int len;
+#ifndef XBEE_OMIT_AT_CACHE
+	// Answer from the cache where we can
+	int slot = at_cache_slot(atxx);
+	if (slot >= 0) {
+		if (at_cache_len[slot] != 0xFF) {
+			at_cache_stats.hits++;
+			*parmlen = at_cache_len[slot];
+			memcpy(parmval, at_cache_value[slot], *parmlen > maxlen ? maxlen : *parmlen);
+			return true;
+		}
+		at_cache_stats.misses++;
+	}
+#endif
 
-	if (at_cmd(atxx, NULL, 0, retbuf, &len, false)) {
-		*parmlen = len;
-		memcpy(parmval, retbuf, len > maxlen ? maxlen : len);
+	// The value is copied straight from the response into parmval
+	if (at_cmd(atxx, NULL, 0, parmval, parmlen, false, maxlen)) {
+#ifndef XBEE_OMIT_AT_CACHE
+		// Keep the value, if the caller's buffer held all of it and so will the slot
+		if (slot >= 0 && *parmlen <= maxlen && *parmlen <= XBEE_AT_CACHE_PARMLEN) {
+			memcpy(at_cache_value[slot], parmval, *parmlen);
+			at_cache_len[slot] = *parmlen;
+		}
+#endif
 		return true;
 	} else {
 		XBEE_DEBUG(Serial.println(F("****** Failed AT QRY")));
@@ -692,15 +1372,179 @@ bool XbeeWifi::at_query(const char *atxx, uint8_t *parmval, int *parmlen, int ma
 	}
 }
 
-// Equivalent for remote device
-bool XbeeWifi::at_remquery(uint8_t *ip, const char *atxx, uint8_t *parmval, int *parmlen, int maxlen)
+#if !defined(XBEE_OMIT_LOCAL_AT) || (!defined(XBEE_OMIT_AT_ASYNC) && !defined(XBEE_OMIT_REMOTE_AT))
+// Character i of a string that may be in program memory
+static char profile_char(const char *str, int i, bool progmem)
 {
-	char retbuf[XBEE_BUFSIZE];
-	int len;
+	char c;
+	if (progmem) {
+		XBEE_PGM_COPY(&c, str + i, 1);
+	} else {
+		c = str[i];
+	}
+	return c;
+}
+
+// Copy setting i of a profile that may be in program memory
+static void profile_setting(const s_atsetting *settings, int i, bool progmem, s_atsetting *setting)
+{
+	if (progmem) {
+		XBEE_PGM_COPY(setting, &settings[i], sizeof(s_atsetting));
+	} else {
+		memcpy(setting, &settings[i], sizeof(s_atsetting));
+	}
+}
+
+// Compare a setting with the value a module reports for it
+static bool profile_matches(const s_atsetting *setting, bool progmem, const uint8_t *data, int len)
+{
+	if (setting->len > 0) {
+		// Numeric, the module reports it in as few bytes as it needs
+		if (len > 4) return false;
+		uint32_t value = 0;
+		for (int i = 0; i < len; i++) value = (value << 8) | data[i];
+		return value == setting->number;
+	}
+
+	// String, the same characters and no more
+	for (int i = 0; i < len; i++) {
+		char c = profile_char(setting->str, i, progmem);
+		if (c == 0 || c != (char) data[i]) return false;
+	}
+	return profile_char(setting->str, len, progmem) == 0;
+}
+
+// Build the parameter value of a setting in buf
+// Returns its length, or -1 if it is longer than maxlen
+static int profile_value(const s_atsetting *setting, bool progmem, uint8_t *buf, int maxlen)
+{
+	int len = 0;
+	if (setting->len > 0) {
+		len = setting->len;
+		for (int i = 0; i < len; i++) buf[i] = setting->number >> (8 * (len - 1 - i));
+	} else {
+		char c;
+		while ((c = profile_char(setting->str, len, progmem)) != 0) {
+			if (len == maxlen) {
+				XBEE_DEBUG(Serial.println(F("****** Profile string too long")));
+				return -1;
+			}
+			buf[len++] = c;
+		}
+	}
+	return len;
+}
+#endif
+
+#ifndef XBEE_OMIT_LOCAL_AT
+// Apply a configuration profile, see header for details
+int XbeeWifi::apply_profile(const s_atsetting *settings, int count, bool progmem, bool write, bool force)
+{
+	// If we are in RX callback, then we can't do ATs
+	if (callback_depth > 0) {
+		XBEE_DEBUG(Serial.println(F("***** Profile Reject - in RX callback")));
+		return -1;
+	}
+
+	uint8_t *buf = arena_borrow(XBEE_SETTING_MAXLEN, XBEE_PATH_AT);
+	if (!buf) return -1;
+
+	// The first pass sends the settings that differ, the second the write only settings,
+	// if anything was sent in the first or force is set. A value that can't be read, or is
+	// too long to compare, is taken to differ
+	int sent = 0;
+	bool ok = true;
+	for (int pass = 0; pass < 2 && ok; pass++) {
+		if (pass == 1 && sent == 0 && !force) break;
+		for (int i = 0; i < count && ok; i++) {
+			s_atsetting setting;
+			profile_setting(settings, i, progmem, &setting);
+			bool write_only = (setting.flags & XBEE_SETTING_WRITE_ONLY) != 0;
+			if (write_only != (pass == 1)) continue;
+			int len;
+			if (!write_only &&
+				at_query(setting.atxx, buf, &len, XBEE_SETTING_MAXLEN) &&
+				len <= XBEE_SETTING_MAXLEN &&
+				profile_matches(&setting, progmem, buf, len)) continue;
+
+			// Sent as a queued command, applied below
+			len = profile_value(&setting, progmem, buf, XBEE_SETTING_MAXLEN);
+			ok = len >= 0 && at_cmd(setting.atxx, buf, len, NULL, 0, true);
+			if (ok) sent++;
+		}
+	}
+	arena_return(buf);
+
+	// Apply the queued changes together, then keep them over a power cycle
+	if (ok && sent > 0) {
+		ok = at_cmd_noparm(XBEE_AT_EXEC_APPLY_CHANGES);
+		if (ok && write) ok = at_cmd_noparm(XBEE_AT_EXEC_WRITE);
+	}
+	if (!ok) {
+		XBEE_DEBUG(Serial.println(F("****** Failed to apply profile")));
+		return -1;
+	}
+	return sent;
+}
+#endif
+
+#ifndef XBEE_OMIT_AT_CACHE
+// The parameters cached, two characters each, in slot order
+static const char at_cache_params[XBEE_AT_CACHE_PARAMS * 2] XBEE_PROGMEM = {
+	'S', 'H',	'S', 'L',	'M', 'Y',	'N', 'P',	'V', 'R',	'H', 'V',	'D', 'D'
+};
+
+// Find the cache slot for a parameter
+int XbeeWifi::at_cache_slot(const char *atxx)
+{
+	char params[XBEE_AT_CACHE_PARAMS * 2];
+	XBEE_PGM_COPY(params, at_cache_params, sizeof(params));
+	for (int slot = 0; slot < XBEE_AT_CACHE_PARAMS; slot++) {
+		if (params[slot * 2] == atxx[0] && params[slot * 2 + 1] == atxx[1]) return slot;
+	}
+	return -1;
+}
+
+// Any local write may change a cached value, directly or (as MA does MY) through a
+// setting it depends on, as do the resets. A queued write only takes effect at AC, and a
+// query between the two caches the old value, so AC (and WR with it) clears it again
+// Queries and other commands leave it alone
+void XbeeWifi::at_cache_command(const char *atxx, int parmlen)
+{
+	if (parmlen > 0 ||
+		(atxx[0] == 'A' && atxx[1] == 'C') ||
+		(atxx[0] == 'W' && atxx[1] == 'R') ||
+		(atxx[0] == 'F' && atxx[1] == 'R') ||
+		(atxx[0] == 'N' && atxx[1] == 'R') ||
+		(atxx[0] == 'R' && atxx[1] == 'E')) {
+		clear_at_cache();
+	}
+}
+
+// Discard all cached values
+void XbeeWifi::clear_at_cache()
+{
+	memset(at_cache_len, 0xFF, sizeof(at_cache_len));
+	at_cache_stats.invalidations++;
+}
+
+// Report the cache counters
+void XbeeWifi::get_at_cache_stats(s_atcache_stats *out)
+{
+	memcpy(out, &at_cache_stats, sizeof(s_atcache_stats));
+}
+
+// Restart the cache counters
+void XbeeWifi::reset_at_cache_stats()
+{
+	memset(&at_cache_stats, 0, sizeof(s_atcache_stats));
+}
+#endif
 
-	if (at_remcmd(ip, atxx, NULL, 0, retbuf, &len, true)) {
-		*parmlen = len;
-		memcpy(parmval, retbuf, len > maxlen ? maxlen : len);
+// Equivalent for remote device
+bool XbeeWifi::at_remquery(uint8_t *ip, const char *atxx, uint8_t *parmval, int *parmlen, int maxlen)
+{
+	if (at_remcmd(ip, atxx, NULL, 0, parmval, parmlen, true, maxlen)) {
 		return true;
 	} else {
 		XBEE_DEBUG(Serial.println(F("**** Failed ATREMQRY")));
@@ -708,6 +1552,417 @@ bool XbeeWifi::at_remquery(uint8_t *ip, const char *atxx, uint8_t *parmval, int
 	}
 }
 
+#ifndef XBEE_OMIT_AT_ASYNC
+// Non-blocking AT command, see header for details
+uint8_t XbeeWifi::at_cmd_async(const char *atxx, const uint8_t *parmval, int parmlen, void (*func)(uint8_t, uint8_t, uint8_t *, int), unsigned long timeout_ms)
+{
+#ifndef XBEE_OMIT_AT_CACHE
+	at_cache_command(atxx, parmlen);
+#endif
+	return at_async_queue(NULL, atxx, parmval, parmlen, 0, func, timeout_ms);
+}
+
+// Non-blocking AT query
+uint8_t XbeeWifi::at_query_async(const char *atxx, void (*func)(uint8_t, uint8_t, uint8_t *, int), unsigned long timeout_ms)
+{
+	return at_async_queue(NULL, atxx, NULL, 0, 0, func, timeout_ms);
+}
+
+// Same - to remote
+uint8_t XbeeWifi::at_remcmd_async(uint8_t *ip, const char *atxx, const uint8_t *parmval, int parmlen, bool apply, void (*func)(uint8_t, uint8_t, uint8_t *, int), unsigned long timeout_ms)
+{
+	return at_async_queue(ip, atxx, parmval, parmlen, AT_REQ_REMOTE | (apply ? AT_REQ_APPLY : 0), func, timeout_ms);
+}
+
+// Same - to remote, query (always applied, as at_remquery)
+uint8_t XbeeWifi::at_remquery_async(uint8_t *ip, const char *atxx, void (*func)(uint8_t, uint8_t, uint8_t *, int), unsigned long timeout_ms)
+{
+	return at_async_queue(ip, atxx, NULL, 0, AT_REQ_REMOTE | AT_REQ_APPLY, func, timeout_ms);
+}
+
+// Returns the number of asynchronous AT requests outstanding
+uint8_t XbeeWifi::at_pending()
+{
+	return at_request_count;
+}
+
+// Remote AT command to a list of nodes, see header for details
+bool XbeeWifi::at_remcmd_fanout(const uint8_t (*ips)[4], int count, const char *atxx, const uint8_t *parmval, int parmlen, bool apply, void (*func)(int, uint8_t, uint8_t *, int), uint8_t max_inflight, unsigned long timeout_ms)
+{
+	if (fanout.count > 0) {
+		XBEE_DEBUG(Serial.println(F("****** Fan-out Reject - already running")));
+		return false;
+	}
+	if (parmlen > XBEE_AT_ASYNC_PARMLEN) {
+		XBEE_DEBUG(Serial.println(F("****** Too big async AT")));
+		return false;
+	}
+	if (count <= 0) return true;
+
+	fanout.ips = ips;
+	fanout.count = count;
+	fanout.next = 0;
+	fanout.inflight = 0;
+	fanout.max_inflight = max_inflight > 0 ? max_inflight : 1;
+	fanout.atxx[0] = atxx[0];
+	fanout.atxx[1] = atxx[1];
+	fanout.parm = parmval;
+	fanout.parmlen = parmlen;
+	fanout.apply = apply;
+	fanout.timeout = timeout_ms;
+	fanout.func = func;
+	fanout.settings = NULL;
+	at_fanout_fill();
+	return true;
+}
+
+// Remote profile sync, see header for details
+bool XbeeWifi::apply_remote_profile(const uint8_t (*ips)[4], int count, const s_atsetting *settings, int setting_count, bool progmem, bool write, bool force, void (*func)(int, uint8_t, uint32_t), uint8_t max_inflight, unsigned long timeout_ms)
+{
+	if (fanout.count > 0) {
+		XBEE_DEBUG(Serial.println(F("****** Sync Reject - fan-out already running")));
+		return false;
+	}
+	if (setting_count > XBEE_REMOTE_PROFILE_MAX) {
+		XBEE_DEBUG(Serial.println(F("****** Too many settings to sync")));
+		return false;
+	}
+
+	// Every value must fit into a request
+	uint8_t parm[XBEE_AT_ASYNC_PARMLEN];
+	for (int i = 0; i < setting_count; i++) {
+		s_atsetting setting;
+		profile_setting(settings, i, progmem, &setting);
+		if (profile_value(&setting, progmem, parm, sizeof(parm)) < 0) return false;
+	}
+	if (count <= 0) return true;
+
+	// Each node in progress has one request outstanding at a time
+	fanout.ips = ips;
+	fanout.count = count;
+	fanout.next = 0;
+	fanout.inflight = 0;
+	fanout.max_inflight = max_inflight > 0 ? (max_inflight < XBEE_AT_PENDING ? max_inflight : XBEE_AT_PENDING) : 1;
+	fanout.timeout = timeout_ms;
+	fanout.func = NULL;
+	fanout.settings = settings;
+	fanout.setting_count = setting_count;
+	fanout.progmem = progmem;
+	fanout.write = write;
+	fanout.force = force;
+	fanout.sync_func = func;
+	at_fanout_fill();
+	return true;
+}
+
+// Nodes of the fan-out still to be reported
+int XbeeWifi::at_fanout_pending()
+{
+	return fanout.count > 0 ? fanout.count - fanout.next + fanout.inflight : 0;
+}
+
+// Queue requests for further nodes while the fan-out and the request table have room
+// The node is claimed before queueing, as sending may run process() and come back here
+void XbeeWifi::at_fanout_fill()
+{
+	if (fanout.settings) {
+		// Retry steps that found the request table full, then start further nodes
+		for (int slot = 0; slot < XBEE_AT_PENDING; slot++) {
+			s_atsyncnode *sync = &sync_nodes[slot];
+			if (sync->state != SYNC_FREE && sync->resend) sync->resend = !at_sync_send(sync);
+		}
+		for (int slot = 0; slot < XBEE_AT_PENDING && fanout.count > 0 && fanout.next < fanout.count && fanout.inflight < fanout.max_inflight; slot++) {
+			s_atsyncnode *sync = &sync_nodes[slot];
+			if (sync->state != SYNC_FREE) continue;
+			sync->node = fanout.next++;
+			sync->state = SYNC_READ;
+			sync->setting = 0;
+			sync->drift = 0;
+			sync->resend = false;
+			fanout.inflight++;
+			at_sync_next(sync);
+		}
+		return;
+	}
+
+	uint8_t flags = AT_REQ_REMOTE | AT_REQ_FANOUT | (fanout.apply ? AT_REQ_APPLY : 0);
+	while (fanout.next < fanout.count && fanout.inflight < fanout.max_inflight && at_request_count < XBEE_AT_PENDING) {
+		uint16_t node = fanout.next++;
+		fanout.inflight++;
+		if (!at_async_queue(fanout.ips[node], fanout.atxx, fanout.parm, fanout.parmlen, flags, NULL, fanout.timeout, node)) {
+			fanout.next--;
+			fanout.inflight--;
+			break;
+		}
+	}
+}
+
+// Record a new asynchronous AT request
+// It goes out straight away unless we are within a callback, where transmitting could
+// recurse into the receive path. In that case process() sends it later
+uint8_t XbeeWifi::at_async_queue(const uint8_t *ip, const char *atxx, const uint8_t *parmval, int parmlen, uint8_t flags, void (*func)(uint8_t, uint8_t, uint8_t *, int), unsigned long timeout_ms, uint16_t node)
+{
+	// Parameter must fit into the request
+	if (parmlen > XBEE_AT_ASYNC_PARMLEN) {
+		XBEE_DEBUG(Serial.println(F("****** Too big async AT")));
+		return 0;
+	}
+
+	// Find a free slot
+	s_atrequest *req = NULL;
+	for (int slot = 0; slot < XBEE_AT_PENDING; slot++) {
+		if (at_requests[slot].frame_id == 0) {
+			req = &at_requests[slot];
+			break;
+		}
+	}
+	if (!req) {
+		XBEE_DEBUG(Serial.println(F("****** Async AT Reject - request table full")));
+		return 0;
+	}
+
+	req->frame_id = next_frame_id();
+	req->atxx[0] = atxx[0];
+	req->atxx[1] = atxx[1];
+	if (ip) memcpy(req->ip, ip, 4);
+	req->flags = flags;
+	req->parmlen = parmlen;
+	if (parmlen > 0) memcpy(req->parm, parmval, parmlen);
+	req->timeout = timeout_ms;
+	req->func = func;
+	req->node = node;
+	req->state = AT_REQ_QUEUED;
+	at_request_count++;
+
+	if (callback_depth == 0 && !spiLocked) at_async_send(req);
+	return req->frame_id;
+}
+
+// Build and transmit the frame for a request
+void XbeeWifi::at_async_send(s_atrequest *req)
+{
+	uint8_t hdr[12];
+
+	// Marked as sent before transmitting, tx_frame may run process()
+	// The parameter is sent straight from the request slot
+	req->state = AT_REQ_SENT;
+	req->sent = millis();
+	if (req->flags & AT_REQ_REMOTE) {
+		hdr[0] = req->frame_id;
+		memset(hdr + 1, 0, 4);
+		memcpy(hdr + 5, req->ip, 4);
+		hdr[9] = (req->flags & AT_REQ_APPLY) ? 0x02 : 0x00;
+		hdr[10] = req->atxx[0];
+		hdr[11] = req->atxx[1];
+		tx_frame(XBEE_API_FRAME_REMOTE_CMD_REQ, hdr, 12, req->parm, req->parmlen);
+	} else {
+		hdr[0] = req->frame_id;
+		hdr[1] = req->atxx[0];
+		hdr[2] = req->atxx[1];
+		tx_frame(XBEE_API_FRAME_ATCMD, hdr, 3, req->parm, req->parmlen);
+	}
+}
+
+// Called from process(), outside of any callback
+// Sends requests that were queued from within callbacks and times out requests
+// that have gone unanswered
+void XbeeWifi::at_async_service()
+{
+	// A fan-out may have been held back by requests made outside it
+	if (fanout.count > 0) at_fanout_fill();
+	if (at_request_count == 0) return;
+	for (int slot = 0; slot < XBEE_AT_PENDING; slot++) {
+		s_atrequest *req = &at_requests[slot];
+		if (req->frame_id == 0) continue;
+		if (req->state == AT_REQ_QUEUED) {
+			at_async_send(req);
+		} else if (millis() - req->sent >= req->timeout) {
+			XBEE_DEBUG(Serial.println(F("****** Async AT timeout")));
+			at_async_complete(req, XBEE_AT_STATUS_TIMEOUT, NULL, 0);
+		}
+	}
+}
+
+// Match an AT response frame against outstanding requests
+// Local responses are matched on frame id, remote responses on frame id and source IP
+// Returns true if the response belonged to an asynchronous request (and has been reported)
+bool XbeeWifi::at_async_resolve(uint8_t type, uint8_t *data, unsigned int len)
+{
+	if (at_request_count == 0 || len < 1 || data[0] == 0) return false;
+	for (int slot = 0; slot < XBEE_AT_PENDING; slot++) {
+		s_atrequest *req = &at_requests[slot];
+		if (req->frame_id != data[0] || req->state != AT_REQ_SENT) continue;
+		if (req->flags & AT_REQ_REMOTE) {
+			// Frame id, reserved, IP, command, status, value
+			if (type != XBEE_API_FRAME_REMOTE_CMD_RESP || len < 12 || memcmp(req->ip, data + 5, 4) != 0) return false;
+			at_async_complete(req, data[11], data + 12, len - 12);
+		} else {
+			// Frame id, command, status, value
+			if (type != XBEE_API_FRAME_ATCMD_RESP || len < 4) return false;
+			at_async_complete(req, data[3], data + 4, len - 4);
+		}
+		return true;
+	}
+	return false;
+}
+
+// Report the outcome of a request through its handler and release the slot
+// The slot is released first so the handler may issue another request
+void XbeeWifi::at_async_complete(s_atrequest *req, uint8_t status, uint8_t *data, int len)
+{
+	uint8_t frame_id = req->frame_id;
+	void (*func)(uint8_t, uint8_t, uint8_t *, int) = req->func;
+	req->frame_id = 0;
+	at_request_count--;
+
+	if ((req->flags & AT_REQ_FANOUT) && fanout.settings) {
+		at_sync_complete(&sync_nodes[req->node], status, data, len);
+		return;
+	}
+	if (req->flags & AT_REQ_FANOUT) {
+		// The fan-out is over once its last node is reported, which frees it for the
+		// handler to start another. Otherwise the slot goes to the next node
+		void (*node_func)(int, uint8_t, uint8_t *, int) = fanout.func;
+		fanout.inflight--;
+		if (fanout.next == fanout.count && fanout.inflight == 0) fanout.count = 0;
+		if (node_func) {
+			callback_depth++;
+			node_func(req->node, status, data, len);
+			callback_depth--;
+		}
+		if (fanout.count > 0) at_fanout_fill();
+		return;
+	}
+
+	if (func) {
+		callback_depth++;
+		func(frame_id, status, data, len);
+		callback_depth--;
+	}
+}
+
+// Skip to the next setting the node's step applies to. Once past the last setting to read,
+// the write only settings follow if anything differed (or with force), and once past those the apply
+void XbeeWifi::at_sync_next(s_atsyncnode *sync)
+{
+	while (sync->state == SYNC_READ || sync->state == SYNC_WRITE_ONLY) {
+		if (sync->setting >= fanout.setting_count) {
+			if (sync->drift == 0 && !fanout.force) {
+				sync->state = SYNC_DONE;
+			} else if (sync->state == SYNC_READ) {
+				sync->state = SYNC_WRITE_ONLY;
+				sync->setting = 0;
+			} else {
+				sync->state = SYNC_APPLY;
+			}
+			continue;
+		}
+		s_atsetting setting;
+		profile_setting(fanout.settings, sync->setting, fanout.progmem, &setting);
+		bool write_only = (setting.flags & XBEE_SETTING_WRITE_ONLY) != 0;
+		if (write_only == (sync->state == SYNC_WRITE_ONLY)) break;
+		sync->setting++;
+	}
+
+	if (sync->state == SYNC_DONE) {
+		at_sync_report(sync, XBEE_AT_STATUS_OK);
+	} else {
+		sync->resend = !at_sync_send(sync);
+	}
+}
+
+// Queue the request for the node's step
+// Returns false if it couldn't be queued, to be tried again by at_fanout_fill
+bool XbeeWifi::at_sync_send(s_atsyncnode *sync)
+{
+	uint8_t flags = AT_REQ_REMOTE | AT_REQ_FANOUT;
+	const uint8_t *ip = fanout.ips[sync->node];
+	uint16_t slot = sync - sync_nodes;
+	s_atsetting setting;
+
+	switch(sync->state) {
+		case SYNC_READ		:
+			profile_setting(fanout.settings, sync->setting, fanout.progmem, &setting);
+			return at_async_queue(ip, setting.atxx, NULL, 0, flags, NULL, fanout.timeout, slot) != 0;
+		case SYNC_WRITE		:
+		case SYNC_WRITE_ONLY	: {
+			// Written without being applied. Values were checked to fit when the sync started
+			uint8_t parm[XBEE_AT_ASYNC_PARMLEN];
+			profile_setting(fanout.settings, sync->setting, fanout.progmem, &setting);
+			int len = profile_value(&setting, fanout.progmem, parm, sizeof(parm));
+			return at_async_queue(ip, setting.atxx, parm, len, flags, NULL, fanout.timeout, slot) != 0;
+		}
+		case SYNC_APPLY		:
+			return at_async_queue(ip, XBEE_AT_EXEC_APPLY_CHANGES, NULL, 0, flags | AT_REQ_APPLY, NULL, fanout.timeout, slot) != 0;
+		case SYNC_COMMIT	:
+			return at_async_queue(ip, XBEE_AT_EXEC_WRITE, NULL, 0, flags | AT_REQ_APPLY, NULL, fanout.timeout, slot) != 0;
+	}
+	return true;
+}
+
+// Take the response to a node's request and move it on
+void XbeeWifi::at_sync_complete(s_atsyncnode *sync, uint8_t status, uint8_t *data, int len)
+{
+	if (status != XBEE_AT_STATUS_OK) {
+		at_sync_report(sync, status);
+		return;
+	}
+
+	switch(sync->state) {
+		case SYNC_READ		: {
+			s_atsetting setting;
+			profile_setting(fanout.settings, sync->setting, fanout.progmem, &setting);
+			if (!profile_matches(&setting, fanout.progmem, data, len)) {
+				sync->drift |= (uint32_t) 1 << sync->setting;
+				sync->state = SYNC_WRITE;
+				sync->resend = !at_sync_send(sync);
+				return;
+			}
+			sync->setting++;
+			break;
+		}
+		case SYNC_WRITE		:
+			sync->state = SYNC_READ;
+			sync->setting++;
+			break;
+		case SYNC_WRITE_ONLY	:
+			sync->setting++;
+			break;
+		case SYNC_APPLY		:
+			if (fanout.write) {
+				sync->state = SYNC_COMMIT;
+				sync->resend = !at_sync_send(sync);
+				return;
+			}
+			sync->state = SYNC_DONE;
+			break;
+		case SYNC_COMMIT	:
+			sync->state = SYNC_DONE;
+			break;
+	}
+	at_sync_next(sync);
+}
+
+// Report a node as done and free its slot for the next
+// The sync is over once its last node is reported, which frees it for the handler to start another
+void XbeeWifi::at_sync_report(s_atsyncnode *sync, uint8_t status)
+{
+	void (*func)(int, uint8_t, uint32_t) = fanout.sync_func;
+	uint16_t node = sync->node;
+	uint32_t drift = sync->drift;
+	sync->state = SYNC_FREE;
+	sync->resend = false;
+	fanout.inflight--;
+	if (fanout.next == fanout.count && fanout.inflight == 0) fanout.count = 0;
+	if (func) {
+		callback_depth++;
+		func(node, status, drift);
+		callback_depth--;
+	}
+	if (fanout.count > 0) at_fanout_fill();
+}
+#endif
+
 // Wait until atn asserts, for a given maximum number of milliseconds
 // returns true if assert is found
 // Call with max_mllis = 0 to get a simple true/false on whether ATN is currently asserted
@@ -717,12 +1972,21 @@ bool XbeeWifi::wait_atn(unsigned long int max_millis)
 		XBEE_DEBUG(Serial.println(F("Waiting for ATN")));
 	}
 	unsigned long int sanity = millis() + max_millis;
-	int atn;
+
+	// Only waits for a response are timed, polls from process() don't wait. The start time is
+	// taken off the total here and the end time added back once the wait is over
+	XBEE_STAT(counters.atn_wait_us -= max_millis > 0 ? (uint32_t) micros() : 0);
+	bool asserted;
 	do {
-		atn = digitalRead(pin_atn);
-		if (atn == LOW) return true;
-		if (millis() >= sanity) return false;
-	} while(true);
+		asserted = atn_asserted();
+	} while (!asserted && millis() < sanity);
+	XBEE_STAT(counters.atn_wait_us += max_millis > 0 ? (uint32_t) micros() : 0);
+
+	if (!asserted && max_millis > 0) {
+		XBEE_STAT(counters.atn_timeouts++);
+		XBEE_TRACE(XBEE_TRACE_ATN_TIMEOUT, 0, max_millis, 0);
+	}
+	return asserted;
 }
 
 // Flush SPI until ATN de-asserts, meaning XBEE has no queued data
@@ -732,15 +1996,17 @@ bool XbeeWifi::wait_atn(unsigned long int max_millis)
 // It should never be hit in normal operation unless we have software errors or possibly noise on the SPI bus
 void XbeeWifi::flush_spi()
 {
-	while(digitalRead(pin_atn) == LOW) {
-#ifdef XBEE_ENABLE_DEBUG
-		uint8_t in = read();
-#else
+#ifdef XBEE_ENABLE_TRACE
+	uint16_t flushed = 0;
+#endif
+	while(atn_asserted()) {
 		read();
+		XBEE_STAT(counters.flushed_bytes++);
+#ifdef XBEE_ENABLE_TRACE
+		flushed++;
 #endif
-		XBEE_DEBUG(Serial.print(F("Flushed one from spi: 0x")));
-		XBEE_DEBUG(Serial.println(in, HEX));
 	}
+	XBEE_TRACE(XBEE_TRACE_FLUSH, 0, flushed, 0);
 }
 		
 // Register a callback for IP data delivery
@@ -751,6 +2017,72 @@ void XbeeWifi::register_ip_data_callback(void (*func)(uint8_t *, int, s_rxinfo *
 }
 #endif
 
+// Register a callback for IP data pulled from the bus
+#ifndef XBEE_OMIT_RX_DATA
+void XbeeWifi::register_ip_stream_callback(void (*func)(s_rxinfo *))
+{
+	ip_stream_func = func;
+}
+#endif
+
+// Register (or with func NULL, remove) a handler for IP data by local port and peer
+#ifndef XBEE_OMIT_RX_ROUTES
+bool XbeeWifi::register_ip_port_callback(uint16_t dest_port, void (*func)(uint8_t *, int, s_rxinfo *), const uint8_t *source_ip, uint16_t source_port)
+{
+	static const uint8_t any[4] = { 0, 0, 0, 0 };
+	if (!source_ip) source_ip = any;
+
+	// Replace (or remove) an existing registration for the same tuple, otherwise take a free slot
+	int slot = -1;
+	for (int i = 0; i < XBEE_RX_ROUTES; i++) {
+		s_rxroute *route = &rx_routes[i];
+		if (route->func && route->dest_port == dest_port && route->source_port == source_port && !memcmp(route->source_addr, source_ip, 4)) {
+			slot = i;
+			break;
+		}
+		if (!route->func && slot < 0) slot = i;
+	}
+	if (slot < 0) return func == NULL;
+
+	s_rxroute *route = &rx_routes[slot];
+	route->dest_port = dest_port;
+	memcpy(route->source_addr, source_ip, 4);
+	route->source_port = source_port;
+	route->func = func;
+	return true;
+}
+
+// Find the handler for a packet, from its already decoded header
+// A handler matching on more fields (peer address, then peer port, then local port) is preferred
+static void (*rx_route_find(s_rxroute *routes, s_rxinfo *info))(uint8_t *, int, s_rxinfo *)
+{
+	void (*func)(uint8_t *, int, s_rxinfo *) = NULL;
+	int best = -1;
+	for (int i = 0; i < XBEE_RX_ROUTES; i++) {
+		s_rxroute *route = &routes[i];
+		if (!route->func) continue;
+		int score = 0;
+		if (route->dest_port) {
+			if (route->dest_port != info->dest_port) continue;
+			score += 1;
+		}
+		if (route->source_port) {
+			if (route->source_port != info->source_port) continue;
+			score += 2;
+		}
+		if (route->source_addr[0] | route->source_addr[1] | route->source_addr[2] | route->source_addr[3]) {
+			if (memcmp(route->source_addr, info->source_addr, 4)) continue;
+			score += 4;
+		}
+		if (score > best) {
+			best = score;
+			func = route->func;
+		}
+	}
+	return func;
+}
+#endif
+
 // Register a callback for status (modem status) delivery
 void XbeeWifi::register_status_callback(void (*func)(uint8_t))
 {
@@ -780,30 +2112,137 @@ void XbeeWifi::process(bool rx_one_packet_only)
 {
 	int res;
 	unsigned int len;
-	uint8_t buf[XBEE_BUFSIZE];
 	uint8_t type;
-	do {
+
+	// In ATN interrupt mode the bus is only visited once ATN has fallen since the last visit
+	// The flag is cleared before draining, so that an edge seen while we drain isn't lost
+	bool drain = true;
+#ifndef XBEE_OMIT_ATN_INTERRUPT
+	if (atn_irq) {
+		drain = atn_flag;
+		atn_flag = false;
+	}
+#endif
+
+	// Frames are drained in one SPI session. Chip select is asserted by the first frame
+	// and held across back to back frames for as long as ATN stays asserted, then released
+	// once, rather than once per frame
+	// No buffer is passed, so rx_frame handles every frame itself (active scan results, stray
+	// responses) and borrows from the arena only for those that need one, leaving the arena
+	// to IP reception
+	spiLocked++;
+	while (drain) {
 		// Receive frames with zero timeout
 		// Since we're not currently expecting an exlicit response to anything
 		// this simply serves to dispatch our asynchronous frames
-		res = rx_frame(&type, &len, buf, XBEE_BUFSIZE, 0, false, true);
-
-		// IP / Status / Sample packets are already handled, the only thing we need to handle here
-		// is AT response to active scan
-#ifndef XBEE_OMIT_SCAN
-		if (type == XBEE_API_FRAME_ATCMD_RESP && res == RX_SUCCESS) {
-			handleActiveScan(buf, len);
-		}
-#endif
+		res = rx_frame(&type, &len, NULL, 0, 0, false, true);
 
 		// Keep doing this until we get a report of timeout (0 length of course) waiting
 		// for ATN, meaning ATN is no longer asserted and the SPI bus is empty
-	} while(res != RX_FAIL_WAITING_FOR_ATN);
+		drain = (res != RX_FAIL_WAITING_FOR_ATN);
+	}
+	spiLocked--;
+	spiEnd();
+
+#ifndef XBEE_OMIT_TX_ASYNC
+	// Give up on any asynchronous transmissions that never received a status
+	tx_status_expire();
+#endif
+
+#if !defined(XBEE_OMIT_FRAGMENTS) && !defined(XBEE_OMIT_RX_DATA)
+	// Give up on a datagram whose remaining fragments haven't arrived in time
+	if (frag_active && millis() - frag_started >= frag_timeout) {
+		XBEE_DEBUG(Serial.println(F("****** Reassembly timeout")));
+		frag_active = false;
+	}
+#endif
+
+#ifndef XBEE_OMIT_TX_QUEUE
+	// Send queued transmissions that have waited long enough, unless nested in a callback
+	// or a transmission
+	if (tx_queue_count > 0 && callback_depth == 0 && !spiLocked) tx_queue_expire();
+#endif
+
+#ifndef XBEE_OMIT_AT_ASYNC
+	// Send any AT requests queued from within callbacks, unless this call is itself
+	// nested in a callback or a transmission, and time out unanswered requests
+	if (callback_depth == 0 && !spiLocked) at_async_service();
+#endif
+}
+
+#ifndef XBEE_OMIT_ATN_INTERRUPT
+// The object the ATN interrupt reports to
+XbeeWifi *XbeeWifi::atn_owner = NULL;
+
+// ATN falling edge, the module has frames for us
+void XbeeWifi::atn_isr()
+{
+	if (atn_owner) atn_owner->atn_flag = true;
+}
+
+// Attach or detach the ATN interrupt
+bool XbeeWifi::enable_atn_interrupt(bool enable)
+{
+	int irq = digitalPinToInterrupt(pin_atn);
+#ifdef NOT_AN_INTERRUPT
+	if (irq == NOT_AN_INTERRUPT) return false;
+#endif
+	if (!enable) {
+		if (atn_irq) detachInterrupt(irq);
+		atn_irq = false;
+		if (atn_owner == this) atn_owner = NULL;
+		return true;
+	}
+
+	// Frames may already be waiting, in which case there will be no edge to tell us
+	// so start out assuming there are
+	atn_owner = this;
+	atn_flag = true;
+	atn_irq = true;
+	attachInterrupt(irq, atn_isr, FALLING);
+	return true;
+}
+
+// True if process() has frames to collect
+bool XbeeWifi::frames_pending()
+{
+	return !atn_irq || atn_flag;
+}
+#endif
+
+#ifndef XBEE_OMIT_RX_SAMPLE
+// Decode the readings of a sample into it
+// Digital line states come first, only where digital lines are sampled, then a reading for
+// each analog channel in the mask. Channels whose readings are missing are taken out of the mask
+static void sample_decode(s_sample *sample, const uint8_t *data, unsigned int len)
+{
+	unsigned int pos = 0;
+	if (sample->digital_mask) {
+		if (len < 2) {
+			sample->digital_mask = 0;
+		} else {
+			sample->digital_samples = ((uint16_t) data[0] << 8) | data[1];
+			pos = 2;
+		}
+	}
+
+	bool first = true;
+	for (int channel = 0; channel < XBEE_ANALOG_CHANNELS; channel++) {
+		uint8_t bit = 1 << channel;
+		if (!(sample->analog_mask & bit)) continue;
+		if (pos + 2 > len) {
+			sample->analog_mask &= ~bit;
+			continue;
+		}
+		sample->analog[channel] = ((uint16_t) data[pos] << 8) | data[pos + 1];
+		if (first) sample->analog_samples = sample->analog[channel];
+		first = false;
+		pos += 2;
+	}
 }
 
 // Receive a remote sample packet
 // Packet must have already been read to type before calling with length of remaining data
-#ifndef XBEE_OMIT_RX_SAMPLE
 void XbeeWifi::rx_sample(unsigned int len)
 {
 	XBEE_DEBUG(Serial.print(F("RX Sample len 0x")));
@@ -816,23 +2255,29 @@ void XbeeWifi::rx_sample(unsigned int len)
 	// Initiate checksum processing
 	uint8_t cs = XBEE_API_FRAME_IO_DATA_SAMPLE_RX;
 	
-	// Keep reading all data, reading in the appropriate values as they are reached
-	for (unsigned int pos = 0 ; pos < len; pos++) {
-		uint8_t incoming = read();
-		cs += incoming;
-		switch(pos) {
-			case 4	: sample.source_addr[0] = incoming; break;
-			case 5	: sample.source_addr[1] = incoming; break;
-			case 6	: sample.source_addr[2] = incoming; break;
-			case 7	: sample.source_addr[3] = incoming; break;
-			case 11	: sample.digital_mask |= ((uint16_t) incoming) << 8; break;
-			case 12	: sample.digital_mask |= incoming; break;
-			case 13 : sample.analog_mask = incoming; break;
-			case 14 : sample.digital_samples |= ((uint8_t) incoming) << 8; break;
-			case 15 : sample.digital_samples |= incoming;
-			case 16 : sample.analog_samples |= ((uint8_t) incoming) << 8; break;
-			case 17 : sample.analog_samples |= incoming; break;
-		}
+	// Read the header in one block and decode it from its layout, dropping the frame if
+	// there is none
+	s_hdrlayout layout;
+	if (!hdr_layout(XBEE_API_FRAME_IO_DATA_SAMPLE_RX, &layout)) {
+		XBEE_STAT(counters.rx_dropped++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_IO_DATA_SAMPLE_RX, len, XBEE_TRACE_FAIL_INVALID);
+		read(NULL, len + 1);
+		return;
+	}
+	uint8_t hdr[HDR_MAX];
+	unsigned int hdrlen = len > layout.hdrlen ? layout.hdrlen : len;
+	cs = read_sum(hdr, hdrlen, cs);
+	hdr_decode(&layout, hdr, hdrlen, &sample);
+
+	// Then the readings, decoded once the checksum is known to be good
+	uint8_t data[SAMPLE_DATA_MAX];
+	unsigned int datalen = (len - hdrlen) > sizeof(data) ? sizeof(data) : (len - hdrlen);
+	cs = read_sum(data, datalen, cs);
+
+	// Anything beyond that is only needed for the checksum
+	for (unsigned int pos = hdrlen + datalen; pos < len; pos += hdrlen) {
+		hdrlen = (len - pos) > sizeof(hdr) ? sizeof(hdr) : (len - pos);
+		cs = read_sum(hdr, hdrlen, cs);
 	}
 	
 	// Read and validate checksum
@@ -840,16 +2285,120 @@ void XbeeWifi::rx_sample(unsigned int len)
 	cs = 0xff - cs;
 	if (incoming_cs != cs) {
 		// Invalid checksum, ignore this packet
-		XBEE_DEBUG(Serial.print(F("Incoming sample CS mismatch RX=0x")));
-		XBEE_DEBUG(Serial.print(incoming_cs, HEX));
-		XBEE_DEBUG(Serial.print(F(", CALC=0x")));
-		XBEE_DEBUG(Serial.println(cs, HEX));
+		XBEE_STAT(counters.checksum_errors++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_IO_DATA_SAMPLE_RX, len, XBEE_TRACE_FAIL_CHECKSUM);
 	} else {
-		// Valid checksum, dispatch this sample to the callback, if registered
+		// Valid checksum, dispatch this sample to the store and the callback, if registered
 		XBEE_DEBUG(Serial.println(F("Sample dispatch")));
+		sample_decode(&sample, data, datalen);
+#ifndef XBEE_OMIT_SAMPLE_STORE
+		if (sample_sources) sample_store(&sample);
+#endif
 		if (sample_func) sample_func(&sample);
 	}
 }
+
+#ifndef XBEE_OMIT_SAMPLE_STORE
+// Keep the samples of sources, see header for details
+void XbeeWifi::enable_sample_store(s_samplesource *sources, uint8_t count, uint16_t decimation)
+{
+	if (sources) memset(sources, 0, count * sizeof(s_samplesource));
+	sample_sources = sources;
+	sample_source_count = sources ? count : 0;
+	sample_decimation = decimation > 0 ? decimation : 1;
+}
+
+// Find the entry of a source
+s_samplesource *XbeeWifi::sample_source(const uint8_t *ip)
+{
+	for (int i = 0; i < sample_source_count; i++) {
+		if (sample_sources[i].used && memcmp(sample_sources[i].ip, ip, 4) == 0) return &sample_sources[i];
+	}
+	return NULL;
+}
+
+// Copy the latest ring entries of a channel, oldest first
+int XbeeWifi::sample_history(const s_samplesource *source, uint8_t channel, uint16_t *out, int max)
+{
+	if (channel != XBEE_SAMPLE_DIGITAL && channel >= XBEE_SAMPLE_CHANNELS) return 0;
+	const uint16_t *ring = channel == XBEE_SAMPLE_DIGITAL ? source->digital : source->analog[channel];
+	int n = source->stored < max ? source->stored : max;
+	int pos = (source->head + XBEE_SAMPLE_HISTORY - n) % XBEE_SAMPLE_HISTORY;
+	for (int i = 0; i < n; i++) {
+		out[i] = ring[pos];
+		pos = (pos + 1) % XBEE_SAMPLE_HISTORY;
+	}
+	return n;
+}
+
+// Restart the running statistics of a source
+void XbeeWifi::reset_sample_stats(s_samplesource *source)
+{
+	for (int channel = 0; channel < XBEE_SAMPLE_CHANNELS; channel++) {
+		s_channelstats *stats = &source->stats[channel];
+		stats->min = 0xFFFF;
+		stats->max = 0;
+		stats->sum = 0;
+		stats->count = 0;
+	}
+}
+
+// Fold a sample into its source's statistics and, every decimation samples, its rings
+void XbeeWifi::sample_store(const s_sample *sample)
+{
+	s_samplesource *source = sample_source(sample->source_addr);
+	if (!source) {
+		// Claim a free entry for a new source
+		for (int i = 0; i < sample_source_count && !source; i++) {
+			if (!sample_sources[i].used) source = &sample_sources[i];
+		}
+		if (!source) {
+			XBEE_DEBUG(Serial.println(F("****** Sample store full")));
+			return;
+		}
+		memset(source, 0, sizeof(s_samplesource));
+		memcpy(source->ip, sample->source_addr, 4);
+		source->used = true;
+		reset_sample_stats(source);
+	}
+
+	source->digital_mask = sample->digital_mask;
+	source->analog_mask = sample->analog_mask;
+	source->last_ms = millis();
+	source->samples++;
+
+	if (sample->digital_mask) {
+		source->pending_digital = sample->digital_samples;
+		source->pending_has_digital = true;
+	}
+	for (int channel = 0; channel < XBEE_SAMPLE_CHANNELS; channel++) {
+		if (!(sample->analog_mask & (1 << channel))) continue;
+		uint16_t value = sample->analog[channel];
+		s_channelstats *stats = &source->stats[channel];
+		if (value < stats->min) stats->min = value;
+		if (value > stats->max) stats->max = value;
+		stats->sum += value;
+		stats->count++;
+		source->pending_sum[channel] += value;
+		source->pending_count[channel]++;
+	}
+
+	// Make the ring entry once enough samples are in
+	if (++source->pending < sample_decimation) return;
+	uint16_t head = source->head;
+	source->digital[head] = source->pending_has_digital ? source->pending_digital : XBEE_SAMPLE_NONE;
+	for (int channel = 0; channel < XBEE_SAMPLE_CHANNELS; channel++) {
+		uint16_t count = source->pending_count[channel];
+		source->analog[channel][head] = count ? source->pending_sum[channel] / count : XBEE_SAMPLE_NONE;
+		source->pending_sum[channel] = 0;
+		source->pending_count[channel] = 0;
+	}
+	source->pending = 0;
+	source->pending_has_digital = false;
+	source->head = (head + 1) % XBEE_SAMPLE_HISTORY;
+	if (source->stored < XBEE_SAMPLE_HISTORY) source->stored++;
+}
+#endif
 #endif
 
 // Receive an IP packet (either IPv4 or compatability IP packet)
@@ -857,94 +2406,331 @@ void XbeeWifi::rx_sample(unsigned int len)
 #ifndef XBEE_OMIT_RX_DATA
 void XbeeWifi::rx_ip(unsigned int len, uint8_t frame_type)
 {
-	uint8_t buf[XBEE_BUFSIZE + 1];	// Leave 1 byte for user termination with \0 for safety
-	int bufpos = 0;
-	int pos = 4;
+	// Initialize checksum processing
+	uint8_t cs = frame_type;
+
+	// The frame must have a header layout and at least hold the header (the same length for
+	// both types), otherwise drop it
+	s_hdrlayout layout;
+	if (!hdr_layout(frame_type, &layout) || len < layout.hdrlen) {
+		XBEE_STAT(counters.rx_dropped++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, frame_type, len, XBEE_TRACE_FAIL_INVALID);
+		read(NULL, len + 1);
+		return;
+	}
 
 	// Create a new IP data record
 	s_rxinfo info;
 	memset(&info, 0, sizeof(s_rxinfo));
 
-	// Set total length of packet
-	info.total_packet_length = len - 0x0A;
+	// Set total length of packet and the sequence it is delivered under
+	info.total_packet_length = len - layout.hdrlen;
+	info.sequence = rx_seq;
 
-	// Initialize checksum processing
-	uint8_t cs = frame_type;
+	// If this is an application compatability IP packet we assert source and dest port
+	// of 0xBEE as defined by spec
+#ifndef XBEE_OMIT_COMPAT_MODE
+	if (frame_type != XBEE_API_FRAME_RX_IPV4) {
+		info.source_port = info.dest_port = 0xBEE;
+		XBEE_DEBUG(Serial.println(F("RX APPMODE")));
+	} else {
+		XBEE_DEBUG(Serial.println(F("RX RAW")));
+	}
+#endif
+
+	// Read the header in one block and decode it from the layout for the packet type
+	uint8_t hdr[HDR_MAX];
+	cs = read_sum(hdr, layout.hdrlen, cs);
+	hdr_decode(&layout, hdr, layout.hdrlen, &info);
+
+#ifndef XBEE_OMIT_FRAGMENTS
+	// Fragments go straight into the reassembly buffer
+	if (frag_buf && info.dest_port == frag_port) {
+		rx_fragment(&info, cs);
+		rx_seq++;
+		return;
+	}
+#endif
+
+#ifndef XBEE_OMIT_RX_POOL
+	// Whole packets into the pool
+	if (rx_pool) {
+		rx_pool_packet(&info, cs);
+		rx_seq++;
+		return;
+	}
+#endif
+
+	// Choose the handler for this packet once, all of its segments go to the same place
+#ifndef XBEE_OMIT_RX_ROUTES
+	rx_route_func = rx_route_find(rx_routes, &info);
+#endif
+
+	// The stream callback pulls the payload itself, straight from the bus
+	if (ip_stream_func) {
+		rx_stream_remaining = info.total_packet_length;
+		rx_stream_cs = cs;
+		rx_stream_active = true;
+		info.final = true;
+		callback_depth++;
+		ip_stream_func(&info);
+		callback_depth--;
+		rx_finish();
+		rx_seq++;
+		return;
+	}
+
+	rx_ip_segments(&info, cs);
+	rx_seq++;
+}
+
+// Read the payload of an IP packet into an intermediate buffer and dispatch it
+// Header has been read, cs is the checksum of everything up to this point
+void XbeeWifi::rx_ip_segments(s_rxinfo *info, uint8_t cs)
+{
+	// Borrow the working buffer, leaving 1 byte for user termination with \0 for safety
+	// If an AT command or transmission from within a callback already holds most of the arena
+	// make do with what remains, and only if too little remains drop the packet
+	int bufsize = arena_free();
+	if (bufsize > XBEE_BUFSIZE + 1) bufsize = XBEE_BUFSIZE + 1;
+	uint8_t *buf = bufsize >= 17 ? arena_borrow(bufsize, XBEE_PATH_RX_IP) : NULL;
+	if (!buf) {
+		XBEE_STAT(counters.rx_dropped++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_RX_IPV4, info->total_packet_length, XBEE_TRACE_FAIL_NO_BUFFER);
+		read(NULL, info->total_packet_length);
+		read();
+		return;
+	}
+	bufsize--;
+
+	// Now read the packet data itself, a buffer at a time
+	// Whenever more data follows a full buffer we must dispatch it now, even though we
+	// haven't had chance to check the checksum. The last buffer is always deferred until
+	// the checksum has been read
+	unsigned int remaining = info->total_packet_length;
+	int bufpos = 0;
+	while (remaining > 0) {
+		bufpos = remaining > (unsigned int) bufsize ? bufsize : remaining;
+		cs = read_sum(buf, bufpos, cs);
+		remaining -= bufpos;
+		if (remaining > 0) {
+			dispatch(buf, bufpos, info);
+			info->current_offset += bufpos;
+			bufpos = 0;
+		}
+	}
+
+	// Complete checksum processing
+	uint8_t inbound_cs = read();
+	cs = 0xFF - cs;
+	if (inbound_cs != cs) {
+		XBEE_STAT(counters.checksum_errors++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_RX_IPV4, info->total_packet_length, XBEE_TRACE_FAIL_CHECKSUM);
+		info->checksum_error = true;
+	}
+
+	// The last packet for a given sequence will always set the checksum error
+	// if it occured
+	// Dispatch the IP data to the callback function - if defined
+	info->final = true;
+	if (bufpos > 0) dispatch(buf, bufpos, info);
+	arena_return(buf);
+}
+
+#ifndef XBEE_OMIT_FRAGMENTS
+// Start (or with buf NULL stop) reassembly of fragmented datagrams on a port
+void XbeeWifi::enable_reassembly(uint16_t dest_port, uint8_t *buf, int bufsize, void (*func)(uint8_t *, int, s_rxinfo *), unsigned long timeout_ms)
+{
+	frag_port = dest_port;
+	frag_buf = buf;
+	frag_bufsize = bufsize;
+	frag_func = func;
+	frag_timeout = timeout_ms;
+	frag_active = false;
+}
+
+// Receive one fragment into its place in the reassembly buffer
+// A fragment that fails its checksum may already have been written anywhere within the
+// datagram, so the whole datagram is abandoned
+void XbeeWifi::rx_fragment(s_rxinfo *info, uint8_t cs)
+{
+	unsigned int len = info->total_packet_length;
+	if (len < XBEE_FRAG_HDRLEN) {
+		XBEE_STAT(counters.rx_dropped++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_RX_IPV4, len, XBEE_TRACE_FAIL_INVALID);
+		read(NULL, len + 1);
+		return;
+	}
+	uint8_t hdr[XBEE_FRAG_HDRLEN];
+	cs = read_sum(hdr, XBEE_FRAG_HDRLEN, cs);
+	len -= XBEE_FRAG_HDRLEN;
+
+	uint8_t index = hdr[2];
+	uint8_t count = hdr[3];
+	unsigned int offset = (hdr[4] << 8) | hdr[5];
+	unsigned int total = (hdr[6] << 8) | hdr[7];
+	if (hdr[0] != XBEE_FRAG_MAGIC || count == 0 || count > XBEE_FRAG_MAX || index >= count
+			|| total > (unsigned int) frag_bufsize || offset + len > total) {
+		XBEE_STAT(counters.rx_dropped++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_RX_IPV4, len, XBEE_TRACE_FAIL_INVALID);
+		read(NULL, len + 1);
+		return;
+	}
+
+	// A fragment of another datagram, or one arriving after the time allowed, starts afresh
+	if (frag_active && (hdr[1] != frag_id || count != frag_count || total != frag_total
+			|| memcmp(info->source_addr, frag_info.source_addr, 4) || info->source_port != frag_info.source_port
+			|| millis() - frag_started >= frag_timeout)) {
+		XBEE_DEBUG(Serial.println(F("****** Incomplete datagram abandoned")));
+		frag_active = false;
+	}
+	if (!frag_active) {
+		frag_active = true;
+		frag_info = *info;
+		frag_id = hdr[1];
+		frag_count = count;
+		frag_total = total;
+		frag_received = 0;
+		frag_started = millis();
+	}
+
+	cs = read_sum(frag_buf + offset, len, cs);
+	uint8_t inbound_cs = read();
+	if (inbound_cs != (uint8_t) (0xFF - cs)) {
+		XBEE_STAT(counters.checksum_errors++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_RX_IPV4, len, XBEE_TRACE_FAIL_CHECKSUM);
+		frag_active = false;
+		return;
+	}
+
+	frag_received |= (uint32_t) 1 << index;
+	uint32_t all = count == 32 ? 0xFFFFFFFFUL : ((uint32_t) 1 << count) - 1;
+	if (frag_received != all) return;
+
+	// Complete, deliver it as a single packet
+	frag_active = false;
+	frag_info.total_packet_length = frag_total;
+	frag_info.current_offset = 0;
+	frag_info.sequence = info->sequence;
+	frag_info.final = true;
+	frag_info.checksum_error = false;
+	if (frag_func) {
+		callback_depth++;
+		frag_func(frag_buf, frag_total, &frag_info);
+		callback_depth--;
+	}
+}
+#endif
+
+#ifndef XBEE_OMIT_RX_POOL
+// Start (or with blocks NULL stop) whole packet reception into a pool of blocks
+// Blocks still held by the application stay held
+void XbeeWifi::enable_rx_pool(uint8_t *blocks, int blocksize, uint8_t count, void (*func)(uint8_t *, int, s_rxinfo *))
+{
+	if (count > XBEE_RX_POOL_MAX) count = XBEE_RX_POOL_MAX;
+	if (blocks != rx_pool) rx_pool_used = 0;
+	rx_pool = blocks;
+	rx_pool_blocksize = blocksize;
+	rx_pool_count = count;
+	rx_pool_func = func;
+}
+
+// Return a block to the pool
+void XbeeWifi::release_rx_block(uint8_t *block)
+{
+	if (!rx_pool || block < rx_pool) return;
+	unsigned int index = (block - rx_pool) / rx_pool_blocksize;
+	if (index < rx_pool_count) rx_pool_used &= ~(1U << index);
+}
+
+// Count the free blocks
+uint8_t XbeeWifi::rx_pool_free()
+{
+	uint8_t free_count = 0;
+	for (uint8_t index = 0; index < rx_pool_count; index++) {
+		if (!(rx_pool_used & (1U << index))) free_count++;
+	}
+	return free_count;
+}
+
+// Read a packet's payload straight into a free block, the whole packet at once
+// The block is only handed to the application once the checksum has proven good
+void XbeeWifi::rx_pool_packet(s_rxinfo *info, uint8_t cs)
+{
+	unsigned int len = info->total_packet_length;
+	uint8_t index;
+	for (index = 0; index < rx_pool_count; index++) {
+		if (!(rx_pool_used & (1U << index))) break;
+	}
+	if (index == rx_pool_count || len > (unsigned int) rx_pool_blocksize) {
+		XBEE_STAT(counters.rx_dropped++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_RX_IPV4, len, XBEE_TRACE_FAIL_NO_BUFFER);
+		read(NULL, len + 1);
+		return;
+	}
 
-	// If this is an application compatability IP packet we assert source and dest port
-	// of 0xBEE as defined by spec
-#ifndef XBEE_OMIT_COMPAT_MODE
-	if (frame_type != XBEE_API_FRAME_RX_IPV4) {
-		info.source_port = info.dest_port = 0xBEE;
-		XBEE_DEBUG(Serial.println(F("RX APPMODE")));
+	uint8_t *block = rx_pool + index * rx_pool_blocksize;
+	cs = read_sum(block, len, cs);
+	uint8_t inbound_cs = read();
+	if (inbound_cs != (uint8_t) (0xFF - cs)) {
+		XBEE_STAT(counters.checksum_errors++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_RX_IPV4, len, XBEE_TRACE_FAIL_CHECKSUM);
+		return;
+	}
+
+	rx_pool_used |= 1U << index;
+	info->final = true;
+	if (rx_pool_func) {
+		callback_depth++;
+		rx_pool_func(block, len, info);
+		callback_depth--;
 	} else {
-		XBEE_DEBUG(Serial.println(F("RX RAW")));
+		rx_pool_used &= ~(1U << index);
 	}
-#endif
-	
-	// Read data and process in based on packet type
-	do {
-		uint8_t inbound = read();
-		XBEE_DEBUG(Serial.print(F("Inbound PKT Data 0x")));
-		XBEE_DEBUG(Serial.println(inbound, HEX));
-		cs += inbound;
-#ifndef XBEE_OMIT_COMPAT_MODE
-		if (frame_type == XBEE_API_FRAME_RX_IPV4) {
-#endif
-			// Handle IPV4 header info
-			switch(pos) {
-				case 4	:	info.source_addr[0] = inbound; break;
-				case 5	:	info.source_addr[1] = inbound; break;
-				case 6	:	info.source_addr[2] = inbound; break;
-				case 7	:	info.source_addr[3] = inbound; break;
-				case 8	:	info.dest_port |= (((uint16_t) inbound) << 8); break;
-				case 9	:	info.dest_port |= ((uint16_t) inbound); break;
-				case 10	:	info.source_port |= (((uint16_t) inbound) << 8); break;
-				case 11	:	info.source_port |= ((uint16_t) inbound); break;
-				case 12	:	info.protocol = inbound; break;
-			}
-#ifndef XBEE_OMIT_COMPAT_MODE
-			} else {
-			// Handle application compatability header info
-			switch(pos) {
-				case 7	:	info.source_addr[0] = inbound; break;
-				case 8	:	info.source_addr[1] = inbound; break;
-				case 9	:	info.source_addr[2] = inbound; break;
-				case 10	:	info.source_addr[3] = inbound; break;
-			}
-		}
+}
 #endif
 
-		if (pos > 0x0D) {
-			// Past the header - reading actual packet data now
-			if (bufpos == XBEE_BUFSIZE && len > 1) {
-				// We've exhausted our inbound buffer, we must dispatch
-				// this buffer now, even though we haven't had chance to check
-				// the checksum unless of course this was the last byte
-				// in which case we still defer
-				dispatch(buf, bufpos, &info);
-				info.current_offset += bufpos;
-				bufpos = 0;
-			}
-			buf[bufpos++] = inbound;
-		}
-		pos++;
-	} while (--len > 0);
+// Number of payload bytes of the current streamed packet not yet read
+int XbeeWifi::rx_available()
+{
+	return rx_stream_active ? rx_stream_remaining : 0;
+}
 
-	// Complete checksum processing
-	uint8_t inbound_cs = read();
-	cs = 0xFF - cs;
-	if (inbound_cs != cs) {
-		XBEE_DEBUG(Serial.println(F("****** CS Fail inbound rx")));
-		info.checksum_error = true;
+// Read payload of the current streamed packet directly into the caller's buffer
+int XbeeWifi::rx_read(uint8_t *buf, int len)
+{
+	if (!rx_stream_active || len <= 0) return 0;
+	if ((unsigned int) len > rx_stream_remaining) len = rx_stream_remaining;
+	rx_stream_cs = read_sum(buf, len, rx_stream_cs);
+	rx_stream_remaining -= len;
+	return len;
+}
+
+// Skip payload of the current streamed packet
+// The bytes still have to pass through the checksum, so they go via a small scratch buffer
+void XbeeWifi::rx_skip(int len)
+{
+	uint8_t scratch[32];
+	while (len > 0 && rx_stream_active && rx_stream_remaining > 0) {
+		int n = rx_read(scratch, len > (int) sizeof(scratch) ? sizeof(scratch) : len);
+		len -= n;
 	}
+}
 
-	// The last packet for a given sequence will always set the checksum error
-	// if it occured
-	// Dispatch the IP data to the callback function - if defined
-	info.final = true;
-	if (bufpos > 0) dispatch(buf, bufpos, &info);
-	rx_seq++;
+// Complete the current streamed packet, discarding unread payload and
+// validating the checksum. Repeated calls return the same result
+bool XbeeWifi::rx_finish()
+{
+	if (!rx_stream_active) return rx_stream_ok;
+	rx_skip(rx_stream_remaining);
+	uint8_t inbound_cs = read();
+	rx_stream_ok = (inbound_cs == (uint8_t) (0xFF - rx_stream_cs));
+	rx_stream_active = false;
+	if (!rx_stream_ok) {
+		XBEE_STAT(counters.checksum_errors++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_RX_IPV4, 0, XBEE_TRACE_FAIL_CHECKSUM);
+	}
+	return rx_stream_ok;
 }
 #endif
 
@@ -955,41 +2741,64 @@ void XbeeWifi::rx_modem_status(unsigned int len)
 	if (len != 1) {
 		// Oops....
 		// Read the frame out and ignore
-		for (unsigned int i = 0 ; i < len + 1; i++) read();
+		read(NULL, len + 1);
 		XBEE_DEBUG(Serial.println(F("Non 1 length on incoming modem status frame")));
 	} else {
-		uint8_t status = read();
+		uint8_t in[2];
+		read(in, 2);
+		uint8_t status = in[0];
 		uint8_t cs = 0xFF - (uint8_t) (status + XBEE_API_FRAME_MODEM_STATUS);
-		uint8_t incoming_cs = read();
+		uint8_t incoming_cs = in[1];
 		if (incoming_cs == cs) {
+			XBEE_TRACE(XBEE_TRACE_MODEM_STATUS, 0, 0, status);
 			// Record last status
 			last_status = status;
+#ifndef XBEE_OMIT_AT_CACHE
+			// A reset may follow a configuration change, and a join or failure to obtain an
+			// address changes MY. Drop everything rather than tracking which is which
+			if (status == XBEE_MODEM_STATUS_RESET ||
+				status == XBEE_MODEM_STATUS_WATCHDOG_RESET ||
+				status == XBEE_MODEM_STATUS_JOINED ||
+				status == XBEE_MODEM_STATUS_IP_CONFIG_ERROR) {
+				clear_at_cache();
+			}
+#endif
 			// Dispatch status
 			if (modem_status_func) modem_status_func(status);
 		} else {
 			// Bad checksum - discard
-			XBEE_DEBUG(Serial.println(F("Checksum mismatch on incoming modem status frame")));
+			XBEE_STAT(counters.checksum_errors++);
+			XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_MODEM_STATUS, len, XBEE_TRACE_FAIL_CHECKSUM);
 		}
 	}
 }
 
-// Transmits data of length to the address and with options specified in addr struct
-// If confirm=true (default) then send confirmation is requested and reflected in
-// the return from this function
+// Send an IP data frame to the address and with options specified in addr struct
+// frame_id is placed in the frame, non zero requests a TX status response from the Xbee
 // useAppService=true would be used to use the application compatability (0xBEE port) method, true for
 // raw IPV4
 // When using app compat mode, addr can be null because it is unused
-bool XbeeWifi::transmit(const uint8_t *ip, s_txoptions *addr, uint8_t *data, int len, bool confirm, bool useAppService)
+bool XbeeWifi::tx_ip(const uint8_t *ip, s_txoptions *addr, const s_txsegment *segs, int count, uint8_t frame_id, bool useAppService)
 {
+	// Total length of the payload across all segments
+	int len = 0;
+	for (int seg = 0; seg < count; seg++) {
+		if (segs[seg].len < 0) return false;
+		len += segs[seg].len;
+	}
+
+	// Attempt to send nothing will be considered an error
+	if (len <= 0) return false;
+
 	// Okay - let's grab the SPI bus and LOCK it (so that other agents within
 	// this code base cannot release it)
 	// This way we (hopefully) stop the Xbee from queuing up any inbound frames
 	spiStart();
-	spiLocked=true;
+	spiLocked++;
 
 	// But it's possible that Xbee may have already had such frames pending
 	// .. So deal with them
-	if (digitalRead(pin_atn) == LOW) {
+	if (atn_asserted()) {
 		XBEE_DEBUG(Serial.print(F("ATN asserted before transmit, call process")));
 		process();
 	}
@@ -997,33 +2806,18 @@ bool XbeeWifi::transmit(const uint8_t *ip, s_txoptions *addr, uint8_t *data, int
 	// Okay - the SPI bus should now be clear of incoming data
 	// we are safe to send our own data...
 	// We still have the SPI bus chip select locked.
-	// Unlock it so that when the transmit releases it, it is actually released
-	spiLocked = false;
+	// Release our lock so that when the transmit releases it, it is actually released
+	// (unless an outer caller, such as process() delivering to a callback, holds it)
+	spiLocked--;
 
 	XBEE_DEBUG(Serial.print(F("XMIT frame of length ")));
 	XBEE_DEBUG(Serial.println(len, DEC));
 	XBEE_DEBUG(Serial.print(F("XMIT mode : ")));
 	XBEE_DEBUG(Serial.println(useAppService ? F("APP") : F("RAW")));
 
-	// If we're in the RX callback, we cannot risk confirmation, so we force confirm=false
-	if (callback_depth > 0) {
-		confirm = false;
-		XBEE_DEBUG(Serial.print(F("Transmit during RX callback - force no confirmation")));
-	}
-
-	// Attempt to send nothing will be considered an error
-	if (len <= 0) return false;
-
 	// Set up the header for the data
 	uint8_t hdrbuf[15];
 
-	// If we've been asked for confirmation, then we'll be needing
-	// an atid
-	if (confirm) {
-		next_atid++;
-		if (next_atid == 0) next_atid++;
-	}
-
 	// Construct the header
 #ifndef XBEE_OMIT_COMPAT_MODE
 	int hdrlen = useAppService ? 0x0E : 0x0F;
@@ -1039,7 +2833,7 @@ bool XbeeWifi::transmit(const uint8_t *ip, s_txoptions *addr, uint8_t *data, int
 #else
 	hdrbuf[offset++] = XBEE_API_FRAME_TX_IPV4;
 #endif
-	hdrbuf[offset++]  = confirm ? next_atid : 0x00;	// ATID (or 00 if no confirm required)
+	hdrbuf[offset++]  = frame_id;			// ATID (or 00 if no confirm required)
 	if (useAppService) {
 		hdrbuf[offset++] = 0x00;
 		hdrbuf[offset++] = 0x00;
@@ -1065,61 +2859,376 @@ bool XbeeWifi::transmit(const uint8_t *ip, s_txoptions *addr, uint8_t *data, int
 	}
 #endif
 	
-	// Write the header, and then the data to SPI
+	// Write the header, and then each segment of data to SPI
+	// The checksum is accumulated as the bytes are written, from the frame type onward
+	XBEE_STAT(counters.tx_frames[XBEE_STATS_TX_IP]++);
+	XBEE_STAT(counters.tx_bytes[XBEE_STATS_TX_IP] += hdrlen + len + 1);
+	XBEE_TRACE(XBEE_TRACE_TX_FRAME, hdrbuf[3], len, frame_id);
 	spiStart();
-	write(hdrbuf, hdrlen);
-	write(data, len);
-
-	// Calculate the checksum
-	uint8_t cs = 0;
-	int i;
-	for(i = 3; i < hdrlen; i ++) cs += hdrbuf[i];
-	for (i = 0; i < len; i ++) cs += data[i];
+	write(hdrbuf, 3);
+	uint8_t cs = write_sum(hdrbuf + 3, hdrlen - 3, 0);
+	for (int seg = 0; seg < count; seg++) {
+#ifdef ARCH_ATMEGA
+		if (segs[seg].progmem) {
+			// Program memory can't be clocked out directly, bring it through RAM in chunks
+			uint8_t chunk[16];
+			for (int done = 0; done < segs[seg].len; done += sizeof(chunk)) {
+				int n = segs[seg].len - done;
+				if (n > (int) sizeof(chunk)) n = sizeof(chunk);
+				XBEE_PGM_COPY(chunk, segs[seg].data + done, n);
+				cs = write_sum(chunk, n, cs);
+			}
+			continue;
+		}
+#endif
+		cs = write_sum(segs[seg].data, segs[seg].len, cs);
+	}
 	cs = 0xFF - cs;
 
 	// Write the checksum
 	write(&cs, 1);
 	spiEnd();
+	return true;
+}
+
+// Transmits data of length to the address and with options specified in addr struct
+// If confirm=true (default) then send confirmation is requested and reflected in
+// the return from this function
+// useAppService=true would be used to use the application compatability (0xBEE port) method, true for
+// raw IPV4
+// When using app compat mode, addr can be null because it is unused
+bool XbeeWifi::transmit(const uint8_t *ip, s_txoptions *addr, uint8_t *data, int len, bool confirm, bool useAppService)
+{
+	s_txsegment seg = { data, len, false };
+	return transmitv(ip, addr, &seg, 1, confirm, useAppService);
+}
+
+// Transmits data gathered from count segments as a single packet
+// Each segment is written to SPI in turn, so no staging buffer is needed
+// Options as for transmit
+bool XbeeWifi::transmitv(const uint8_t *ip, s_txoptions *addr, const s_txsegment *segs, int count, bool confirm, bool useAppService)
+{
+	// If we're in the RX callback, we cannot risk confirmation, so we force confirm=false
+	if (callback_depth > 0) {
+		confirm = false;
+		XBEE_DEBUG(Serial.print(F("Transmit during RX callback - force no confirmation")));
+	}
+
+	// If we've been asked for confirmation, then we'll be needing
+	// an atid
+	uint8_t frame_id = confirm ? next_frame_id() : 0x00;
 
-	// If asked to confirm we sent a packet with a non-zero ATID
-	// and must now listen for a response
+	// If asked to confirm, borrow the buffer for the response before sending
+	uint8_t *buf = NULL;
 	if (confirm) {
-		uint8_t type;
-		unsigned int len;
-		uint8_t buf[XBEE_BUFSIZE];
-		// Attempt to receive a frame - use a long timeout for ATN (1 minute)
-		if (rx_frame(&type, &len, buf, XBEE_BUFSIZE, 60000L) == RX_SUCCESS) {
-			if (type != XBEE_API_FRAME_TX_STATUS) {
-				// Did not get the expected frame back
-				// Probably not the best idea, but clean out the SPI bus
-				XBEE_DEBUG(Serial.println(F("****** Receive of frame not TX status")));
-				flush_spi();
-				return false;
-			}
-			if (buf[0] != next_atid) {
-				// ATID mismatch
-				// Very weird - clean out the SPI bus
-				XBEE_DEBUG(Serial.println(F("****** Receive of frame, ATID mismatch")));
-				flush_spi();
-				return false;
-			}
-			if (buf[1] != 0x00) {
-				// Transmission operation success, but failed to transmit
-				XBEE_DEBUG(Serial.print(F("****** TX Failure, code=")));
-				XBEE_DEBUG(Serial.println(buf[1], HEX));
-				return false;
+		buf = arena_borrow(XBEE_BUFSIZE, XBEE_PATH_TRANSMIT);
+		if (!buf) return false;
+	}
+	bool ok = tx_ip(ip, addr, segs, count, frame_id, useAppService);
+	if (ok && confirm) ok = tx_confirm(frame_id, buf);
+	arena_return(buf);
+	if (ok) XBEE_DEBUG(Serial.println(F("Frame sent successfully")));
+	return ok;
+}
+
+// Wait for the TX status of a confirmed transmission, using buf (XBEE_BUFSIZE) to receive it
+// Returns true if the status was received and reports success
+bool XbeeWifi::tx_confirm(uint8_t frame_id, uint8_t *buf)
+{
+	uint8_t type;
+	unsigned int len;
+
+	// Attempt to receive a frame - use a long timeout for ATN (1 minute)
+	// Status for any asynchronous transmissions is consumed by rx_frame along the way
+	if (rx_frame(&type, &len, buf, XBEE_BUFSIZE, 60000L) != RX_SUCCESS) {
+		// ATN Timeout or structural problem with received frame
+		XBEE_DEBUG(Serial.println(F("****** RX TX Status frame failed RX")));
+		flush_spi();
+		return false;
+	}
+	if (type != XBEE_API_FRAME_TX_STATUS) {
+		// Did not get the expected frame back
+		// Probably not the best idea, but clean out the SPI bus
+		XBEE_DEBUG(Serial.println(F("****** Receive of frame not TX status")));
+		flush_spi();
+		return false;
+	}
+	if (buf[0] != frame_id) {
+		// ATID mismatch
+		// Very weird - clean out the SPI bus
+		XBEE_DEBUG(Serial.println(F("****** Receive of frame, ATID mismatch")));
+		flush_spi();
+		return false;
+	}
+	if (buf[1] != XBEE_TX_STATUS_SUCCESS) {
+		// Transmission operation success, but failed to transmit
+		XBEE_TRACE(XBEE_TRACE_TX_STATUS, frame_id, 0, buf[1]);
+		return false;
+	}
+	XBEE_TRACE(XBEE_TRACE_TX_STATUS, frame_id, 0, buf[1]);
+	return true;
+}
+
+#ifndef XBEE_OMIT_TX_ASYNC
+// Transmit without waiting for confirmation
+// The frame id is recorded in the pending table and the outcome is reported through
+// the TX status callback once process() (or any other receive) picks up the TX status frame
+uint8_t XbeeWifi::transmit_async(const uint8_t *ip, s_txoptions *addr, uint8_t *data, int len, bool useAppService)
+{
+	// Find a free pending slot, we need one to track the outcome
+	int slot;
+	for (slot = 0; slot < XBEE_TX_PENDING; slot++) {
+		if (tx_pending_id[slot] == 0) break;
+	}
+	if (slot == XBEE_TX_PENDING) {
+		XBEE_DEBUG(Serial.println(F("****** Async TX Reject - pending table full")));
+		return 0;
+	}
+
+	uint8_t frame_id = next_frame_id();
+	s_txsegment seg = { data, len, false };
+	if (!tx_ip(ip, addr, &seg, 1, frame_id, useAppService)) return 0;
+
+	tx_pending_id[slot] = frame_id;
+	tx_pending_time[slot] = millis();
+	tx_pending_count++;
+	return frame_id;
+}
+
+// Number of asynchronous transmissions awaiting status
+uint8_t XbeeWifi::tx_pending()
+{
+	return tx_pending_count;
+}
+
+// Register a callback for asynchronous transmission status
+void XbeeWifi::register_tx_status_callback(void (*func)(uint8_t, uint8_t))
+{
+	tx_status_func = func;
+}
+
+// Match an incoming TX status against the pending table
+// Returns true if it belonged to an asynchronous transmission (and has been reported)
+bool XbeeWifi::tx_status_resolve(uint8_t frame_id, uint8_t status)
+{
+	if (tx_pending_count == 0 || frame_id == 0) return false;
+	for (int slot = 0; slot < XBEE_TX_PENDING; slot++) {
+		if (tx_pending_id[slot] == frame_id) {
+			XBEE_TRACE(XBEE_TRACE_TX_STATUS, frame_id, 0, status);
+			tx_pending_id[slot] = 0;
+			tx_pending_count--;
+			if (tx_status_func) {
+				callback_depth++;
+				tx_status_func(frame_id, status);
+				callback_depth--;
 			}
-		} else {
-			// ATN Timeout or structural problem with received frame
-			XBEE_DEBUG(Serial.println(F("****** RX TX Status frame failed RX")));
-			flush_spi();
-			return false;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Report any pending transmissions for which no status has arrived in time
+void XbeeWifi::tx_status_expire()
+{
+	if (tx_pending_count == 0) return;
+	unsigned long now = millis();
+	for (int slot = 0; slot < XBEE_TX_PENDING; slot++) {
+		if (tx_pending_id[slot] != 0 && now - tx_pending_time[slot] >= XBEE_TX_STATUS_TIMEOUT_MS) {
+			XBEE_DEBUG(Serial.println(F("****** Async TX status timeout")));
+			tx_status_resolve(tx_pending_id[slot], XBEE_TX_STATUS_TIMEOUT);
+		}
+	}
+}
+#endif
+
+#ifndef XBEE_OMIT_TX_QUEUE
+// Queue data to be merged with other data for the same destination
+bool XbeeWifi::transmit_queued(const uint8_t *ip, s_txoptions *addr, const uint8_t *data, int len)
+{
+	if (len <= 0 || !addr) return false;
+	int limit = tx_queue_limit();
+
+	// Find the destination's queue, or a free slot for it
+	s_txqueue *q = NULL;
+	s_txqueue *free_q = NULL;
+	s_txqueue *oldest = NULL;
+	for (int slot = 0; slot < XBEE_TX_QUEUES; slot++) {
+		s_txqueue *t = &tx_queues[slot];
+		if (t->len == 0) {
+			if (!free_q) free_q = t;
+			continue;
+		}
+		if (!memcmp(t->ip, ip, 4) && t->addr.dest_port == addr->dest_port && t->addr.source_port == addr->source_port
+				&& t->addr.protocol == addr->protocol && t->addr.leave_open == addr->leave_open) {
+			q = t;
+			break;
+		}
+		if (!oldest || (long) (t->first_ms - oldest->first_ms) < 0) oldest = t;
+	}
+
+	bool ok = true;
+
+	// Sending the queue first keeps the data in order, whether or not this data is queued
+	if (q && q->len + len > limit) {
+		ok = tx_queue_send(q);
+		free_q = q;
+		q = NULL;
+	}
+
+	// Too large to merge with anything, send it straight away
+	if (len > limit) {
+		s_txsegment seg = { data, len, false };
+		return transmitv(ip, addr, &seg, 1, false) && ok;
+	}
+
+	if (!q) {
+		// New destination. If every slot is taken, the longest waiting queue makes room
+		if (!free_q) {
+			ok = tx_queue_send(oldest) && ok;
+			free_q = oldest;
+		}
+		q = free_q;
+		memcpy(q->ip, ip, 4);
+		q->addr = *addr;
+		q->first_ms = millis();
+		tx_queue_count++;
+	}
+	memcpy(q->data + q->len, data, len);
+	q->len += len;
+
+	// Send now if nothing more would fit
+	if (q->len >= limit) ok = tx_queue_send(q) && ok;
+	return ok;
+}
+
+// Send all queued data
+bool XbeeWifi::flush_queued()
+{
+	bool ok = true;
+	for (int slot = 0; slot < XBEE_TX_QUEUES && tx_queue_count > 0; slot++) {
+		if (tx_queues[slot].len > 0) ok = tx_queue_send(&tx_queues[slot]) && ok;
+	}
+	return ok;
+}
+
+// Set the limits for merging
+void XbeeWifi::set_tx_queue_limits(int max_bytes, unsigned long max_age_ms)
+{
+	tx_queue_max = max_bytes;
+	tx_queue_age = max_age_ms;
+}
+
+// The largest frame that queued data is merged into
+// Without an explicit limit this is the module's maximum RF payload (NP)
+int XbeeWifi::tx_queue_limit()
+{
+	int limit = tx_queue_max > 0 ? tx_queue_max : rf_payload_limit();
+	if (limit > XBEE_TX_QUEUE_BUFSIZE) limit = XBEE_TX_QUEUE_BUFSIZE;
+	return limit;
+}
+
+// Send a destination's queue as one frame and free the slot
+bool XbeeWifi::tx_queue_send(s_txqueue *q)
+{
+	s_txsegment seg = { q->data, q->len, false };
+	q->len = 0;
+	tx_queue_count--;
+	return transmitv(q->ip, &q->addr, &seg, 1, false);
+}
+
+// Send queues whose oldest data has waited the maximum age
+void XbeeWifi::tx_queue_expire()
+{
+	unsigned long now = millis();
+	for (int slot = 0; slot < XBEE_TX_QUEUES; slot++) {
+		if (tx_queues[slot].len > 0 && now - tx_queues[slot].first_ms >= tx_queue_age) {
+			tx_queue_send(&tx_queues[slot]);
 		}
 	}
+}
+#endif
+
+#ifndef XBEE_OMIT_FRAGMENTS
+// Transmit a datagram as fragments small enough for the module
+// Each fragment is sent from the caller's data with its header as a separate segment
+bool XbeeWifi::transmit_fragmented(const uint8_t *ip, s_txoptions *addr, const uint8_t *data, int len, bool confirm)
+{
+	if (len <= 0 || !addr) return false;
+	int chunk = rf_payload_limit() - XBEE_FRAG_HDRLEN;
+	if (chunk <= 0) {
+		XBEE_DEBUG(Serial.println(F("****** Maximum payload too small for fragments")));
+		return false;
+	}
+	int count = (len + chunk - 1) / chunk;
+	if (count > XBEE_FRAG_MAX) {
+		XBEE_DEBUG(Serial.println(F("****** Datagram needs too many fragments")));
+		return false;
+	}
 
-	XBEE_DEBUG(Serial.println(F("Frame sent successfully")));
+	uint8_t id = ++frag_tx_id;
+	for (int index = 0; index < count; index++) {
+		int offset = index * chunk;
+		int n = len - offset < chunk ? len - offset : chunk;
+		uint8_t hdr[XBEE_FRAG_HDRLEN];
+		hdr[0] = XBEE_FRAG_MAGIC;
+		hdr[1] = id;
+		hdr[2] = index;
+		hdr[3] = count;
+		hdr[4] = offset >> 8;
+		hdr[5] = offset & 0xFF;
+		hdr[6] = len >> 8;
+		hdr[7] = len & 0xFF;
+		s_txsegment segs[2] = { { hdr, XBEE_FRAG_HDRLEN, false }, { data + offset, n, false } };
+		if (!transmitv(ip, addr, segs, 2, confirm)) return false;
+	}
 	return true;
 }
+#endif
+
+// Read the module's maximum RF payload (NP) while initializing, so that the transmit paths
+// sizing frames by it never have to wait on the module. If it can't be read
+// XBEE_RF_PAYLOAD_DEFAULT is assumed
+void XbeeWifi::read_rf_payload()
+{
+#ifndef XBEE_OMIT_LOCAL_AT
+	uint8_t np[2];
+	int nplen;
+	if (at_query(XBEE_AT_ADDR_MAX_RF_PAYLOAD_BYTES, np, &nplen, sizeof(np)) && nplen == 2) {
+		rf_payload = (np[0] << 8) | np[1];
+	}
+#endif
+}
+
+// The module's maximum RF payload, as read by init
+int XbeeWifi::rf_payload_limit()
+{
+	return rf_payload > 0 ? rf_payload : XBEE_RF_PAYLOAD_DEFAULT;
+}
+
+// Allocate the next frame id for a frame that expects a response
+// Zero is never used (it means no response) and neither is any id still
+// awaiting a response for an asynchronous operation
+uint8_t XbeeWifi::next_frame_id()
+{
+	bool in_use;
+	do {
+		next_atid++;
+		if (next_atid == 0) next_atid++;
+		in_use = false;
+#ifndef XBEE_OMIT_TX_ASYNC
+		for (int slot = 0; slot < XBEE_TX_PENDING; slot++) {
+			if (tx_pending_id[slot] == next_atid) in_use = true;
+		}
+#endif
+#ifndef XBEE_OMIT_AT_ASYNC
+		for (int slot = 0; slot < XBEE_AT_PENDING; slot++) {
+			if (at_requests[slot].frame_id == next_atid) in_use = true;
+		}
+#endif
+	} while (in_use);
+	return next_atid;
+}
 
 // Initiate active scan
 // Note that network reset will occur meaning association to any AP will be lost
@@ -1168,21 +3277,32 @@ void XbeeWifi::handleActiveScan(uint8_t *buf, int len)
 void XbeeWifi::dispatch(uint8_t *data, int len, s_rxinfo *info)
 {
 	XBEE_DEBUG(Serial.println(F("Non buffered dispatch")));
-	if (ip_data_func) {
+	void (*func)(uint8_t *, int, s_rxinfo *) = ip_data_func;
+#ifndef XBEE_OMIT_RX_ROUTES
+	if (rx_route_func) func = rx_route_func;
+#endif
+	if (func) {
 		callback_depth++;
-		ip_data_func(data, len, info);
+		func(data, len, info);
 		callback_depth--;
 	}
 }
 
 #ifndef XBEE_OMIT_RX_DATA
 // Constructor for buffered XbeeWifi object
-XbeeWifiBuffered::XbeeWifiBuffered(uint16_t bufsize) :
+XbeeWifiBuffered::XbeeWifiBuffered(uint16_t bufsize, bool packets, uint8_t *arena, int arena_size) :
+	XbeeWifi(arena, arena_size),
 	bufsize(bufsize),
 	head(0),
 	tail(0),
 	size(0),
-	buffer_overrun(false)
+	buffer_overrun(false),
+	packet_mode(packets),
+	packets(0),
+	pkt_active(false),
+	pkt_start(0),
+	pkt_len(0),
+	pkt_read(0)
 {
 	// Allocate memory to the buffer
 	buffer = (uint8_t *) malloc(bufsize);
@@ -1205,40 +3325,90 @@ void XbeeWifiBuffered::dispatch(uint8_t *data, int len, s_rxinfo *info)
 	XBEE_DEBUG(Serial.print(len, DEC));
 	XBEE_DEBUG(Serial.println(F(" bytes to FIFO queue")));
 
-	// For each incoming byte
-	for (int i = 0 ; i < len; i ++) {
-		// Make sure we have space
-		if (size == bufsize) {
-			// Oops, out of space. Remainder is dropped. Make sure overrun condition is flagged
-			XBEE_DEBUG(Serial.println(F("FIFO overrun")));
-			buffer_overrun = true;
-			break;
-		} else {
-			// Add to head of buffer
-			buffer[head++] = data[i];
-			if (head == bufsize) head = 0;
-			size++;
+	if (packet_mode) {
+		// The first segment of a packet reserves room for its record and all of its data
+		// If that isn't available the whole packet is dropped
+		// A packet still being received when the next one starts is abandoned, and the room
+		// reserved for it is given back
+		if (info->current_offset == 0) {
+			if (pkt_active) head = pkt_start;
+			pkt_active = false;
+			if ((uint32_t) size + sizeof(s_pktinfo) + info->total_packet_length > bufsize) {
+				XBEE_STAT(counters.buffer_overruns++);
+				XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_RX_IPV4, info->total_packet_length, XBEE_TRACE_FAIL_NO_BUFFER);
+				buffer_overrun = true;
+				return;
+			}
+			pkt_active = true;
+			pkt_start = head;
+			pkt_len = 0;
+			head = (head + sizeof(s_pktinfo)) % bufsize;
+		}
+
+		// Segments of a dropped (or flushed) packet are ignored
+		// A segment running past the declared length abandons the packet
+		if (!pkt_active || pkt_len + len > info->total_packet_length) {
+			if (pkt_active) head = pkt_start;
+			pkt_active = false;
+			return;
 		}
+		head = ring_put(head, data, len);
+		pkt_len += len;
+
+		// Once the packet is complete, its record is written and the packet becomes readable
+		if (info->final) {
+			s_pktinfo pkt;
+			memcpy(pkt.source_addr, info->source_addr, 4);
+			pkt.source_port = info->source_port;
+			pkt.dest_port = info->dest_port;
+			pkt.protocol = info->protocol;
+			pkt.length = pkt_len;
+			pkt.checksum_error = info->checksum_error;
+			ring_put(pkt_start, (uint8_t *) &pkt, sizeof(pkt));
+			size += sizeof(pkt) + pkt_len;
+			packets++;
+			pkt_active = false;
+		}
+		return;
+	}
+
+	// Take as much as there is space for. Remainder is dropped and the overrun condition flagged
+	int space = bufsize - size;
+	if (len > space) {
+		XBEE_STAT(counters.buffer_overruns++);
+		XBEE_TRACE(XBEE_TRACE_RX_FAIL, XBEE_API_FRAME_RX_IPV4, len, XBEE_TRACE_FAIL_NO_BUFFER);
+		buffer_overrun = true;
+		len = space;
 	}
+	head = ring_put(head, data, len);
+	size += len;
 }
 
-// Returns true if we have bytes available to read
-bool XbeeWifiBuffered::available()
+// Returns the number of bytes available to read
+// In packet mode, only the bytes left in the next packet are counted
+int XbeeWifiBuffered::available()
 {
+	if (packet_mode) return pkt_remaining(true);
 	if (size == 0) process();
-	return (size > 0);
+	return size;
 }
 
 // Returns the next character but does not remove it from the buffer
-// Always returns 0 if nothing available (but of course might return 0 if 0 is in the buffer too)
-uint8_t XbeeWifiBuffered::peek()
+// Returns -1 if nothing is available
+int XbeeWifiBuffered::peek()
 {
+	// In packet mode, the next byte of the next packet
+	if (packet_mode) {
+		if (pkt_remaining(false) == 0) return -1;
+		return buffer[(tail + sizeof(s_pktinfo) + pkt_read) % bufsize];
+	}
+
 	// If we have nothing in the buffer, it's time to process the SPI bus
 	if (size == 0) process(false);
 
 	if (size == 0) {
-		// Still nothing, return 0
-		return 0;
+		// Still nothing
+		return -1;
 	} else {
 		// Return tail of buffer
 		return buffer[tail];
@@ -1246,24 +3416,47 @@ uint8_t XbeeWifiBuffered::peek()
 }
 
 // Returns the next character from the buffer
-// Returns 0 if nothing available (same caveat as for peek)
-uint8_t XbeeWifiBuffered::read()
+// Returns -1 if nothing is available
+int XbeeWifiBuffered::read()
+{
+	uint8_t data;
+	return read(&data, 1) == 1 ? data : -1;
+}
+
+// Reads up to len characters from the buffer into buf
+// Returns the number read, the copy is made in at most two pieces around the wrap point
+// In packet mode a read stops at the end of the packet, which is removed once all read
+int XbeeWifiBuffered::read(uint8_t *buf, int len)
 {
+	if (len <= 0) return 0;
+	if (packet_mode) {
+		int left = pkt_remaining(false);
+		if (left == 0) return 0;
+		if (len > left) len = left;
+		ring_get((tail + sizeof(s_pktinfo) + pkt_read) % bufsize, buf, len);
+		pkt_read += len;
+		if (len == left) pkt_pop();
+		return len;
+	}
+
 	// If we have nothing in the buffer, it's time to process the SPI bus
 	if (size == 0) process(false);
 
-	if (size == 0) {
-		// Still nothing, return 0
-		return 0;
-	} else {
-		// Grab the buffer tail and advance / wrap the tail pointer
-		uint8_t data = buffer[tail++];
-		if (tail == bufsize) tail = 0;
+	if (len > size) len = size;
+	tail = ring_get(tail, buf, len);
+	size -= len;
+	return len;
+}
 
-		// Decrement the size since we just removed a byte and return the byte
-		size--;
-		return data;
-	}
+// Stream output is not supported, the buffer only holds incoming data
+size_t XbeeWifiBuffered::write(uint8_t c)
+{
+	return 0;
+}
+
+size_t XbeeWifiBuffered::write(const uint8_t *buf, size_t len)
+{
+	return 0;
 }
 
 // Returns true if we overran the buffer
@@ -1280,6 +3473,95 @@ bool XbeeWifiBuffered::overran(bool reset)
 void XbeeWifiBuffered::flush()
 {
 	head = tail = size = 0;
+	packets = 0;
+	pkt_active = false;
+	pkt_read = 0;
+}
+
+// Copy len bytes into the buffer at pos, in at most two pieces either side of the wrap
+uint16_t XbeeWifiBuffered::ring_put(uint16_t pos, const uint8_t *data, uint16_t len)
+{
+	uint16_t first = bufsize - pos;
+	if (first > len) first = len;
+	memcpy(buffer + pos, data, first);
+	memcpy(buffer, data + first, len - first);
+	pos += len;
+	if (pos >= bufsize) pos -= bufsize;
+	return pos;
+}
+
+// Copy len bytes out of the buffer at pos (data may be NULL to skip them)
+uint16_t XbeeWifiBuffered::ring_get(uint16_t pos, uint8_t *data, uint16_t len)
+{
+	if (data) {
+		uint16_t first = bufsize - pos;
+		if (first > len) first = len;
+		memcpy(data, buffer + pos, first);
+		memcpy(data + first, buffer, len - first);
+	}
+	pos += len;
+	if (pos >= bufsize) pos -= bufsize;
+	return pos;
+}
+
+// Returns the bytes left to read in the next packet, removing any that have none (packet mode)
+uint16_t XbeeWifiBuffered::pkt_remaining(bool drain)
+{
+	if (packets == 0) process(drain);
+	while (packets > 0) {
+		s_pktinfo pkt;
+		ring_get(tail, (uint8_t *) &pkt, sizeof(pkt));
+		if (pkt.length > pkt_read) return pkt.length - pkt_read;
+		pkt_pop();
+	}
+	return 0;
+}
+
+// Removes the packet at the tail of the buffer (packet mode)
+void XbeeWifiBuffered::pkt_pop()
+{
+	s_pktinfo pkt;
+	tail = ring_get(tail, (uint8_t *) &pkt, sizeof(pkt));
+	tail = ring_get(tail, NULL, pkt.length);
+	size -= sizeof(pkt) + pkt.length;
+	packets--;
+	pkt_read = 0;
+}
+
+// Returns the number of whole packets held (packet mode)
+uint16_t XbeeWifiBuffered::packetsAvailable()
+{
+	if (packets == 0) process();
+	return packets;
+}
+
+// Returns the details of the next packet without removing it (packet mode)
+bool XbeeWifiBuffered::peekPacketInfo(s_pktinfo *info)
+{
+	if (!packet_mode) return false;
+	if (packets == 0) process(false);
+	if (packets == 0) return false;
+	ring_get(tail, (uint8_t *) info, sizeof(s_pktinfo));
+	return true;
+}
+
+// Removes the next packet, copying as much of its data as fits in buf (packet mode)
+int XbeeWifiBuffered::readPacket(uint8_t *buf, int maxlen, s_pktinfo *info)
+{
+	if (!packet_mode) return -1;
+	if (packets == 0) process(false);
+	if (packets == 0) return -1;
+
+	// Data already taken by read() is not returned again
+	s_pktinfo pkt;
+	ring_get(tail, (uint8_t *) &pkt, sizeof(pkt));
+	int copy = pkt.length - pkt_read;
+	if (copy > maxlen) copy = maxlen;
+	if (copy < 0) copy = 0;
+	ring_get((tail + sizeof(pkt) + pkt_read) % bufsize, buf, copy);
+	pkt_pop();
+	if (info) *info = pkt;
+	return copy;
 }
 	
 
@@ -50,13 +50,17 @@
  */
 #ifndef __XBEEWIFI_H
 #define __XBEEWIFI_H
-#include <Arduino.h>
 
 // Set up a macro depending on architecture
-#ifdef __SAM3X8E__
+// Define XBEE_HOST to build on a desktop machine against a simulated module (see xbee_host.h)
+#if defined(XBEE_HOST)
+#include "xbee_host.h"
+#elif defined(__SAM3X8E__)
+#include <Arduino.h>
 #define ARCH_SAM
 #include "xbee_sam.h"
 #else
+#include <Arduino.h>
 #define ARCH_ATMEGA
 #include "xbee_atmega.h"
 #endif
@@ -75,9 +79,78 @@
 // If you won't be using remote data sampling, uncomment XBEE_OMIT_SAMPLE
 // #define XBEE_OMIT_RX_SAMPLE
 
+// If you won't be keeping IO sample history per source (enable_sample_store), uncomment XBEE_OMIT_SAMPLE_STORE
+// #define XBEE_OMIT_SAMPLE_STORE
+
 // If you want to omit support for Xbee compatability mode, uncomment XBEE_OMIT_COMPAT_MODE
 // #define XBEE_OMIT_COMPAT_MODE
 
+// If you won't be using non-blocking transmission (transmit_async), uncomment XBEE_OMIT_TX_ASYNC
+// #define XBEE_OMIT_TX_ASYNC
+
+// If you won't be merging small transmissions into shared frames (transmit_queued), uncomment XBEE_OMIT_TX_QUEUE
+// #define XBEE_OMIT_TX_QUEUE
+
+// If you won't be sending or reassembling fragmented datagrams (transmit_fragmented), uncomment XBEE_OMIT_FRAGMENTS
+// #define XBEE_OMIT_FRAGMENTS
+
+// If you won't be using non-blocking AT commands (at_xxx_async), uncomment XBEE_OMIT_AT_ASYNC
+// #define XBEE_OMIT_AT_ASYNC
+
+// If you don't want at_query to answer the read-mostly parameters (SH, SL, MY, NP, VR, HV, DD)
+// from a copy kept in RAM, uncomment XBEE_OMIT_AT_CACHE
+// #define XBEE_OMIT_AT_CACHE
+
+// If you won't be using the ATN interrupt mode (enable_atn_interrupt), uncomment XBEE_OMIT_ATN_INTERRUPT
+// #define XBEE_OMIT_ATN_INTERRUPT
+
+// To measure peak use of the working buffer arena and of the stack on each call path
+// (get_memstats), uncomment XBEE_ENABLE_MEMSTATS
+// #define XBEE_ENABLE_MEMSTATS
+
+// To count frames, bytes, errors and time spent waiting on the module (get_stats),
+// uncomment XBEE_ENABLE_STATS
+// #define XBEE_ENABLE_STATS
+
+// To record a binary trace of frames and failures into a ring in RAM (dump_trace), uncomment
+// XBEE_ENABLE_TRACE. Unlike XBEE_ENABLE_DEBUG this prints nothing as it goes, each event costs
+// a few stores and a call to micros(), so it may be left on to catch problems in the field
+// The events it records (frames, failures, flushes, ATN timeouts) are not printed by
+// XBEE_ENABLE_DEBUG, which is left for the rest, such as setup, AT commands and rejected calls
+// #define XBEE_ENABLE_TRACE
+
+// If you won't be using per port / per peer IP data handlers, uncomment XBEE_OMIT_RX_ROUTES
+// #define XBEE_OMIT_RX_ROUTES
+
+// If you won't be receiving whole packets into a pool of blocks (enable_rx_pool), uncomment XBEE_OMIT_RX_POOL
+// #define XBEE_OMIT_RX_POOL
+
+// Handlers and the pool are only meaningful when IP data is received at all
+#if defined(XBEE_OMIT_RX_DATA) && !defined(XBEE_OMIT_RX_ROUTES)
+#define XBEE_OMIT_RX_ROUTES
+#endif
+#if defined(XBEE_OMIT_RX_DATA) && !defined(XBEE_OMIT_RX_POOL)
+#define XBEE_OMIT_RX_POOL
+#endif
+
+// The sample store is fed by sample reception
+#if defined(XBEE_OMIT_RX_SAMPLE) && !defined(XBEE_OMIT_SAMPLE_STORE)
+#define XBEE_OMIT_SAMPLE_STORE
+#endif
+
+// The parameter cache serves at_query only
+#if defined(XBEE_OMIT_LOCAL_AT) && !defined(XBEE_OMIT_AT_CACHE)
+#define XBEE_OMIT_AT_CACHE
+#endif
+
+// Most blocks an rx pool may have
+#define XBEE_RX_POOL_MAX 16
+
+// Parameters held by the AT parameter cache, and the longest value it keeps
+// A longer value is always read from the module
+#define XBEE_AT_CACHE_PARAMS 7
+#define XBEE_AT_CACHE_PARMLEN 4
+
 // Definitions of the various API frame types
 #define XBEE_API_FRAME_TX64			0x00
 #define XBEE_API_FRAME_REMOTE_CMD_REQ		0x07
@@ -107,6 +180,51 @@
 #define XBEE_MODEM_STATUS_INVALID_CHANNEL	0x8A
 #define XBEE_MODEM_STATUS_FAILED_TO_JOIN	0x8E
 
+// TX status (delivery status) values reported for transmissions
+#define XBEE_TX_STATUS_SUCCESS			0x00
+#define XBEE_TX_STATUS_NO_ACK			0x01
+#define XBEE_TX_STATUS_PURGED			0x03
+#define XBEE_TX_STATUS_PHYSICAL_ERROR		0x04
+#define XBEE_TX_STATUS_NO_BUFFERS		0x18
+#define XBEE_TX_STATUS_NETWORK_ACK_FAILURE	0x21
+#define XBEE_TX_STATUS_NOT_JOINED		0x22
+#define XBEE_TX_STATUS_INVALID_FRAME		0x2C
+#define XBEE_TX_STATUS_INTERNAL_ERROR		0x31
+#define XBEE_TX_STATUS_RESOURCE_ERROR		0x32
+#define XBEE_TX_STATUS_MESSAGE_TOO_LONG		0x74
+#define XBEE_TX_STATUS_SOCKET_CLOSED		0x75
+#define XBEE_TX_STATUS_SOCKET_FAILED		0x76
+// Not sent by the Xbee, reported by this library when no status arrives in time
+#define XBEE_TX_STATUS_TIMEOUT			0xFF
+
+// How long an asynchronous transmission waits for its TX status (millisecs)
+#define XBEE_TX_STATUS_TIMEOUT_MS		60000L
+
+// Default for how long queued transmissions (transmit_queued) wait to be merged (millisecs)
+#define XBEE_TX_QUEUE_AGE_MS			50
+
+// Maximum RF payload assumed when the module's NP value can't be read
+#define XBEE_RF_PAYLOAD_DEFAULT			1400
+
+// Fragmented datagrams (transmit_fragmented). Each fragment starts with a header of
+// magic, datagram id, fragment index, fragment count, offset (MSB, LSB) and total length (MSB, LSB)
+#define XBEE_FRAG_MAGIC				0xF7
+#define XBEE_FRAG_HDRLEN			8
+#define XBEE_FRAG_MAX				32	// Fragments per datagram
+#define XBEE_FRAG_TIMEOUT_MS			2000L	// Default time allowed to reassemble a datagram
+
+// AT command status values reported for AT commands
+#define XBEE_AT_STATUS_OK			0x00
+#define XBEE_AT_STATUS_ERROR			0x01
+#define XBEE_AT_STATUS_INVALID_COMMAND		0x02
+#define XBEE_AT_STATUS_INVALID_PARAMETER	0x03
+#define XBEE_AT_STATUS_TX_FAILURE		0x04	// Remote commands only
+// Not sent by the Xbee, reported by this library when no response arrives in time
+#define XBEE_AT_STATUS_TIMEOUT			0xFF
+
+// How long an asynchronous AT command waits for its response by default (millisecs)
+#define XBEE_AT_TIMEOUT_MS			5000L
+
 // Definitions of AT commands for addressing
 #define XBEE_AT_ADDR_DEST_ADDR			"DL"
 #define XBEE_AT_ADDR_IPADDR			"MY"
@@ -325,6 +443,17 @@ typedef struct {
 	bool checksum_error;		// Checksum indication flag
 } s_rxinfo;
 
+// This structure describes a whole packet held by XbeeWifiBuffered in packet mode
+// A copy is stored in the buffer ahead of each packet's data
+typedef struct {
+	uint8_t source_addr[4];		// Address from which the packet originated
+	uint16_t source_port;		// Port from which the packet originated
+	uint16_t dest_port;		// Port on which the packet arrived (0xBEE for app service)
+	uint8_t protocol;		// XBEE_NET_IPPROTO_UDP / TCP
+	uint16_t length;		// Length of the packet data
+	bool checksum_error;		// Checksum indication flag
+} s_pktinfo;
+
 // Note that due to buffer size restrictions, an incoming data packet (of up to 1400 bytes length)
 // will be delivered in multiple calls to the ip data reception callback
 // The sequence number will be the same for all calls for a given packet and then incremented
@@ -332,6 +461,178 @@ typedef struct {
 // A checksum error will only be flagged (true) on the last given call for a packet / sequence
 
 
+// This structure holds a per port / per peer IP data handler registration
+// It is internal to the library
+typedef struct {
+	uint16_t dest_port;		// Local port, 0 matches any
+	uint8_t source_addr[4];		// Peer address, 0.0.0.0 matches any
+	uint16_t source_port;		// Peer port, 0 matches any
+	void (*func)(uint8_t *, int, s_rxinfo *);	// Handler, NULL when this slot is free
+} s_rxroute;
+
+// Call paths that borrow working buffers from the arena, for get_memstats
+#define XBEE_PATH_PROCESS			0
+#define XBEE_PATH_RX_IP				1
+#define XBEE_PATH_AT				2
+#define XBEE_PATH_TRANSMIT			3
+#define XBEE_PATH_INIT				4
+#define XBEE_PATHS				5
+
+// This structure reports memory use on one call path, see get_memstats
+typedef struct {
+	uint16_t arena_peak;		// Arena in use (bytes) at the deepest borrow on this path
+	uint16_t stack_peak;		// Stack (bytes) below the outermost borrowing call, at the same point
+	uint16_t borrows;		// Number of buffers borrowed
+	uint16_t failures;		// Number of times the arena was too full to lend a buffer
+} s_memstats;
+
+// This structure reports the memory an XbeeWifi object holds for as long as it exists,
+// see get_memfootprint
+typedef struct {
+	uint16_t object;		// The object itself, with the tables of the features built in
+	uint16_t arena;			// The working buffer arena
+	bool arena_allocated;		// The arena was allocated by the object rather than provided
+} s_memfootprint;
+
+// Classes of frame counted by the statistics, see get_stats
+#define XBEE_STATS_RX_IP			0	// IP data, IPv4 and app service
+#define XBEE_STATS_RX_SAMPLE			1
+#define XBEE_STATS_RX_MODEM_STATUS		2
+#define XBEE_STATS_RX_TX_STATUS			3
+#define XBEE_STATS_RX_AT_RESP			4	// Local and remote
+#define XBEE_STATS_RX_OTHER			5
+#define XBEE_STATS_RX_TYPES			6
+#define XBEE_STATS_TX_IP			0	// IPv4 and app service
+#define XBEE_STATS_TX_AT			1	// Local and remote
+#define XBEE_STATS_TX_TYPES			2
+
+// Trace events, see dump_trace. The meaning of the type, len and result fields of each
+// record is given alongside
+#define XBEE_TRACE_RX_FRAME			0x01	// Frame type, length, -
+#define XBEE_TRACE_RX_FAIL			0x02	// Frame type, length, XBEE_TRACE_FAIL_xxx
+#define XBEE_TRACE_TX_FRAME			0x03	// Frame type, length, frame id
+#define XBEE_TRACE_TX_STATUS			0x04	// Frame id, -, delivery status
+#define XBEE_TRACE_MODEM_STATUS			0x05	// -, -, modem status
+#define XBEE_TRACE_ATN_TIMEOUT			0x06	// -, time waited (millisecs), -
+#define XBEE_TRACE_FLUSH			0x07	// -, bytes discarded, -
+
+// Reasons given by XBEE_TRACE_RX_FAIL records
+#define XBEE_TRACE_FAIL_INVALID_START		0x01	// Type field holds the byte read instead
+#define XBEE_TRACE_FAIL_TRUNCATED		0x02
+#define XBEE_TRACE_FAIL_CHECKSUM		0x03
+#define XBEE_TRACE_FAIL_UNSUPPORTED		0x04
+#define XBEE_TRACE_FAIL_NO_BUFFER		0x05	// No buffer, pool block or XbeeWifiBuffered space
+#define XBEE_TRACE_FAIL_INVALID			0x06	// Too short, or a malformed fragment
+
+// One trace record
+typedef struct {
+	uint32_t time_us;		// micros() when recorded
+	uint16_t len;
+	uint8_t event;			// XBEE_TRACE_xxx
+	uint8_t type;
+	uint8_t result;
+} s_trace;
+
+// This structure reports what the driver has been doing, see get_stats
+typedef struct {
+	uint32_t rx_frames[XBEE_STATS_RX_TYPES];	// Frames received, by class (XBEE_STATS_RX_xxx)
+	uint32_t rx_bytes[XBEE_STATS_RX_TYPES];		// Bytes of those frames, start byte to checksum
+	uint32_t tx_frames[XBEE_STATS_TX_TYPES];	// Frames sent, by class (XBEE_STATS_TX_xxx)
+	uint32_t tx_bytes[XBEE_STATS_TX_TYPES];		// Bytes of those frames, start byte to checksum
+	uint32_t checksum_errors;	// Frames received with a bad checksum
+	uint32_t truncated;		// Frames too long for the buffer receiving them
+	uint32_t invalid_start;		// Frames not beginning with the start byte
+	uint32_t flushed_bytes;		// Bytes discarded to bring the bus back into step
+	uint32_t unsupported;		// Frames of unknown type, discarded
+	uint32_t rx_dropped;		// IP packets dropped: short, no buffer or pool block, bad fragment
+	uint32_t buffer_overruns;	// Packets (or parts) lost to a full XbeeWifiBuffered buffer
+	uint32_t atn_timeouts;		// Waits for a response that ended without ATN
+	uint32_t atn_wait_us;		// Time spent waiting for ATN for a response (microsecs)
+	uint32_t spi_bytes;		// Bytes clocked on the SPI bus
+} s_stats;
+
+// This structure reports how well the AT parameter cache is doing, see get_at_cache_stats
+typedef struct {
+	uint32_t hits;			// Queries answered from the cache
+	uint32_t misses;		// Queries of cached parameters that had to go to the module
+	uint32_t invalidations;		// Times the whole cache was discarded
+} s_atcache_stats;
+
+// One setting of a configuration profile, see apply_profile
+// A numeric setting (len 1, 2 or 4) sends number, most significant byte first, and is compared
+// by value with what the module reports. A string setting (len 0) sends str, without its
+// terminator. Build them with the XBEE_SETTING_xxx macros
+typedef struct {
+	char atxx[3];
+	uint8_t len;
+	uint8_t flags;			// XBEE_SETTING_xxx
+	uint32_t number;
+	const char *str;
+} s_atsetting;
+
+// The setting can't be read back (as PK), so it is only sent along with other changes
+#define XBEE_SETTING_WRITE_ONLY			0x01
+
+#define XBEE_SETTING_BYTE(atxx, value)		{ atxx, 1, 0, (uint32_t) (value), NULL }
+#define XBEE_SETTING_SHORT(atxx, value)		{ atxx, 2, 0, (uint32_t) (value), NULL }
+#define XBEE_SETTING_LONG(atxx, value)		{ atxx, 4, 0, (uint32_t) (value), NULL }
+#define XBEE_SETTING_IP(atxx, a, b, c, d)	{ atxx, 4, 0, ((uint32_t) (a) << 24) | ((uint32_t) (b) << 16) | ((uint32_t) (c) << 8) | (uint32_t) (d), NULL }
+#define XBEE_SETTING_STR(atxx, value)		{ atxx, 0, 0, 0, (value) }
+#define XBEE_SETTING_KEY(atxx, value)		{ atxx, 0, XBEE_SETTING_WRITE_ONLY, 0, (value) }
+
+// Longest string setting apply_profile will compare or send (PK takes up to 64 characters)
+#define XBEE_SETTING_MAXLEN			64
+
+// This structure holds an asynchronous AT command request while it is queued or awaiting
+// its response. It is internal to the library
+typedef struct {
+	uint8_t frame_id;		// Frame id of the request, 0 when this slot is free
+	uint8_t state;			// Queued for transmission or sent
+	char atxx[2];			// AT command
+	uint8_t ip[4];			// Target IP address for remote commands
+	uint8_t flags;			// Remote / apply options
+	uint8_t parmlen;		// Parameter length
+	uint8_t parm[XBEE_AT_ASYNC_PARMLEN];	// Parameter value
+	unsigned long sent;		// Time sent (millis)
+	unsigned long timeout;		// Time to wait for a response (millisecs)
+	void (*func)(uint8_t, uint8_t, uint8_t *, int);	// Completion handler
+	uint16_t node;			// Index in the node list, for a fan-out request
+} s_atrequest;
+
+// This structure holds the progress of a remote AT fan-out (at_remcmd_fanout), or of a
+// remote profile sync (apply_remote_profile) which is run as one. It is internal to the library
+typedef struct {
+	const uint8_t (*ips)[4];	// Node list, 0 nodes when no fan-out is running
+	uint16_t count;			// Nodes in the list
+	uint16_t next;			// Next node to send to
+	uint8_t inflight;		// Requests queued or awaiting a response
+	uint8_t max_inflight;
+	char atxx[2];
+	const uint8_t *parm;		// Parameter value, from the caller
+	uint8_t parmlen;
+	bool apply;
+	unsigned long timeout;
+	void (*func)(int, uint8_t, uint8_t *, int);	// Per node result handler
+	const s_atsetting *settings;	// Profile, for a sync
+	uint8_t setting_count;
+	bool progmem;
+	bool write;
+	bool force;			// Send the write only settings even if nothing differed
+	void (*sync_func)(int, uint8_t, uint32_t);	// Per node drift handler
+} s_atfanout;
+
+// This structure follows one node through a remote profile sync. It is internal to the library
+typedef struct {
+	uint16_t node;			// Index in the node list
+	uint8_t state;			// Step the node is at, 0 when the slot is free
+	uint8_t setting;		// Setting being read or written
+	uint32_t drift;			// Settings found to differ
+	bool resend;			// The request for this step couldn't be queued yet
+} s_atsyncnode;
+
+// Most settings a profile applied to remote nodes may have, one per bit of the drift mask
+#define XBEE_REMOTE_PROFILE_MAX			32
+
 // This structure is used to provide transmission options when transmiting IP data
 typedef struct {
 	uint16_t dest_port;
@@ -340,21 +641,85 @@ typedef struct {
 	bool leave_open;
 } s_txoptions;
 
+// This structure describes one segment of a scatter-gather transmission (transmitv)
+// Set progmem to true where data points into program memory (flash) rather than RAM
+typedef struct {
+	const uint8_t *data;
+	int len;
+	bool progmem;
+} s_txsegment;
+
+// Data queued for one destination by transmit_queued, waiting to be sent as a single frame
+typedef struct {
+	uint8_t ip[4];
+	s_txoptions addr;
+	unsigned long first_ms;		// When the oldest data in the queue was added (millisecs)
+	int len;			// Bytes queued, 0 when the slot is free
+	uint8_t data[XBEE_TX_QUEUE_BUFSIZE];
+} s_txqueue;
+
+// Analog channels an IO sample may carry, one per bit of its analog mask
+#define XBEE_ANALOG_CHANNELS			8
+
 // This packet is used for the sample reception callback to provide sample data
 typedef struct {
 	uint8_t source_addr[4];
 	uint16_t digital_mask;
 	uint8_t analog_mask;
-	uint16_t digital_samples;
-	uint16_t analog_samples;
+	uint16_t digital_samples;	// Digital line states, present where digital_mask is non zero
+	uint16_t analog_samples;	// Reading of the lowest numbered analog channel sampled
+	uint16_t analog[XBEE_ANALOG_CHANNELS];	// Reading of each channel in analog_mask, by channel
 } s_sample;
 
+// Running statistics of an analog channel in the sample store
+// The mean is sum / count
+typedef struct {
+	uint16_t min;
+	uint16_t max;
+	uint32_t sum;
+	uint32_t count;			// Readings taken since the last reset_sample_stats
+} s_channelstats;
+
+// Ring entry of a channel not sampled in the readings it covers
+#define XBEE_SAMPLE_NONE			0xFFFF
+
+// Channel number of the digital lines, for sample_history
+#define XBEE_SAMPLE_DIGITAL			0xFF
+
+// The samples kept for one source in the sample store (enable_sample_store)
+// Each ring entry covers decimation samples, holding the mean of each analog channel and the
+// last digital line states over them. Analog channels beyond XBEE_SAMPLE_CHANNELS aren't kept
+typedef struct {
+	uint8_t ip[4];
+	bool used;			// Entry is allocated to a source
+	uint16_t digital_mask;		// Channels in the latest sample
+	uint8_t analog_mask;
+	unsigned long last_ms;		// When the latest sample arrived (millis)
+	uint32_t samples;		// Samples received from the source
+	uint16_t head;			// Next ring entry to fill
+	uint16_t stored;		// Ring entries filled, at most XBEE_SAMPLE_HISTORY
+	uint16_t pending;		// Samples taken towards the next entry
+	uint16_t pending_digital;	// Latest digital line states towards it
+	bool pending_has_digital;
+	uint16_t pending_count[XBEE_SAMPLE_CHANNELS];
+	uint32_t pending_sum[XBEE_SAMPLE_CHANNELS];
+	uint16_t digital[XBEE_SAMPLE_HISTORY];
+	uint16_t analog[XBEE_SAMPLE_CHANNELS][XBEE_SAMPLE_HISTORY];
+	s_channelstats stats[XBEE_SAMPLE_CHANNELS];
+} s_samplesource;
+
 class XbeeWifi
 {
 	public:
 
 	// Constructor
-	XbeeWifi();
+	// The receive, AT command and transmit paths borrow their working buffers from an arena
+	// of arena_size bytes. Provide it (arena), or leave arena NULL to have it allocated
+	// Reception while an AT command or confirmed transmission is waiting needs
+	// 2 * (XBEE_BUFSIZE + 1) bytes, XBEE_ARENA_SIZE by default. get_memstats shows the
+	// peak actually used
+	XbeeWifi(uint8_t *arena = NULL, int arena_size = XBEE_ARENA_SIZE);
+	~XbeeWifi();
 
 	// Must call before any other functions to initialize the xbee
 	// Provide cs (required), atn (required) pins and reset (optional), dout (optional)
@@ -378,6 +743,29 @@ class XbeeWifi
 	// Provide a buffer (parmval) and it's length (maxlen)
 	// Will return parmlen indicating the number of bytes read back into the buffer
 	bool at_query(const char *atxx, uint8_t *parmval, int *parmlen, int maxlen);
+
+	// Queries of SH, SL, MY, NP, VR, HV and DD are answered from RAM once read
+	// The cache is discarded on a reset, join or IP configuration error modem status, on any
+	// local AT command carrying a parameter (at_cmd_xxx or at_cmd_async) and on AC, WR, FR, NR and RE
+	// clear_at_cache discards it by hand, for changes the library can't see
+#ifndef XBEE_OMIT_AT_CACHE
+	void clear_at_cache();
+
+	// Copy the cache hit / miss counts gathered since the last reset into out
+	void get_at_cache_stats(s_atcache_stats *out);
+	void reset_at_cache_stats();
+#endif
+
+	// Bring the module's configuration into line with a profile of count settings
+	// Each setting is read from the module and only those that differ are sent, as queued AT
+	// commands applied together by a single AC. WR follows (where write is true) only if
+	// something was sent, so an unchanged profile costs one query per setting and no flash write
+	// Write only settings (XBEE_SETTING_KEY) can't be read back, so a change to one can't be
+	// seen. They are sent along with any other change, or always where force is set. Set force
+	// when a key may have changed, otherwise a profile that differs only in its key is not sent
+	// Set progmem where the profile, and any strings it points to, are in program memory
+	// Returns the number of settings sent, or -1 on failure
+	int apply_profile(const s_atsetting *settings, int count, bool progmem = false, bool write = true, bool force = false);
 #endif
 
 	// Equivalent AT set / get methods for targetting a remote device
@@ -393,6 +781,56 @@ class XbeeWifi
 	bool at_remquery(uint8_t *ip, const char *atxx, uint8_t *parmval, int *parmlen, int maxlen);
 #endif
 
+	// Non-blocking equivalents of the AT command and query methods
+	// The request is queued and sent (immediately unless called from within a callback, in
+	// which case it is sent by the next process call). The response is matched to the request
+	// by frame id as process() receives it and passed to the completion handler
+	// Handler should be of the following form:
+	//	void my_handler(uint8_t frame_id, uint8_t status, uint8_t *data, int len)
+	// status is XBEE_AT_STATUS_OK, a failure code, or XBEE_AT_STATUS_TIMEOUT
+	// data / len hold the returned parameter value (valid during the call only)
+	// Returns the frame id of the request, or 0 on failure (XBEE_AT_PENDING requests already
+	// outstanding, or parameter longer than XBEE_AT_ASYNC_PARMLEN)
+	// handler may be NULL if the outcome is not needed
+#ifndef XBEE_OMIT_AT_ASYNC
+	uint8_t at_cmd_async(const char *atxx, const uint8_t *parmval, int parmlen, void (*func)(uint8_t, uint8_t, uint8_t *, int), unsigned long timeout_ms = XBEE_AT_TIMEOUT_MS);
+	uint8_t at_query_async(const char *atxx, void (*func)(uint8_t, uint8_t, uint8_t *, int), unsigned long timeout_ms = XBEE_AT_TIMEOUT_MS);
+	uint8_t at_remcmd_async(uint8_t *ip, const char *atxx, const uint8_t *parmval, int parmlen, bool apply, void (*func)(uint8_t, uint8_t, uint8_t *, int), unsigned long timeout_ms = XBEE_AT_TIMEOUT_MS);
+	uint8_t at_remquery_async(uint8_t *ip, const char *atxx, void (*func)(uint8_t, uint8_t, uint8_t *, int), unsigned long timeout_ms = XBEE_AT_TIMEOUT_MS);
+
+	// Returns the number of asynchronous AT requests queued or awaiting a response
+	uint8_t at_pending();
+
+	// Send the same remote AT command to each of count nodes (a query where parmlen is 0)
+	// Requests go out as the asynchronous ones above, with at most max_inflight outstanding at
+	// once (further limited by the free XBEE_AT_PENDING slots). Each completes on its own
+	// response or timeout, so an unresponsive node holds up only its own slot, and the next
+	// node's request is sent as each completes. ips and parmval must remain valid until the
+	// fan-out is over. Handler should be of the following form:
+	//	void my_handler(int index, uint8_t status, uint8_t *data, int len)
+	// index is the node's position in ips, the rest as for the at_xxx_async handlers
+	// Returns false if a fan-out is already running or the parameter is too long
+	bool at_remcmd_fanout(const uint8_t (*ips)[4], int count, const char *atxx, const uint8_t *parmval, int parmlen, bool apply, void (*func)(int, uint8_t, uint8_t *, int), uint8_t max_inflight = XBEE_AT_PENDING, unsigned long timeout_ms = XBEE_AT_TIMEOUT_MS);
+
+	// Bring a list of remote nodes into line with a profile of setting_count settings (see
+	// apply_profile), several nodes at a time as for at_remcmd_fanout. Each node's settings
+	// are read in turn, and those that differ written without being applied. Only if any
+	// differed, or where force is set (see apply_profile), do the write only settings follow,
+	// then a single AC and (with write) WR
+	// Handler should be of the following form:
+	//	void my_handler(int index, uint8_t status, uint32_t drift)
+	// index is the node's position in ips, status is XBEE_AT_STATUS_OK or the failure of the
+	// request that ended the node's sync, and drift has bit n set where setting n differed
+	// ips and settings must remain valid until the sync is over, and string settings may be no
+	// longer than XBEE_AT_ASYNC_PARMLEN. Progress is reported by at_fanout_pending
+	// Returns false if a fan-out is already running, there are more than
+	// XBEE_REMOTE_PROFILE_MAX settings or a string setting is too long
+	bool apply_remote_profile(const uint8_t (*ips)[4], int count, const s_atsetting *settings, int setting_count, bool progmem, bool write, bool force, void (*func)(int, uint8_t, uint32_t), uint8_t max_inflight = XBEE_AT_PENDING, unsigned long timeout_ms = XBEE_AT_TIMEOUT_MS);
+
+	// Returns the number of nodes of the running fan-out not yet reported, 0 once it is over
+	int at_fanout_pending();
+#endif
+
 	// Provide a reference of the last modem status
 	volatile uint8_t last_status;
 
@@ -405,6 +843,60 @@ class XbeeWifi
 	//	void my_callback(uint8_t *data, int len, s_rxinfo *info)
 #ifndef XBEE_OMIT_RX_DATA
 	void register_ip_data_callback(void (*func)(uint8_t *, int, s_rxinfo *));
+
+	// Register a callback to receive incoming IP data for a given local port and, optionally, peer
+	// Callback is of the same form as for register_ip_data_callback
+	// dest_port selects the local port (0xBEE for the app service), or 0 for any port
+	// source_ip (binary form, may be NULL) and source_port narrow the handler to a single peer
+	// where given, 0 / NULL matching any
+	// Each packet is delivered to the most specific matching handler, or the ip data callback
+	// if none match. Call with func NULL to remove a handler
+	// Returns false if XBEE_RX_ROUTES handlers are already registered
+#ifndef XBEE_OMIT_RX_ROUTES
+	bool register_ip_port_callback(uint16_t dest_port, void (*func)(uint8_t *, int, s_rxinfo *), const uint8_t *source_ip = NULL, uint16_t source_port = 0);
+#endif
+
+	// Register a callback to pull incoming IP data straight from the SPI bus
+	// This avoids the intermediate buffer (and copy) used for the ip data callback
+	// Callback should be of following form:
+	//	void my_callback(s_rxinfo *info)
+	// It is called once per packet with the parsed header, total_packet_length giving the
+	// payload length. Within the callback use rx_read / rx_skip to move the payload into your
+	// own buffer (or past it), and rx_finish to validate the checksum once you are done.
+	// Anything left unread on return is discarded
+	// Takes precedence over the ip data callback when registered, set to NULL to revert
+	void register_ip_stream_callback(void (*func)(s_rxinfo *));
+
+	// For use within the ip stream callback only
+	// Number of payload bytes not yet read
+	int rx_available();
+
+	// Read up to len payload bytes into buf, returns the number read
+	int rx_read(uint8_t *buf, int len);
+
+	// Skip over up to len payload bytes
+	void rx_skip(int len);
+
+	// Discard any unread payload and check the packet checksum
+	// Returns true if the checksum was good
+	bool rx_finish();
+
+	// Receive each IP packet whole into a block from a pool, delivered only once its checksum
+	// has been verified. blocks is count (at most XBEE_RX_POOL_MAX) blocks of blocksize bytes
+	// Callback is of the same form as for register_ip_data_callback, called once per packet
+	// with the block holding the packet. The block then belongs to the application until handed
+	// back with release_rx_block, which may be done within the callback or at any time later
+	// Packets larger than a block, or arriving when no block is free, are dropped
+	// Takes precedence over the ip data, port and stream callbacks. Call with blocks NULL to stop
+#ifndef XBEE_OMIT_RX_POOL
+	void enable_rx_pool(uint8_t *blocks, int blocksize, uint8_t count, void (*func)(uint8_t *, int, s_rxinfo *));
+
+	// Hand a block delivered by the rx pool back to it
+	void release_rx_block(uint8_t *block);
+
+	// Number of blocks free for reception
+	uint8_t rx_pool_free();
+#endif
 #endif
 
 	// Register callback for modem status indications
@@ -426,10 +918,65 @@ class XbeeWifi
 	void register_sample_callback(void (*func)(s_sample *));
 #endif
 
+	// Keep the samples of up to count sources in sources, an array provided by the caller
+	// Each source is given an entry when first heard from. Once all are taken, samples from
+	// further sources are only passed to the sample callback. Every sample updates the running
+	// statistics of its source's channels, and each decimation samples make one ring entry
+	// Call with sources NULL to stop keeping samples
+#ifndef XBEE_OMIT_SAMPLE_STORE
+	void enable_sample_store(s_samplesource *sources, uint8_t count, uint16_t decimation = 1);
+
+	// Find the entry of a source (binary form IP address), NULL if it hasn't been heard from
+	s_samplesource *sample_source(const uint8_t *ip);
+
+	// Copy up to max of the latest ring entries of a channel (0 to XBEE_SAMPLE_CHANNELS - 1, or
+	// XBEE_SAMPLE_DIGITAL) into out, oldest first. Returns the number copied
+	int sample_history(const s_samplesource *source, uint8_t channel, uint16_t *out, int max);
+
+	// Restart the running statistics of a source
+	void reset_sample_stats(s_samplesource *source);
+#endif
+
 	// Call as often as possible to check for inbound data
 	// Will trigger register_ip_data_callback to receive and process any inbound data
 	void process(bool rx_one_packet_only = false);
 
+	// Attach an interrupt to the falling edge of the ATN line (or detach it with enable false)
+	// While attached, process() only services the SPI bus once the module has signalled that
+	// it has frames for us, so calling it when idle costs almost nothing. Between calls the
+	// application may sleep until frames_pending() becomes true
+	// The ATN pin must be interrupt capable. Returns false if it is not
+	// Only one XbeeWifi object may use this mode at a time
+#ifndef XBEE_OMIT_ATN_INTERRUPT
+	bool enable_atn_interrupt(bool enable = true);
+
+	// True when the module has signalled frames that process() has not yet collected
+	// Always true when the ATN interrupt is not enabled
+	bool frames_pending();
+#endif
+
+	// Set the minimum time chip select is held de-asserted between SPI sessions, in microseconds
+	// Defaults to XBEE_SPI_GUARD_US. The wait is only made if a session follows the last one
+	// more closely than this
+	void set_spi_guard(unsigned int us);
+
+	// Set the SPI clock, in Hz. The fastest rate the hardware can make that doesn't exceed hz
+	// is used (on AVR the master clock over 2, 4 .. 128, on the Due over 1 .. 255)
+	// Returns false, leaving the clock unchanged, if hz is below the slowest rate available
+	bool set_spi_clock(unsigned long hz);
+
+	// The SPI clock in use, in Hz
+	unsigned long get_spi_clock();
+
+	// Find the fastest SPI clock that works reliably with this board's wiring
+	// Starting from the current clock, which must be known good, the rate is stepped up as far as
+	// max_hz. At each step trials AT queries are made and their replies compared with one taken at
+	// the starting rate. A query that fails (including on a frame checksum) or replies differently
+	// ends the search. The clock is left at the fastest rate at which every trial passed, which is
+	// returned, or 0 if even the starting rate failed
+	// Call after init and outside of callbacks. Takes a few AT round trips per step
+	unsigned long calibrate_spi_clock(unsigned long max_hz = XBEE_SPI_MAX_HZ, uint8_t trials = 16);
+
 	// Transmit data to an endpoint
 	// ip should be the binary form (uint8_t[4]) IP address
 	// addr should be transmission options indicating port assignments and such. May be null when useAppService is true
@@ -438,6 +985,99 @@ class XbeeWifi
 	// Set useAppService to true to use the compatability mode (64bit) app service to transmit the data to the 0xBEE port
 	bool transmit(const uint8_t *ip, s_txoptions *addr, uint8_t *data, int len, bool confirm = true, bool useAppService = false);
 
+	// Transmit data gathered from a list of segments as a single packet
+	// segs points to count segments which are sent in order, no staging copy is made
+	// Segments may be in RAM or (with progmem set) in program memory
+	// Other parameters as for transmit
+	bool transmitv(const uint8_t *ip, s_txoptions *addr, const s_txsegment *segs, int count, bool confirm = true, bool useAppService = false);
+
+	// Transmit data to an endpoint without waiting for confirmation of delivery
+	// Parameters as for transmit
+	// Returns the frame id of the transmission, or 0 on failure (including when XBEE_TX_PENDING
+	// transmissions are already awaiting their status)
+	// The delivery status is reported to the tx status callback when process() receives it
+	// Several transmissions may be in flight at once
+#ifndef XBEE_OMIT_TX_ASYNC
+	uint8_t transmit_async(const uint8_t *ip, s_txoptions *addr, uint8_t *data, int len, bool useAppService = false);
+
+	// Register a callback for delivery status of transmit_async transmissions
+	// Callback should be of following form:
+	//	void my_callback(uint8_t frame_id, uint8_t status)
+	// status is XBEE_TX_STATUS_SUCCESS, a failure code, or XBEE_TX_STATUS_TIMEOUT
+	void register_tx_status_callback(void (*func)(uint8_t, uint8_t));
+
+	// Returns the number of transmit_async transmissions still awaiting their status
+	uint8_t tx_pending();
+#endif
+
+	// Queue data for transmission, merged with data queued earlier for the same destination
+	// (IP, ports and protocol) into a single frame, sent without confirmation
+	// A destination's queue is sent when the next data would take it over the frame limit, and
+	// once its oldest data has waited the maximum age (checked by process())
+	// The receiver gets the merged data as a single packet, so it must carry its own framing
+	// Data too large to merge is sent straight away, after anything queued for its destination
+	// Returns false if the data could not be queued or a send failed
+#ifndef XBEE_OMIT_TX_QUEUE
+	bool transmit_queued(const uint8_t *ip, s_txoptions *addr, const uint8_t *data, int len);
+
+	// Send everything queued now
+	bool flush_queued();
+
+	// Set the largest merged frame (0 to use the module's maximum payload, NP, read by init)
+	// and how long data may wait to be merged (millisecs)
+	// Frames never exceed XBEE_TX_QUEUE_BUFSIZE
+	void set_tx_queue_limits(int max_bytes, unsigned long max_age_ms = XBEE_TX_QUEUE_AGE_MS);
+#endif
+
+	// Transmit a datagram larger than the module's maximum payload (NP), split into fragments
+	// that are reassembled by a receiver using enable_reassembly. Every fragment, even of a
+	// datagram that would fit in one, carries an XBEE_FRAG_HDRLEN byte header, and a datagram
+	// may have at most XBEE_FRAG_MAX fragments, each also within the maximum payload. With
+	// confirm each fragment is confirmed in turn
+	// Other parameters as for transmit
+#ifndef XBEE_OMIT_FRAGMENTS
+	bool transmit_fragmented(const uint8_t *ip, s_txoptions *addr, const uint8_t *data, int len, bool confirm = true);
+
+	// Reassemble fragmented datagrams arriving on dest_port into buf, which must hold the
+	// largest datagram expected (bufsize). The port is given over to fragments, anything else
+	// arriving on it is dropped. Complete datagrams are passed to func, which takes the same
+	// form as the IP data callback, with total_packet_length the length of the datagram
+	// One datagram is reassembled at a time. It is abandoned if not complete within timeout_ms
+	// of its first fragment, or if a fragment of another datagram arrives
+	// Call with buf NULL to stop reassembly
+#ifndef XBEE_OMIT_RX_DATA
+	void enable_reassembly(uint16_t dest_port, uint8_t *buf, int bufsize, void (*func)(uint8_t *, int, s_rxinfo *), unsigned long timeout_ms = XBEE_FRAG_TIMEOUT_MS);
+#endif
+#endif
+
+	// Report peak memory use for a call path (XBEE_PATH_xxx) since the last reset_memstats
+	// The arena peak shows how far XBEE_ARENA_SIZE could be reduced, the stack peak how
+	// much stack the library itself uses beneath the call
+#ifdef XBEE_ENABLE_MEMSTATS
+	void get_memstats(uint8_t path, s_memstats *stats);
+	void reset_memstats();
+
+	// Report the memory held for the life of the object, as against the peaks above which
+	// are only held during a call. Classes derived from XbeeWifi hold their own on top
+	void get_memfootprint(s_memfootprint *fp);
+#endif
+
+	// Copy the counters gathered since the last reset_stats into out
+	// Without XBEE_ENABLE_STATS no counting is done at all
+#ifdef XBEE_ENABLE_STATS
+	void get_stats(s_stats *out);
+	void reset_stats();
+#endif
+
+	// Write the trace records held, oldest first, to out (Serial for example) as text lines
+	//	XT <time_us> <event> <type> <len> <result>
+	// with each field in hex, for decoding by extras/host/tracedump. Lines that don't begin
+	// "XT " may be mixed in, the decoder skips them. The ring is emptied unless clear is false
+#ifdef XBEE_ENABLE_TRACE
+	void dump_trace(Print &out, bool clear = true);
+	void clear_trace();
+#endif
+
 	// Initiate a network scan
 	// Will cause the registered scan callback to be called with information about APs that are heard
 	// Causes network reset! Connection will be downed and will need to be reconfigured (or xBee reset if appropriate)
@@ -450,36 +1090,116 @@ class XbeeWifi
 	virtual void dispatch(uint8_t *data, int len, s_rxinfo *info);
 #endif
 
+	// Pin access for the chip select and ATN lines on the hot paths
+	// Not virtual, so that they inline into the frame engine. They drive the port registers
+	// looked up by init, or use digitalWrite / digitalRead where there are no ports to access
+#ifndef XBEE_NO_DIRECT_PINS
+	void cs_select(bool select)
+	{
+		if (select) {
+			XBEE_PORT_CLEAR(cs_port, cs_mask);
+		} else {
+			XBEE_PORT_SET(cs_port, cs_mask);
+		}
+	}
+
+	bool atn_asserted()
+	{
+		return !XBEE_PORT_READ(atn_port, atn_mask);
+	}
+#else
+	void cs_select(bool select)
+	{
+		digitalWrite(pin_cs, select ? LOW : HIGH);
+	}
+
+	bool atn_asserted()
+	{
+		return digitalRead(pin_atn) == LOW;
+	}
+#endif
+
+	// Driver statistics
+#ifdef XBEE_ENABLE_STATS
+	s_stats counters;
+#endif
+
+	// Record a trace event, and the ring of the last XBEE_TRACE_RECORDS
+#ifdef XBEE_ENABLE_TRACE
+	void trace(uint8_t event, uint8_t type, uint16_t len, uint8_t result);
+	s_trace trace_ring[XBEE_TRACE_RECORDS];
+	uint8_t trace_head;
+	uint8_t trace_count;
+#endif
+
 	private:
 	// This is the actual method that does all AT processing
-	bool at_cmd(const char *atxx, const uint8_t *parmval, int parmlen, void *returndata, int *returnlen, bool queued);
+	// At most returnmax bytes are copied to returndata, returnlen gives the full length
+	bool at_cmd(const char *atxx, const uint8_t *parmval, int parmlen, void *returndata, int *returnlen, bool queued, int returnmax = XBEE_BUFSIZE);
 
 	// And this is the equivalent for remote commands
-	bool at_remcmd(uint8_t ip[4], const char *atxx, const uint8_t *parmval, int parmlen, void *returndata, int *returnlen, bool apply);
+	bool at_remcmd(uint8_t ip[4], const char *atxx, const uint8_t *parmval, int parmlen, void *returndata, int *returnlen, bool apply, int returnmax = XBEE_BUFSIZE);
 
 	// Read from SPI, single byte
 	uint8_t read();
 
+	// Read from SPI into buffer of given length (data may be NULL to discard)
+	void read(uint8_t *data, int len);
+
+	// Read from SPI into buffer of given length, adding each byte to checksum cs
+	// Returns the updated checksum
+	uint8_t read_sum(uint8_t *data, int len, uint8_t cs);
+
 	// Write to SPI buffer of given length
 	void write(const uint8_t *data, int len);
 
+	// Write to SPI buffer of given length, adding each byte to checksum cs
+	// Returns the updated checksum
+	uint8_t write_sum(const uint8_t *data, int len, uint8_t cs);
+
 	// Receive an API frame, providing type, length and data to a max of bufsize
 	// If bufsize is < len then data will be truncated
+	// With data NULL no frame is returned: each is handled here, borrowing from the arena only
+	// as needed, until none is waiting (RX_FAIL_WAITING_FOR_ATN) or the bus fails
 	int rx_frame(uint8_t *frame_type, unsigned int *len, uint8_t *data, int bufsize, unsigned long atn_wait_ms = 5000L, bool return_status = false, bool single_ip_rx_only = false);
 
 	// Transmit an API frame of specified type, length and data
-	void tx_frame(uint8_t type, unsigned int len, uint8_t *data);
+	// The content is given in two parts, a header (hdr, hdrlen) and data (data, len)
+	void tx_frame(uint8_t type, const uint8_t *hdr, int hdrlen, const uint8_t *data, int len);
+
+	// Borrow a working buffer of len bytes from the arena for the given path (XBEE_PATH_xxx)
+	// Returns NULL if the arena is too full. Buffers must be returned in reverse order
+	uint8_t *arena_borrow(int len, uint8_t path);
+	void arena_return(uint8_t *buf);
+
+	// Bytes of the arena not currently lent out
+	int arena_free();
+
+	// Transmit an IP data frame, frame_id of 0 requests no TX status
+	bool tx_ip(const uint8_t *ip, s_txoptions *addr, const s_txsegment *segs, int count, uint8_t frame_id, bool useAppService);
+
+	// Wait for the TX status of a confirmed transmission, buf is a XBEE_BUFSIZE working buffer
+	bool tx_confirm(uint8_t frame_id, uint8_t *buf);
+
+	// Allocate the next frame id for a frame expecting a response
+	uint8_t next_frame_id();
 
 	// Start / End SPI operation
 	void spiStart();
 	void spiEnd();
 
-	// Perform the actual TX/RX on SPI bus
-	uint8_t rxtx(uint8_t data);
+	// Perform the actual TX/RX on SPI bus, n bytes full duplex
+	// tx may be NULL (zeros are clocked out), rx may be NULL (incoming data is discarded)
+	// This is the transport primitive, each platform provides its own backend for it
+	void transfer(const uint8_t *tx, uint8_t *rx, int n);
 
 	// Read and dispatch an inbound IP packet
 #ifndef XBEE_OMIT_RX_DATA
 	void rx_ip(unsigned int len, uint8_t frame_type);
+
+	// Read the payload of an inbound IP packet through an intermediate buffer
+	// and dispatch it in XBEE_BUFSIZE segments. cs is the checksum so far
+	void rx_ip_segments(s_rxinfo *info, uint8_t cs);
 #endif
 
 	// Read and dispatch inbound sample packet
@@ -502,6 +1222,14 @@ class XbeeWifi
 	uint8_t pin_atn;
 	uint8_t pin_dout;
 	uint8_t pin_reset;
+
+	// Port registers and masks of the chip select and ATN pins, looked up once by init
+#ifndef XBEE_NO_DIRECT_PINS
+	xbee_port_t cs_port;
+	xbee_mask_t cs_mask;
+	xbee_port_t atn_port;
+	xbee_mask_t atn_mask;
+#endif
 #ifdef ARCH_SAM
 	uint8_t pin_cs_actual;
 	uint8_t spi_ch;
@@ -515,6 +1243,34 @@ class XbeeWifi
 	// The function pointer for IP callback
 #ifndef XBEE_OMIT_RX_DATA
 	void (*ip_data_func)(uint8_t *, int, s_rxinfo *);
+
+	// The function pointer for IP stream callback
+	void (*ip_stream_func)(s_rxinfo *);
+
+	// State of the packet being pulled by the ip stream callback
+	// Payload bytes still to be read, running checksum and completion flags
+	unsigned int rx_stream_remaining;
+	uint8_t rx_stream_cs;
+	bool rx_stream_active;
+	bool rx_stream_ok;
+
+	// Per port / per peer handlers, and the handler chosen for the packet being received
+#ifndef XBEE_OMIT_RX_ROUTES
+	s_rxroute rx_routes[XBEE_RX_ROUTES];
+	void (*rx_route_func)(uint8_t *, int, s_rxinfo *);
+#endif
+
+	// Receive the payload of a packet into a pool block and deliver it if the checksum is good
+#ifndef XBEE_OMIT_RX_POOL
+	void rx_pool_packet(s_rxinfo *info, uint8_t cs);
+
+	// Pool of receive blocks, with a bit set for each block owned by the application
+	uint8_t *rx_pool;
+	int rx_pool_blocksize;
+	uint8_t rx_pool_count;
+	uint16_t rx_pool_used;
+	void (*rx_pool_func)(uint8_t *, int, s_rxinfo *);
+#endif
 #endif
 
 	// The function pointer for modem status callback
@@ -530,9 +1286,129 @@ class XbeeWifi
 	void (*sample_func)(s_sample *);
 #endif
 
+	// Sample store
+#ifndef XBEE_OMIT_SAMPLE_STORE
+	// Fold a sample into its source's entry
+	void sample_store(const s_sample *sample);
+
+	s_samplesource *sample_sources;
+	uint8_t sample_source_count;
+	uint16_t sample_decimation;
+#endif
+
 	// The next ATID to use for sequencing AT comamnd responses
 	uint8_t next_atid;
 
+#ifndef XBEE_OMIT_TX_ASYNC
+	// Match an incoming TX status to a pending asynchronous transmission and report it
+	bool tx_status_resolve(uint8_t frame_id, uint8_t status);
+
+	// Report pending asynchronous transmissions that have waited too long for status
+	void tx_status_expire();
+
+	// Pending asynchronous transmissions, by frame id (0 = free slot) and time sent
+	uint8_t tx_pending_id[XBEE_TX_PENDING];
+	unsigned long tx_pending_time[XBEE_TX_PENDING];
+	uint8_t tx_pending_count;
+
+	// The function pointer for tx status callback
+	void (*tx_status_func)(uint8_t, uint8_t);
+#endif
+
+	// The module's maximum RF payload, read from NP by init
+	void read_rf_payload();
+	int rf_payload_limit();
+	int rf_payload;
+
+#ifndef XBEE_OMIT_FRAGMENTS
+	// Id of the last fragmented datagram sent
+	uint8_t frag_tx_id;
+
+#ifndef XBEE_OMIT_RX_DATA
+	// Read a fragment straight into the reassembly buffer, delivering the datagram once complete
+	// Header has been read, cs is the checksum of everything up to this point
+	void rx_fragment(s_rxinfo *info, uint8_t cs);
+
+	// Reassembly settings, and the datagram in progress: its source (from the first fragment),
+	// id, fragment count, total length, the fragments received (bit per index) and start time
+	uint8_t *frag_buf;
+	int frag_bufsize;
+	uint16_t frag_port;
+	void (*frag_func)(uint8_t *, int, s_rxinfo *);
+	unsigned long frag_timeout;
+	bool frag_active;
+	s_rxinfo frag_info;
+	uint8_t frag_id;
+	uint8_t frag_count;
+	uint16_t frag_total;
+	uint32_t frag_received;
+	unsigned long frag_started;
+#endif
+#endif
+
+#ifndef XBEE_OMIT_TX_QUEUE
+	// Frame limit for merged transmissions
+	int tx_queue_limit();
+
+	// Send a destination's queued data and free its slot
+	bool tx_queue_send(s_txqueue *q);
+
+	// Send queued data that has waited too long
+	void tx_queue_expire();
+
+	// Queued transmissions by destination, and the limits applied to them
+	s_txqueue tx_queues[XBEE_TX_QUEUES];
+	uint8_t tx_queue_count;
+	int tx_queue_max;
+	unsigned long tx_queue_age;
+#endif
+
+#ifndef XBEE_OMIT_AT_ASYNC
+	// Place a new asynchronous AT request into a free slot, sending it if possible
+	uint8_t at_async_queue(const uint8_t *ip, const char *atxx, const uint8_t *parmval, int parmlen, uint8_t flags, void (*func)(uint8_t, uint8_t, uint8_t *, int), unsigned long timeout_ms, uint16_t node = 0);
+
+	// Transmit the frame for an asynchronous AT request
+	void at_async_send(s_atrequest *req);
+
+	// Send queued requests, and report those that have waited too long for a response
+	void at_async_service();
+
+	// Match an incoming AT response (local or remote) to a request and report it
+	bool at_async_resolve(uint8_t type, uint8_t *data, unsigned int len);
+
+	// Report the outcome of a request and free its slot
+	void at_async_complete(s_atrequest *req, uint8_t status, uint8_t *data, int len);
+
+	// Queue fan-out requests for the nodes not yet sent to, as slots allow
+	void at_fanout_fill();
+
+	// Remote profile sync: move a node on to its next step, queue the request for its step,
+	// take the response to it, and report the node once it is done
+	void at_sync_next(s_atsyncnode *sync);
+	bool at_sync_send(s_atsyncnode *sync);
+	void at_sync_complete(s_atsyncnode *sync, uint8_t status, uint8_t *data, int len);
+	void at_sync_report(s_atsyncnode *sync, uint8_t status);
+
+	// Asynchronous AT requests
+	s_atrequest at_requests[XBEE_AT_PENDING];
+	uint8_t at_request_count;
+	s_atfanout fanout;
+	s_atsyncnode sync_nodes[XBEE_AT_PENDING];
+#endif
+
+#ifndef XBEE_OMIT_AT_CACHE
+	// Index of the cache slot for a parameter, or -1 if it isn't one that is cached
+	int at_cache_slot(const char *atxx);
+
+	// Discard cached values affected by a local AT command about to be sent
+	void at_cache_command(const char *atxx, int parmlen);
+
+	// Cached values, with a length of 0xFF marking a slot not yet read
+	uint8_t at_cache_value[XBEE_AT_CACHE_PARAMS][XBEE_AT_CACHE_PARMLEN];
+	uint8_t at_cache_len[XBEE_AT_CACHE_PARAMS];
+	s_atcache_stats at_cache_stats;
+#endif
+
 #ifndef XBEE_OMIT_SCAN
 	// Handles incoming active scan data (AT responses to AS command)
 	void handleActiveScan(uint8_t *buf, int len);
@@ -541,6 +1417,16 @@ class XbeeWifi
 	// Track RX callback depth
 	uint8_t callback_depth;
 
+	// Working buffer arena, lent out from the bottom up
+	uint8_t *arena;
+	int arena_size;
+	int arena_top;
+	bool arena_owned;		// Allocated by the constructor, rather than provided
+#ifdef XBEE_ENABLE_MEMSTATS
+	s_memstats memstats[XBEE_PATHS];
+	uintptr_t stack_base;
+#endif
+
 #ifdef ARCH_ATMEGA
 	// To be nice about things, we reset SPCR after using it, copy of SPCR held here
 	// Ditto SPSR - which is in fact just the SPI2X bit which is the only writable bit here
@@ -548,12 +1434,40 @@ class XbeeWifi
 	uint8_t spsr_copy;
 #endif
 
+	// SPI clock divisor in use, and on AVR the SPCR / SPSR values that select it
+	uint16_t spi_div;
+#ifdef ARCH_ATMEGA
+	uint8_t spi_spcr;
+	uint8_t spi_spsr;
+#endif
+
+	// Apply an SPI clock divisor, and find the next faster divisor (0 if there is none)
+	void spi_set_div(uint16_t div);
+	uint16_t spi_faster_div(uint16_t div);
+
+	// Make trials AT queries, true if each returns the reference reply
+	bool spi_trial(const uint8_t *ref, int reflen, uint8_t trials);
+
 	// True when we have the Xbee Chip Select asserted
 	bool spiRunning;
 
-	// True to prevent SPI bus from being de-selected by endSpi function
-	// in some cases
-	bool spiLocked;
+	// While non zero, spiEnd leaves chip select asserted, so that a run of frames
+	// shares one SPI session. Nested users each take and release their own lock
+	uint8_t spiLocked;
+
+	// Minimum chip select de-asserted time before it is asserted again (us) and when it was
+	// last de-asserted (micros)
+	unsigned int spi_guard_us;
+	unsigned long spi_end_us;
+
+	// ATN interrupt mode. The flag is set by the interrupt handler on each falling edge
+	// of ATN and cleared by process() before it drains the bus
+#ifndef XBEE_OMIT_ATN_INTERRUPT
+	bool atn_irq;
+	volatile bool atn_flag;
+	static XbeeWifi *atn_owner;
+	static void atn_isr();
+#endif
 
 };
 
@@ -571,28 +1485,59 @@ class XbeeWifi
 // Strictly speaking if you want to do this you're probably better off
 // usign the UART on the Xbee to read data instead of SPI
 // Still - there might be a use case for this
-class XbeeWifiBuffered : public XbeeWifi
+//
+// It implements the Arduino Stream interface, so that data may be consumed by
+// anything that reads a Stream. The stream is input only, writes are not accepted
+class XbeeWifiBuffered : public XbeeWifi, public Stream
 {
 	public:
 	// Must provide a desired buffer size when constructing
 	// If at any time incoming data is in excess of this buffer size, you will lose data
 	// This is why you should probably be using the Xbee serial service instead of SPI
-	XbeeWifiBuffered(uint16_t bufsize);
+	// Set packets to true for packet mode, where packet boundaries and the s_pktinfo for
+	// each packet are kept in the buffer. In packet mode use readPacket / peekPacketInfo
+	// rather than the byte methods, and whole packets are dropped when the buffer is full
+	// The working buffer arena is as for XbeeWifi
+	XbeeWifiBuffered(uint16_t bufsize, bool packets = false, uint8_t *arena = NULL, int arena_size = XBEE_ARENA_SIZE);
 
 	// Destructor since we use dynamic allocation
 	~XbeeWifiBuffered();
 
 	// Returns the number of available bytes
-	bool available();
+	// In packet mode, the bytes left in the next packet (use packetsAvailable to count packets)
+	virtual int available();
 
-	// Reads the next byte. Always returns 0 if no bytes were available
-	uint8_t read();
+	// Reads the next byte. Returns -1 if no bytes were available
+	virtual int read();
 
-	// Peeks the next byte. Always returns 0 if no bytes are in the buffer
-	uint8_t peek();
+	// Reads up to len bytes into buf, returns the number read
+	// In packet mode a read never runs past the end of the next packet. The packet is
+	// removed once all of it has been read
+	int read(uint8_t *buf, int len);
+
+	// Peeks the next byte. Returns -1 if no bytes are in the buffer
+	virtual int peek();
 
 	// Flush all items out of the buffer
-	void flush();
+	virtual void flush();
+
+	// Stream output is not supported, these always return 0
+	virtual size_t write(uint8_t c);
+	virtual size_t write(const uint8_t *buf, size_t len);
+
+	// Packet mode only
+	// Returns the number of whole packets in the buffer
+	uint16_t packetsAvailable();
+
+	// Fills info with the details of the next packet without removing it
+	// Returns false if no packet is available
+	bool peekPacketInfo(s_pktinfo *info);
+
+	// Removes the next packet from the buffer, copying up to maxlen bytes of its data to buf
+	// and its details to info (if not NULL). Data beyond maxlen is discarded, as is data
+	// already taken from the packet by read()
+	// Returns the number of bytes copied, or -1 if no packet is available
+	int readPacket(uint8_t *buf, int maxlen, s_pktinfo *info = NULL);
 
 	// Returns true if a buffer overrun has occurred (and resets the overrun
 	// state to false unless reset is marked false)
@@ -604,9 +1549,12 @@ class XbeeWifiBuffered : public XbeeWifi
 	virtual void dispatch(uint8_t *data, int len, s_rxinfo *info);
 
 	private:
-	// Move register_ip_data_callback to private space
+	// Move register_ip_data_callback (and register_ip_port_callback) to private space
 	// This is not callable from the buffered version of the class
 	void register_ip_data_callback(void (*func)(uint8_t *, int, s_rxinfo *));
+#ifndef XBEE_OMIT_RX_ROUTES
+	bool register_ip_port_callback(uint16_t dest_port, void (*func)(uint8_t *, int, s_rxinfo *), const uint8_t *source_ip = NULL, uint16_t source_port = 0);
+#endif
 
 	// The buffer
 	uint8_t *buffer;
@@ -625,6 +1573,22 @@ class XbeeWifiBuffered : public XbeeWifi
 
 	// Flag when a buffer overrun has occurred here
 	bool buffer_overrun;
+
+	// Copy into / out of the buffer at pos, wrapping as needed. Returns the position after
+	uint16_t ring_put(uint16_t pos, const uint8_t *data, uint16_t len);
+	uint16_t ring_get(uint16_t pos, uint8_t *data, uint16_t len);
+
+	// Packet mode state
+	bool packet_mode;		// Packet mode selected at construction
+	uint16_t packets;		// Number of whole packets in the buffer
+	bool pkt_active;		// A packet is being received into the buffer
+	uint16_t pkt_start;		// Buffer position of the record for that packet
+	uint16_t pkt_len;		// Bytes of it received so far
+	uint16_t pkt_read;		// Bytes of the packet at the tail already taken by read()
+
+	// Bytes left to read in the next packet, and removal of the packet at the tail
+	uint16_t pkt_remaining(bool drain);
+	void pkt_pop();
 };
 #endif
 
@@ -20,6 +20,25 @@
 #define CONFIG_SSID "Example"                    // SSID
 #define CONFIG_KEY "whatever"                    // Password
 
+#define CONFIG_KEY_CHANGED false                 // Set true for one run after changing the password
+
+// The configuration as a profile, kept in program memory along with its strings
+// Only settings that differ from the module's are sent, and only then is the flash written
+// The key can't be read back to compare, it goes with any other change or with CONFIG_KEY_CHANGED
+const char config_ssid[] PROGMEM = CONFIG_SSID;
+#if CONFIG_ENCMODE != XBEE_SEC_ENCTYPE_NONE
+const char config_key[] PROGMEM = CONFIG_KEY;
+#endif
+const s_atsetting config_profile[] PROGMEM = {
+  XBEE_SETTING_BYTE(XBEE_AT_NET_TYPE, XBEE_NET_TYPE_IBSS_INFRASTRUCTURE),
+  XBEE_SETTING_STR(XBEE_AT_NET_SSID, config_ssid),
+  XBEE_SETTING_BYTE(XBEE_AT_NET_ADDRMODE, XBEE_NET_ADDRMODE_DHCP),
+  XBEE_SETTING_BYTE(XBEE_AT_SEC_ENCTYPE, CONFIG_ENCMODE),
+#if CONFIG_ENCMODE != XBEE_SEC_ENCTYPE_NONE
+  XBEE_SETTING_KEY(XBEE_AT_SEC_KEY, config_key)
+#endif
+};
+
 // Create an xbee object to handle things for us
 XbeeWifi xbee;
 
@@ -35,14 +54,8 @@ void setup()
   bool result = xbee.init(XBEE_SELECT, XBEE_ATN, XBEE_RESET, XBEE_DOUT);
 
   if (result) {
-    // Initialization okay so far, send setup parameters - if anything fails, result goes false
-    result &= xbee.at_cmd_byte(XBEE_AT_NET_TYPE, XBEE_NET_TYPE_IBSS_INFRASTRUCTURE);
-    result &= xbee.at_cmd_str(XBEE_AT_NET_SSID, CONFIG_SSID);
-    result &= xbee.at_cmd_byte(XBEE_AT_NET_ADDRMODE, XBEE_NET_ADDRMODE_DHCP);
-    result &= xbee.at_cmd_byte(XBEE_AT_SEC_ENCTYPE, CONFIG_ENCMODE);
-    if (CONFIG_ENCMODE != XBEE_SEC_ENCTYPE_NONE) {
-      result &= xbee.at_cmd_str(XBEE_AT_SEC_KEY, CONFIG_KEY);
-    }
+    // Initialization okay so far, bring the configuration up to date - if anything fails, result goes false
+    result = xbee.apply_profile(config_profile, sizeof(config_profile) / sizeof(s_atsetting), true, true, CONFIG_KEY_CHANGED) >= 0;
   }
   
   if (!result) {
@@ -0,0 +1,987 @@
+/*
+ * File			bench.cpp
+ *
+ * Synopsis		Host benchmark for the XbeeWifi frame engine, running against the simulated module
+ *
+ * Author		Chris Bearman
+ *
+ * Version		1.0
+ *
+ * License		This software is released under the terms of the Mozilla Public License (MPL) version 2.0
+ * 			Full details of licensing terms can be found in the "LICENSE" file, distributed with this code
+ *
+ * Instructions		make -C extras/host && extras/host/bench
+ *
+ *			For each frame type, reports frames per second and CPU time per byte spent
+ *			by the library (the cost of the simulator itself is measured and subtracted)
+ */
+#include <XbeeWifi.h>
+#include "xbee_sim.h"
+#include <stdio.h>
+#include <time.h>
+
+#define PIN_CS 10
+#define PIN_ATN 2
+#define PIN_RESET 15
+#define PIN_DOUT 23
+
+// Frames queued in the simulator per call to process()
+#define BATCH 64
+
+static XbeeSim sim(PIN_CS, PIN_ATN, PIN_RESET);
+static XbeeWifi xbee;
+
+// The object under test
+static XbeeWifi *dev = &xbee;
+
+static const uint8_t peer[4] = { 192, 168, 1, 10 };
+
+// Delivery counters, updated by the callbacks
+static unsigned long rx_bytes;
+static unsigned long rx_calls;
+static unsigned long samples;
+static unsigned long statuses;
+
+static void ip_rx(uint8_t *data, int len, s_rxinfo *info)
+{
+	rx_bytes += len;
+	rx_calls++;
+}
+
+// Handler that should never be chosen by the routed case
+static void stray_rx(uint8_t *data, int len, s_rxinfo *info)
+{
+	rx_bytes += 1000000;
+}
+
+// Pull style reception straight into the application's buffer
+static uint8_t app_buf[1400];
+static unsigned long stream_bad;
+
+static void ip_stream(s_rxinfo *info)
+{
+	rx_bytes += dev->rx_read(app_buf, sizeof(app_buf));
+	rx_calls++;
+	if (!dev->rx_finish()) stream_bad++;
+}
+
+// Whole packets from the rx pool. Each block is kept until the next packet arrives, as an
+// application handing packets to a later stage would
+static uint8_t pool[4][1400];
+static uint8_t *pool_held;
+
+static void ip_pool(uint8_t *block, int len, s_rxinfo *info)
+{
+	rx_bytes += len;
+	rx_calls++;
+	if (pool_held) dev->release_rx_block(pool_held);
+	pool_held = block;
+}
+
+static unsigned long samples_bad;
+
+static void sample_rx(s_sample *sample)
+{
+	samples++;
+	if (sample->analog_mask == 0x0F && (sample->digital_samples != 0x0015 || sample->analog_samples != 0x100 || sample->analog[3] != 0x3FF)) samples_bad++;
+}
+
+static void status_rx(uint8_t status)
+{
+	statuses++;
+}
+
+static unsigned long tx_confirmed;
+
+static void tx_status(uint8_t frame_id, uint8_t status)
+{
+	if (status == XBEE_TX_STATUS_SUCCESS) tx_confirmed++;
+}
+
+// CPU time consumed by this process, nanoseconds
+static unsigned long long cpu_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Simulator cost per clocked byte, measured once and subtracted from results
+static double sim_ns_per_byte;
+
+static void calibrate()
+{
+	static uint8_t buf[1024];
+	// Best of several runs, a single run is easily disturbed. Frames are read back as the
+	// receive paths read them, with no data sent
+	sim_ns_per_byte = 0;
+	for (int run = 0; run < 20; run++) {
+		sim.reset();
+		for (int i = 0; i < BATCH; i++) sim.queue_rx_ipv4(peer, 12345, 5000, XBEE_NET_IPPROTO_UDP, buf, sizeof(buf));
+		unsigned long bytes = sim.pending() / sizeof(buf) * sizeof(buf);
+		digitalWrite(PIN_CS, LOW);
+		unsigned long long start = cpu_ns();
+		for (unsigned long done = 0; done < bytes; done += sizeof(buf)) xbee_host_spi_transfer(NULL, buf, sizeof(buf));
+		unsigned long long ns = cpu_ns() - start;
+		digitalWrite(PIN_CS, HIGH);
+		double per_byte = (double) ns / bytes;
+		if (run == 0 || per_byte < sim_ns_per_byte) sim_ns_per_byte = per_byte;
+	}
+	sim.reset();
+}
+
+// Report a result line
+// clocked is the number of bytes clocked on the bus, used for the per byte cost
+static void report(const char *name, unsigned long frames, unsigned long long ns, unsigned long clocked)
+{
+	double net = ns - sim_ns_per_byte * clocked;
+	if (net < 0) net = 0;
+	printf("%-24s %8lu frames %12.0f frames/s %8.2f ns/byte %10.0f ns/frame %6.1f pin/frame\n",
+		name, frames, frames / (net / 1e9), net / clocked, net / frames, (double) sim.pin_calls / frames);
+}
+
+// Drain queued frames through process(), queued by fill() in batches
+static void run_rx(const char *name, unsigned long frames, void (*fill)(int))
+{
+	sim.reset();
+	unsigned long long total = 0, best = 0;
+	unsigned long done = 0;
+	while (done < frames) {
+		int n = (frames - done) > BATCH ? BATCH : (frames - done);
+		fill(n);
+		done += n;
+		unsigned long long start = cpu_ns();
+		dev->process();
+		unsigned long long ns = cpu_ns() - start;
+		total += ns;
+		if (n == BATCH && (best == 0 || ns < best)) best = ns;
+	}
+	// Cost is taken from the fastest full batch, as for the simulator calibration, since the
+	// total is easily disturbed by anything else running on the machine
+	if (best) total = best * frames / BATCH;
+	report(name, frames, total, sim.bytes_clocked);
+}
+
+static uint8_t payload[1400];
+static int payload_len;
+
+static void fill_ipv4(int n)
+{
+	for (int i = 0; i < n; i++) sim.queue_rx_ipv4(peer, 12345, 5000, XBEE_NET_IPPROTO_UDP, payload, payload_len);
+}
+
+static void fill_compat(int n)
+{
+	for (int i = 0; i < n; i++) sim.queue_rx_compat(peer, payload, payload_len);
+}
+
+static void fill_sample(int n)
+{
+	uint16_t analog[4] = { 0x100, 0x200, 0x300, 0x3FF };
+	for (int i = 0; i < n; i++) sim.queue_io_sample(peer, 0x001F, 0x0F, 0x0015, analog);
+}
+
+// Samples from STORE_SOURCES sources in turn. Even sources sample digital lines and analog
+// channels 0 and 1, odd ones only analog channels 0 and 2, each stepping through eight levels
+#define STORE_SOURCES 16
+static unsigned long store_sent;
+
+static void fill_store(int n)
+{
+	for (int i = 0; i < n; i++, store_sent++) {
+		int source = store_sent % STORE_SOURCES;
+		int step = (store_sent / STORE_SOURCES) % 8;
+		uint8_t ip[4] = { 192, 168, 2, (uint8_t) (source + 1) };
+		uint16_t analog[2] = { (uint16_t) (source * 10 + step), (uint16_t) (0x3FF - step) };
+		if (source & 1) sim.queue_io_sample(ip, 0x0000, 0x05, 0, analog);
+		else sim.queue_io_sample(ip, 0x0003, 0x03, (uint16_t) (step & 3), analog);
+	}
+}
+
+static void fill_status(int n)
+{
+	for (int i = 0; i < n; i++) sim.queue_modem_status(XBEE_MODEM_STATUS_JOINED);
+}
+
+static void bench_rx_ip(const char *kind, int len, unsigned long frames, void (*fill)(int))
+{
+	char name[40];
+	payload_len = len;
+	rx_bytes = 0;
+	snprintf(name, sizeof(name), "%s %d", kind, len);
+	run_rx(name, frames, fill);
+	if (rx_bytes != frames * len) printf("  ** delivered %lu of %lu bytes\n", rx_bytes, frames * len);
+}
+
+// Transmit path
+static void bench_tx(int len, unsigned long frames, bool confirm, bool app)
+{
+	s_txoptions opts = { 12345, 5000, XBEE_NET_IPPROTO_UDP, false };
+
+	sim.reset();
+	unsigned long ok = 0;
+	unsigned long long start = cpu_ns();
+	for (unsigned long i = 0; i < frames; i++) {
+		if (dev->transmit(peer, &opts, payload, len, confirm, app)) ok++;
+	}
+	unsigned long long total = cpu_ns() - start;
+
+	char name[40];
+	snprintf(name, sizeof(name), "%s %d%s", app ? "tx64" : "tx_ipv4", len, confirm ? " confirm" : "");
+	report(name, frames, total, sim.bytes_clocked);
+	if (ok != frames || sim.frames_in_bad > 0) {
+		printf("  ** %lu of %lu sent, %lu bad frames at module\n", ok, frames, sim.frames_in_bad);
+	}
+}
+
+// Small datagrams to one destination merged by transmit_queued
+// Frames are counted at the module, the result is per datagram
+static void bench_tx_queued(int len, unsigned long datagrams)
+{
+	s_txoptions opts = { 12345, 5000, XBEE_NET_IPPROTO_UDP, false };
+
+	sim.reset();
+	unsigned long ok = 0;
+	unsigned long long start = cpu_ns();
+	for (unsigned long i = 0; i < datagrams; i++) {
+		if (dev->transmit_queued(peer, &opts, payload, len)) ok++;
+	}
+	if (!dev->flush_queued()) ok = 0;
+	unsigned long long total = cpu_ns() - start;
+
+	char name[40];
+	snprintf(name, sizeof(name), "tx_queued %d", len);
+	report(name, datagrams, total, sim.bytes_clocked);
+	printf("  %lu frames at module, %.1f datagrams/frame\n", sim.tx_frames, (double) datagrams / sim.tx_frames);
+	if (ok != datagrams || sim.frames_in_bad > 0 || sim.tx_bytes != (unsigned long) len * datagrams) {
+		printf("  ** %lu of %lu queued, %lu of %lu bytes at module\n", ok, datagrams, sim.tx_bytes, (unsigned long) len * datagrams);
+	}	// The frame limit (NP) was read by init, queueing never waits on the module for it
+	if (sim.at_commands != 0) printf("  ** %lu AT commands sent while queueing\n", sim.at_commands);
+}
+
+// Scatter-gather transmit of a header, readings and a constant trailer, totalling len bytes
+static void bench_txv(int len, unsigned long frames)
+{
+	s_txoptions opts = { 12345, 5000, XBEE_NET_IPPROTO_UDP, false };
+	static const uint8_t trailer[] = "end of record\r\n";
+	s_txsegment segs[3] = {
+		{ payload, 8, false },
+		{ payload + 8, len - 8 - (int) sizeof(trailer), false },
+		{ trailer, sizeof(trailer), true }
+	};
+
+	sim.reset();
+	unsigned long ok = 0;
+	unsigned long long start = cpu_ns();
+	for (unsigned long i = 0; i < frames; i++) {
+		if (dev->transmitv(peer, &opts, segs, 3, false)) ok++;
+	}
+	unsigned long long total = cpu_ns() - start;
+
+	char name[40];
+	snprintf(name, sizeof(name), "txv_ipv4 %d x3", len);
+	report(name, frames, total, sim.bytes_clocked);
+	if (ok != frames || sim.frames_in_bad > 0 || sim.last_frame.size() != (size_t) len + 11) {
+		printf("  ** %lu of %lu sent, %lu bad frames at module\n", ok, frames, sim.frames_in_bad);
+	}
+}
+
+// Asynchronous transmit, keeping the pending table full and resolving status through process()
+static void bench_tx_async(int len, unsigned long frames)
+{
+	s_txoptions opts = { 12345, 5000, XBEE_NET_IPPROTO_TCP, true };
+
+	sim.reset();
+	tx_confirmed = 0;
+	unsigned long sent = 0;
+	unsigned long long start = cpu_ns();
+	while (sent < frames) {
+		if (dev->transmit_async(peer, &opts, payload, len)) {
+			sent++;
+		} else {
+			dev->process();
+		}
+	}
+	while (dev->tx_pending() > 0) dev->process();
+	unsigned long long total = cpu_ns() - start;
+
+	char name[40];
+	snprintf(name, sizeof(name), "tx_async %d", len);
+	report(name, frames, total, sim.bytes_clocked);
+	if (tx_confirmed != frames) printf("  ** %lu of %lu confirmed\n", tx_confirmed, frames);
+}
+
+static unsigned long at_ok;
+
+static void at_done(uint8_t frame_id, uint8_t status, uint8_t *data, int len)
+{
+	if (status == XBEE_AT_STATUS_OK && len > 0) at_ok++;
+}
+
+// Asynchronous AT queries, keeping the request table full
+static void bench_at_async(unsigned long frames, bool remote)
+{
+	uint8_t node[4] = { 192, 168, 1, 20 };
+
+	sim.reset();
+	at_ok = 0;
+	unsigned long sent = 0;
+	unsigned long long start = cpu_ns();
+	while (sent < frames) {
+		uint8_t id = remote ?
+			dev->at_remquery_async(node, XBEE_AT_ADDR_NODEID, at_done) :
+			dev->at_query_async(XBEE_AT_DIAG_FIRMWARE_VERSION, at_done);
+		if (id) {
+			sent++;
+		} else {
+			dev->process();
+		}
+	}
+	while (dev->at_pending() > 0) dev->process();
+	unsigned long long total = cpu_ns() - start;
+	report(remote ? "at_remquery_async NI" : "at_query_async VR", frames, total, sim.bytes_clocked);
+	if (at_ok != frames) printf("  ** %lu of %lu succeeded\n", at_ok, frames);
+}
+
+// Remote query of many nodes at once, some of which never answer
+#define FANOUT_NODES 48
+#define FANOUT_DEAD 4
+#define FANOUT_TIMEOUT_MS 20
+static unsigned long fanout_ok, fanout_timeouts;
+static uint8_t fanout_seen[FANOUT_NODES];
+
+static void fanout_done(int index, uint8_t status, uint8_t *data, int len)
+{
+	fanout_seen[index]++;
+	if (status == XBEE_AT_STATUS_OK && len > 0) fanout_ok++;
+	if (status == XBEE_AT_STATUS_TIMEOUT) fanout_timeouts++;
+}
+
+static void bench_fanout()
+{
+	static uint8_t nodes[FANOUT_NODES][4];
+	static const uint8_t ni[] = { 'n', 'o', 'd', 'e' };
+	for (int i = 0; i < FANOUT_NODES; i++) {
+		nodes[i][0] = 10;
+		nodes[i][1] = 1;
+		nodes[i][2] = 0;
+		nodes[i][3] = i + 1;
+		// Every twelfth node is switched off
+		if (i % (FANOUT_NODES / FANOUT_DEAD) == 0) continue;
+		sim.add_remote(nodes[i]);
+		sim.set_remote_param(nodes[i], "NI", ni, sizeof(ni));
+	}
+
+	sim.reset();
+	fanout_ok = fanout_timeouts = 0;
+	memset(fanout_seen, 0, sizeof(fanout_seen));
+	unsigned long long start = xbee_sim_micros();
+	if (!dev->at_remcmd_fanout(nodes, FANOUT_NODES, XBEE_AT_ADDR_NODEID, NULL, 0, true, fanout_done, XBEE_AT_PENDING, FANOUT_TIMEOUT_MS)) {
+		printf("  ** fan-out refused\n");
+		return;
+	}
+	while (dev->at_fanout_pending() > 0) dev->process();
+	double ms = (xbee_sim_micros() - start) / 1000.0;
+	printf("at_remcmd_fanout NI      %8d nodes  %6.1f ms, %lu answered, %lu timed out after %d ms, %d in flight\n", FANOUT_NODES, ms, fanout_ok, fanout_timeouts, FANOUT_TIMEOUT_MS, XBEE_AT_PENDING);
+	if (fanout_ok != FANOUT_NODES - FANOUT_DEAD || fanout_timeouts != FANOUT_DEAD) printf("  ** wrong results\n");
+	for (int i = 0; i < FANOUT_NODES; i++) {
+		if (fanout_seen[i] != 1) printf("  ** node %d reported %u times\n", i, fanout_seen[i]);
+	}
+	// Sequentially, each dead node would cost a full timeout
+	if (ms >= FANOUT_DEAD * FANOUT_TIMEOUT_MS) printf("  ** dead nodes were waited for in turn\n");
+}
+
+// Cost of calling process() with nothing pending
+// Samples kept per source, four to a ring entry, then checked against what was sent
+static void bench_sample_store(unsigned long frames)
+{
+	static s_samplesource store[STORE_SOURCES];
+	dev->enable_sample_store(store, STORE_SOURCES, 4);
+	store_sent = 0;
+	run_rx("io_sample store", frames, fill_store);
+
+	// A source beyond the table is still delivered, but not kept
+	static const uint8_t extra[4] = { 192, 168, 2, 200 };
+	uint16_t analog[1] = { 0 };
+	samples = 0;
+	sim.queue_io_sample(extra, 0, 0x01, 0, analog);
+	dev->process();
+	if (samples != 1 || dev->sample_source(extra)) printf("  ** sample from a source beyond the table mishandled\n");
+
+	// Each entry averages four steps, 0..3 or 4..7, rounded down
+	unsigned long bad = 0;
+	uint16_t history[XBEE_SAMPLE_HISTORY];
+	for (int source = 0; source < STORE_SOURCES; source++) {
+		uint8_t ip[4] = { 192, 168, 2, (uint8_t) (source + 1) };
+		s_samplesource *entry = dev->sample_source(ip);
+		if (!entry) {
+			bad++;
+			continue;
+		}
+		unsigned long count = frames / STORE_SOURCES;
+		s_channelstats *stats = &entry->stats[0];
+		if (entry->samples != count || stats->count != count || stats->min != source * 10 || stats->max != source * 10 + 7 ||
+			stats->sum / stats->count != (uint32_t) (source * 10 + 3)) bad++;
+		int n = dev->sample_history(entry, 0, history, XBEE_SAMPLE_HISTORY);
+		if (n != XBEE_SAMPLE_HISTORY) bad++;
+		for (int i = 0; i < n; i++) {
+			if (history[i] != source * 10 + ((n - i) & 1 ? 5 : 1)) bad++;
+		}
+		n = dev->sample_history(entry, (source & 1) ? 2 : 1, history, XBEE_SAMPLE_HISTORY);
+		for (int i = 0; i < n; i++) {
+			if (history[i] != 0x3FF - ((n - i) & 1 ? 6 : 2)) bad++;
+		}
+		n = dev->sample_history(entry, (source & 1) ? 1 : 2, history, 1);
+		if (n != 1 || history[0] != XBEE_SAMPLE_NONE) bad++;
+		n = dev->sample_history(entry, XBEE_SAMPLE_DIGITAL, history, 1);
+		if (n != 1 || history[0] != ((source & 1) ? XBEE_SAMPLE_NONE : 3)) bad++;
+		dev->reset_sample_stats(entry);
+		if (entry->stats[0].count != 0) bad++;
+	}
+	if (bad) printf("  ** %lu sample store mismatches\n", bad);
+	dev->enable_sample_store(NULL, 0);
+}
+
+// Reassembled datagrams, checked against the fragmented data sent
+#define FRAG_PORT 6000
+#define FRAG_LEN 5000
+static uint8_t frag_data[FRAG_LEN];
+static uint8_t frag_buf[FRAG_LEN];
+static unsigned long frag_delivered;
+static unsigned long frag_bad;
+
+static void frag_rx(uint8_t *data, int len, s_rxinfo *info)
+{
+	frag_delivered++;
+	if (len != FRAG_LEN || memcmp(data, frag_data, len) != 0 || memcmp(info->source_addr, peer, 4) != 0) frag_bad++;
+}
+
+// Queue one fragment as the module would deliver it, header and all
+static void queue_fragment(uint8_t magic, uint8_t id, uint8_t index, uint8_t count, int offset, int total, int len)
+{
+	static uint8_t f[XBEE_FRAG_HDRLEN + 1400];
+	f[0] = magic;
+	f[1] = id;
+	f[2] = index;
+	f[3] = count;
+	f[4] = offset >> 8;
+	f[5] = offset & 0xFF;
+	f[6] = total >> 8;
+	f[7] = total & 0xFF;
+	memcpy(f + XBEE_FRAG_HDRLEN, frag_data + offset, len);
+	sim.queue_rx_ipv4(peer, FRAG_PORT, FRAG_PORT, XBEE_NET_IPPROTO_UDP, f, XBEE_FRAG_HDRLEN + len);
+}
+
+// Datagrams larger than the maximum payload sent with transmit_fragmented, looped back by the
+// simulator and reassembled. Then fragments that are lost, late or invalid
+static void bench_fragments(unsigned long datagrams)
+{
+	s_txoptions opts = { FRAG_PORT, FRAG_PORT, XBEE_NET_IPPROTO_UDP, false };
+	for (int i = 0; i < FRAG_LEN; i++) frag_data[i] = i * 7 + (i >> 8);
+	dev->enable_reassembly(FRAG_PORT, frag_buf, sizeof(frag_buf), frag_rx, 100);
+
+	sim.reset();
+	sim.loopback = true;
+	frag_delivered = frag_bad = 0;
+	unsigned long ok = 0;
+	unsigned long long start = cpu_ns();
+	for (unsigned long i = 0; i < datagrams; i++) {
+		if (dev->transmit_fragmented(peer, &opts, frag_data, FRAG_LEN, false)) ok++;
+		dev->process();
+	}
+	unsigned long long total = cpu_ns() - start;
+	sim.loopback = false;
+	char name[40];
+	snprintf(name, sizeof(name), "fragmented %d loopback", FRAG_LEN);
+	report(name, datagrams, total, sim.bytes_clocked);
+	printf("  %.1f frames/datagram each way\n", (double) sim.tx_frames / datagrams);
+	if (ok != datagrams || frag_delivered != datagrams || frag_bad) {
+		printf("  ** %lu of %lu sent, %lu delivered, %lu corrupt\n", ok, datagrams, frag_delivered, frag_bad);
+	}
+
+	// Three fragments of 1400, 1400 and 2200 bytes
+	s_stats before, after;
+	dev->get_stats(&before);
+	frag_delivered = frag_bad = 0;
+	unsigned long bad = 0;
+
+	// A missing piece, then a complete datagram which abandons the incomplete one
+	queue_fragment(XBEE_FRAG_MAGIC, 1, 0, 3, 0, FRAG_LEN, 1400);
+	queue_fragment(XBEE_FRAG_MAGIC, 1, 2, 3, 2800, FRAG_LEN, 1400);
+	queue_fragment(XBEE_FRAG_MAGIC, 2, 0, 4, 0, FRAG_LEN, 1400);
+	queue_fragment(XBEE_FRAG_MAGIC, 2, 1, 4, 1400, FRAG_LEN, 1400);
+	queue_fragment(XBEE_FRAG_MAGIC, 2, 2, 4, 2800, FRAG_LEN, 1400);
+	queue_fragment(XBEE_FRAG_MAGIC, 2, 3, 4, 4200, FRAG_LEN, 800);
+	dev->process();
+	if (frag_delivered != 1 || frag_bad) bad++;
+
+	// The last piece arriving after the timeout starts afresh and is not delivered
+	queue_fragment(XBEE_FRAG_MAGIC, 3, 0, 4, 0, FRAG_LEN, 1400);
+	queue_fragment(XBEE_FRAG_MAGIC, 3, 1, 4, 1400, FRAG_LEN, 1400);
+	queue_fragment(XBEE_FRAG_MAGIC, 3, 2, 4, 2800, FRAG_LEN, 1400);
+	dev->process();
+	delay(150);
+	queue_fragment(XBEE_FRAG_MAGIC, 3, 3, 4, 4200, FRAG_LEN, 800);
+	dev->process();
+	if (frag_delivered != 1) bad++;
+
+	// Invalid fragments are dropped: bad magic, index beyond count, too many fragments,
+	// datagram larger than the buffer, piece beyond the datagram
+	queue_fragment(0x00, 4, 0, 4, 0, FRAG_LEN, 1400);
+	queue_fragment(XBEE_FRAG_MAGIC, 4, 4, 4, 0, FRAG_LEN, 1400);
+	queue_fragment(XBEE_FRAG_MAGIC, 4, 0, XBEE_FRAG_MAX + 1, 0, FRAG_LEN, 1400);
+	queue_fragment(XBEE_FRAG_MAGIC, 4, 0, 4, 0, FRAG_LEN + 1, 1400);
+	queue_fragment(XBEE_FRAG_MAGIC, 4, 3, 4, 4200, FRAG_LEN, 1400);
+	dev->process();
+	dev->get_stats(&after);
+	if (frag_delivered != 1 || after.rx_dropped - before.rx_dropped != 5) bad++;
+	if (bad) printf("  ** %lu lost, late or invalid fragment cases mishandled (%lu delivered)\n", bad, frag_delivered);
+	dev->enable_reassembly(0, NULL, 0, NULL);
+
+	// A maximum payload too small to carry the fragment header is refused
+	static const uint8_t np_tiny[2] = { 0x00, XBEE_FRAG_HDRLEN };
+	static const uint8_t np_normal[2] = { 0x05, 0xDC };
+	sim.set_param("NP", np_tiny, sizeof(np_tiny));
+	xbee.init(PIN_CS, PIN_ATN, PIN_RESET, PIN_DOUT);
+	if (dev->transmit_fragmented(peer, &opts, frag_data, FRAG_LEN, false)) printf("  ** fragmented with no room for data\n");
+	sim.set_param("NP", np_normal, sizeof(np_normal));
+	xbee.init(PIN_CS, PIN_ATN, PIN_RESET, PIN_DOUT);
+}
+
+static void bench_idle(const char *name, unsigned long calls)
+{
+	sim.reset();
+	unsigned long long start = cpu_ns();
+	for (unsigned long i = 0; i < calls; i++) dev->process();
+	unsigned long long total = cpu_ns() - start;
+	printf("%-24s %8lu calls  %12.0f calls/s  %29.1f ns/call  %6.1f pin/call\n", name, calls, calls / (total / 1e9), (double) total / calls, (double) sim.pin_calls / calls);
+}
+
+// IP data already waiting at the module when a blocking AT command or confirmed transmission
+// is made is received while the command waits, and must not be dropped for want of a buffer
+static void bench_nested_rx()
+{
+	s_txoptions opts = { 12345, 5000, XBEE_NET_IPPROTO_UDP, false };
+	uint8_t node[4] = { 192, 168, 1, 21 };
+	uint8_t value[32];
+	int len;
+	static const uint8_t ni[] = { 'n', 'o', 'd', 'e' };
+	sim.set_param("NI", ni, sizeof(ni));
+	sim.set_remote_param(node, "NI", ni, sizeof(ni));
+	s_stats before, after;
+	dev->get_stats(&before);
+	sim.reset();
+	rx_bytes = 0;
+	payload_len = 100;
+
+	fill_ipv4(1);
+	bool ok = dev->at_query(XBEE_AT_ADDR_NODEID, value, &len, sizeof(value));
+	fill_ipv4(1);
+	ok = dev->transmit(peer, &opts, payload, 16, true) && ok;
+	fill_ipv4(1);
+	ok = dev->at_remquery(node, XBEE_AT_ADDR_NODEID, value, &len, sizeof(value)) && ok;
+
+	dev->get_stats(&after);
+	printf("nested rx                 %lu of 300 bytes delivered around AT query, confirmed transmit and remote query\n", rx_bytes);
+	if (!ok || rx_bytes != 300 || after.rx_dropped != before.rx_dropped) {
+		printf("  ** %s, %lu of 300 bytes delivered, %u dropped\n", ok ? "commands succeeded" : "commands failed", rx_bytes, after.rx_dropped - before.rx_dropped);
+	}
+}
+
+// XbeeWifiBuffered in packet mode, fed segments directly as rx_ip would deliver them
+class BufferedProbe : public XbeeWifiBuffered
+{
+	public:
+	BufferedProbe(uint16_t bufsize) : XbeeWifiBuffered(bufsize, true) {}
+
+	void segment(const uint8_t *data, int len, int offset, int total, bool final)
+	{
+		s_rxinfo info;
+		memset(&info, 0, sizeof(info));
+		memcpy(info.source_addr, peer, 4);
+		info.source_port = 5000;
+		info.dest_port = 12345;
+		info.protocol = XBEE_NET_IPPROTO_UDP;
+		info.total_packet_length = total;
+		info.current_offset = offset;
+		info.final = final;
+		dispatch((uint8_t *) data, len, &info);
+	}
+};
+
+// Packets abandoned part way through must give back the room reserved for them
+static void bench_buffered()
+{
+	BufferedProbe buf(256);
+	if (!buf.init(PIN_CS, PIN_ATN, PIN_RESET, PIN_DOUT)) {
+		printf("  ** buffered init failed\n");
+		return;
+	}
+	uint8_t out[256];
+	int fit = 256 / (sizeof(s_pktinfo) + 40);
+	int bad = 0;
+
+	// A packet cut short by the start of the next, and one running past its declared length
+	buf.segment(payload, 30, 0, 100, false);
+	buf.segment(payload + 1, 20, 0, 20, true);
+	buf.segment(payload, 15, 0, 20, false);
+	buf.segment(payload + 15, 10, 15, 20, true);
+	buf.segment(payload + 2, 20, 0, 20, true);
+	for (int i = 1; i <= 2; i++) {
+		int n = buf.readPacket(out, sizeof(out));
+		if (n != 20 || memcmp(out, payload + i, 20)) bad++;
+	}
+	if (buf.readPacket(out, sizeof(out)) != -1) bad++;
+
+	// All of the ring is free again, and takes exactly as many whole packets as fit
+	for (int i = 0; i <= fit; i++) buf.segment(payload + i, 40, 0, 40, true);
+	if (!buf.overran()) bad++;
+	for (int i = 0; i < fit; i++) {
+		int n = buf.readPacket(out, sizeof(out));
+		if (n != 40 || memcmp(out, payload + i, 40)) bad++;
+	}
+	if (buf.readPacket(out, sizeof(out)) != -1) bad++;
+
+	printf("buffered packets          2 abandoned, 2 kept, %d of %d filled and read back\n", fit, fit);
+	if (bad) printf("  ** %d packets wrong after abandoned packets\n", bad);
+
+	// The Stream methods count and read bytes of one packet at a time
+	bad = 0;
+	buf.segment(payload, 30, 0, 30, true);
+	buf.segment(payload + 1, 20, 0, 20, true);
+	if (buf.packetsAvailable() != 2 || buf.available() != 30 || buf.peek() != payload[0]) bad++;
+	if (buf.read(out, 10) != 10 || memcmp(out, payload, 10) || buf.available() != 20) bad++;
+	if (buf.readPacket(out, sizeof(out)) != 20 || memcmp(out, payload + 10, 20)) bad++;
+	int n = 0;
+	while (buf.available() > 0 && n < (int) sizeof(out)) out[n++] = buf.read();
+	if (n != 20 || memcmp(out, payload + 1, 20) || buf.packetsAvailable() != 0 || buf.read() != -1) bad++;
+	printf("buffered stream           2 packets read by byte count\n");
+	if (bad) printf("  ** %d wrong byte counts or reads in packet mode\n", bad);
+}
+
+// AT command round trips, local and remote
+static void bench_at(unsigned long frames, bool remote)
+{
+	uint8_t node[4] = { 192, 168, 1, 20 };
+	uint8_t value[16];
+	int len;
+	static const uint8_t ni[] = { 'n', 'o', 'd', 'e' };
+	sim.set_param("NI", ni, sizeof(ni));
+	sim.set_remote_param(node, "NI", ni, sizeof(ni));
+
+	sim.reset();
+	unsigned long ok = 0;
+	unsigned long long start = cpu_ns();
+	for (unsigned long i = 0; i < frames; i++) {
+		bool res = remote ?
+			dev->at_remquery(node, XBEE_AT_ADDR_NODEID, value, &len, sizeof(value)) :
+			dev->at_query(XBEE_AT_ADDR_NODEID, value, &len, sizeof(value));
+		if (res) ok++;
+	}
+	unsigned long long total = cpu_ns() - start;
+	report(remote ? "at_remquery NI" : "at_query NI", frames, total, sim.bytes_clocked);
+	if (ok != frames) printf("  ** %lu of %lu succeeded\n", ok, frames);
+}
+
+// Queries of a cached parameter, where only the first goes to the module
+static void bench_at_cached(unsigned long frames)
+{
+	uint8_t value[16];
+	int len;
+	dev->clear_at_cache();
+	dev->reset_at_cache_stats();
+
+	// The first query goes to the module and fills the cache, only the ones answered from RAM
+	// are timed. No bytes are clocked for those, so the cost is given per query
+	sim.reset();
+	unsigned long ok = dev->at_query(XBEE_AT_ADDR_SERNO_LOW, value, &len, sizeof(value)) ? 1 : 0;
+	unsigned long pins = sim.pin_calls;
+	unsigned long long start = cpu_ns();
+	for (unsigned long i = 0; i < frames; i++) {
+		if (dev->at_query(XBEE_AT_ADDR_SERNO_LOW, value, &len, sizeof(value))) ok++;
+	}
+	unsigned long long total = cpu_ns() - start;
+	printf("%-24s %8lu queries %11.0f queries/s %28.1f ns/query %5.1f pin/query\n", "at_query SL cached", frames, frames / (total / 1e9), (double) total / frames, (double) (sim.pin_calls - pins) / frames);
+	if (ok != frames + 1) printf("  ** %lu of %lu succeeded\n", ok, frames + 1);
+
+	s_atcache_stats cs;
+	dev->get_at_cache_stats(&cs);
+	if (cs.hits != frames || cs.misses != 1 || sim.at_commands != 1) {
+		printf("  ** %u hits, %u misses, %lu AT commands sent\n", cs.hits, cs.misses, sim.at_commands);
+	}
+
+	// A queued write takes effect at AC, so a query in between caches the old value and AC
+	// must discard it again
+	uint8_t old_np[2], new_np[2];
+	bool np_ok = dev->at_query(XBEE_AT_ADDR_MAX_RF_PAYLOAD_BYTES, old_np, &len, sizeof(old_np)) && len == 2;
+	np_ok = dev->at_cmd_short(XBEE_AT_ADDR_MAX_RF_PAYLOAD_BYTES, 1000, true) && np_ok;
+	np_ok = dev->at_query(XBEE_AT_ADDR_MAX_RF_PAYLOAD_BYTES, value, &len, sizeof(value)) && len == 2 && !memcmp(value, old_np, 2) && np_ok;
+	dev->reset_at_cache_stats();
+	np_ok = dev->at_cmd_noparm(XBEE_AT_EXEC_APPLY_CHANGES) && np_ok;
+	np_ok = dev->at_query(XBEE_AT_ADDR_MAX_RF_PAYLOAD_BYTES, new_np, &len, sizeof(new_np)) && len == 2 && np_ok;
+	dev->get_at_cache_stats(&cs);
+	printf("%-24s NP %u before AC, %u after, %u miss after AC\n", "at_query queued write", (old_np[0] << 8) | old_np[1], (new_np[0] << 8) | new_np[1], cs.misses);
+	if (!np_ok || cs.misses != 1 || cs.hits != 0 || new_np[0] != 1000 >> 8 || new_np[1] != (1000 & 0xFF)) {
+		printf("  ** stale NP answered from the cache after AC\n");
+	}
+	sim.set_param("NP", old_np, 2);
+	dev->clear_at_cache();
+}
+
+// Two configurations differing in every readable setting
+static const s_atsetting profile_a[] = {
+	XBEE_SETTING_BYTE(XBEE_AT_NET_TYPE, XBEE_NET_TYPE_IBSS_INFRASTRUCTURE),
+	XBEE_SETTING_STR(XBEE_AT_NET_SSID, "Example"),
+	XBEE_SETTING_BYTE(XBEE_AT_NET_ADDRMODE, XBEE_NET_ADDRMODE_DHCP),
+	XBEE_SETTING_BYTE(XBEE_AT_NET_IPPROTO, XBEE_NET_IPPROTO_UDP),
+	XBEE_SETTING_SHORT(XBEE_AT_ADDR_SERIAL_COM_SERVICE_PORT, 12345),
+	XBEE_SETTING_BYTE(XBEE_AT_SEC_ENCTYPE, XBEE_SEC_ENCTYPE_WPA2),
+	XBEE_SETTING_KEY(XBEE_AT_SEC_KEY, "whatever")
+};
+static const s_atsetting profile_b[] = {
+	XBEE_SETTING_BYTE(XBEE_AT_NET_TYPE, XBEE_NET_TYPE_IBSS_CREATOR),
+	XBEE_SETTING_STR(XBEE_AT_NET_SSID, "Other"),
+	XBEE_SETTING_BYTE(XBEE_AT_NET_ADDRMODE, XBEE_NET_ADDRMODE_STATIC),
+	XBEE_SETTING_BYTE(XBEE_AT_NET_IPPROTO, XBEE_NET_IPPROTO_TCP),
+	XBEE_SETTING_SHORT(XBEE_AT_ADDR_SERIAL_COM_SERVICE_PORT, 9750),
+	XBEE_SETTING_BYTE(XBEE_AT_SEC_ENCTYPE, XBEE_SEC_ENCTYPE_WPA),
+	XBEE_SETTING_KEY(XBEE_AT_SEC_KEY, "whatever")
+};
+#define PROFILE_SETTINGS (int) (sizeof(profile_a) / sizeof(s_atsetting))
+
+// Boot time configuration: the usual run of confirmed at_cmd_xxx calls and WR, against
+// apply_profile where every setting has changed and where none has
+static void bench_profile(unsigned long boots)
+{
+	sim.reset();
+	unsigned long long start = cpu_ns();
+	for (unsigned long i = 0; i < boots; i++) {
+		dev->at_cmd_byte(XBEE_AT_NET_TYPE, XBEE_NET_TYPE_IBSS_INFRASTRUCTURE);
+		dev->at_cmd_str(XBEE_AT_NET_SSID, "Example");
+		dev->at_cmd_byte(XBEE_AT_NET_ADDRMODE, XBEE_NET_ADDRMODE_DHCP);
+		dev->at_cmd_byte(XBEE_AT_NET_IPPROTO, XBEE_NET_IPPROTO_UDP);
+		dev->at_cmd_short(XBEE_AT_ADDR_SERIAL_COM_SERVICE_PORT, 12345);
+		dev->at_cmd_byte(XBEE_AT_SEC_ENCTYPE, XBEE_SEC_ENCTYPE_WPA2);
+		dev->at_cmd_str(XBEE_AT_SEC_KEY, "whatever");
+		dev->at_cmd_noparm(XBEE_AT_EXEC_WRITE);
+	}
+	unsigned long long total = cpu_ns() - start;
+	printf("%-24s %8lu boots  %10.0f ns/boot  %5.1f AT/boot  %4.2f WR/boot\n", "at_cmd_xxx, WR", boots, (double) total / boots, (double) sim.at_commands / boots, (double) sim.flash_writes / boots);
+
+	for (int changed = 1; changed >= 0; changed--) {
+		dev->apply_profile(profile_a, PROFILE_SETTINGS);
+		sim.reset();
+		unsigned long bad = 0;
+		start = cpu_ns();
+		for (unsigned long i = 0; i < boots; i++) {
+			const s_atsetting *profile = (changed && (i & 1) == 0) ? profile_b : profile_a;
+			if (dev->apply_profile(profile, PROFILE_SETTINGS) != (changed ? PROFILE_SETTINGS : 0)) bad++;
+		}
+		total = cpu_ns() - start;
+		printf("%-24s %8lu boots  %10.0f ns/boot  %5.1f AT/boot  %4.2f WR/boot\n", changed ? "apply_profile changed" : "apply_profile unchanged", boots, (double) total / boots, (double) sim.at_commands / boots, (double) sim.flash_writes / boots);
+		if (bad) printf("  ** %lu boots sent the wrong number of settings\n", bad);
+		if (sim.at_applies != (changed ? boots : 0)) printf("  ** %lu AC sent\n", sim.at_applies);
+	}
+
+	// A new key alone can't be seen, so it is sent only with force
+	s_atsetting keyed[PROFILE_SETTINGS];
+	s_atsetting key = XBEE_SETTING_KEY(XBEE_AT_SEC_KEY, "changed");
+	memcpy(keyed, profile_a, sizeof(keyed));
+	keyed[PROFILE_SETTINGS - 1] = key;
+	sim.reset();
+	int plain = dev->apply_profile(keyed, PROFILE_SETTINGS);
+	int forced = dev->apply_profile(keyed, PROFILE_SETTINGS, false, true, true);
+	std::vector<uint8_t> pk;
+	bool sent = sim.get_param("PK", &pk) && pk.size() == 7 && memcmp(&pk[0], "changed", 7) == 0;
+	printf("%-24s %d sent without force, %d with force, %lu AC, %lu WR\n", "apply_profile key only", plain, forced, sim.at_applies, sim.flash_writes);
+	if (plain != 0 || forced != 1 || !sent || sim.at_applies != 1 || sim.flash_writes != 1) printf("  ** key change %s\n", sent ? "applied wrongly" : "not sent");
+	dev->apply_profile(profile_a, PROFILE_SETTINGS, false, true, true);
+}
+
+// Remote nodes brought into line with profile_a, a third of them having drifted on SSID and
+// port, and some switched off (as for the fan-out)
+#define SYNC_DRIFT ((1UL << 1) | (1UL << 4))
+static unsigned long sync_ok, sync_drifted, sync_timeouts, sync_wrong;
+static bool sync_corrected;
+
+static void sync_done(int index, uint8_t status, uint32_t drift)
+{
+	bool dead = index % (FANOUT_NODES / FANOUT_DEAD) == 0;
+	bool drifted = !sync_corrected && index % 3 == 1;
+	if (status == XBEE_AT_STATUS_OK) sync_ok++;
+	if (status == XBEE_AT_STATUS_TIMEOUT) sync_timeouts++;
+	if (drift) sync_drifted++;
+	if (dead ? status != XBEE_AT_STATUS_TIMEOUT : drift != (drifted ? SYNC_DRIFT : 0)) sync_wrong++;
+}
+
+static void bench_remote_profile()
+{
+	static uint8_t nodes[FANOUT_NODES][4];
+	static const uint8_t ah[] = { XBEE_NET_TYPE_IBSS_INFRASTRUCTURE };
+	static const uint8_t ma[] = { XBEE_NET_ADDRMODE_DHCP };
+	static const uint8_t ip[] = { XBEE_NET_IPPROTO_UDP };
+	static const uint8_t ee[] = { XBEE_SEC_ENCTYPE_WPA2 };
+	static const uint8_t c0[] = { 12345 >> 8, 12345 & 0xFF };
+	static const uint8_t c0_old[] = { 0x26, 0x16 };
+	for (int i = 0; i < FANOUT_NODES; i++) {
+		nodes[i][0] = 10;
+		nodes[i][1] = 1;
+		nodes[i][2] = 0;
+		nodes[i][3] = i + 1;
+		if (i % (FANOUT_NODES / FANOUT_DEAD) == 0) continue;
+		bool drifted = i % 3 == 1;
+		sim.set_remote_param(nodes[i], XBEE_AT_NET_TYPE, ah, sizeof(ah));
+		sim.set_remote_param(nodes[i], XBEE_AT_NET_SSID, (const uint8_t *) (drifted ? "Other" : "Example"), drifted ? 5 : 7);
+		sim.set_remote_param(nodes[i], XBEE_AT_NET_ADDRMODE, ma, sizeof(ma));
+		sim.set_remote_param(nodes[i], XBEE_AT_NET_IPPROTO, ip, sizeof(ip));
+		sim.set_remote_param(nodes[i], XBEE_AT_ADDR_SERIAL_COM_SERVICE_PORT, drifted ? c0_old : c0, 2);
+		sim.set_remote_param(nodes[i], XBEE_AT_SEC_ENCTYPE, ee, sizeof(ee));
+	}
+
+	// The first pass corrects the drift, the second should find none
+	for (int pass = 0; pass < 2; pass++) {
+		sim.reset();
+		sync_ok = sync_drifted = sync_timeouts = sync_wrong = 0;
+		sync_corrected = pass > 0;
+		unsigned long long start = xbee_sim_micros();
+		if (!dev->apply_remote_profile(nodes, FANOUT_NODES, profile_a, PROFILE_SETTINGS, false, true, false, sync_done, XBEE_AT_PENDING, FANOUT_TIMEOUT_MS)) {
+			printf("  ** sync refused\n");
+			return;
+		}
+		while (dev->at_fanout_pending() > 0) dev->process();
+		double ms = (xbee_sim_micros() - start) / 1000.0;
+		printf("apply_remote_profile %-4s%8d nodes  %6.1f ms, %lu in line, %lu drifted, %lu timed out, %.1f AT/node\n", pass ? "2nd" : "1st", FANOUT_NODES, ms, sync_ok - sync_drifted, sync_drifted, sync_timeouts, (double) sim.remote_commands / FANOUT_NODES);
+		if (sync_wrong) printf("  ** %lu nodes reported wrongly\n", sync_wrong);
+		if (sync_ok + sync_timeouts != FANOUT_NODES) printf("  ** %lu nodes failed\n", FANOUT_NODES - sync_ok - sync_timeouts);
+	}
+}
+
+int main()
+{
+	for (unsigned int i = 0; i < sizeof(payload); i++) payload[i] = i;
+
+	calibrate();
+	printf("Simulator overhead %.2f ns/byte (subtracted)\n\n", sim_ns_per_byte);
+
+	// Full reset through the RESET / DOUT lines, answered by a modem status frame
+	if (!xbee.init(PIN_CS, PIN_ATN, PIN_RESET, PIN_DOUT)) {
+		printf("init failed\n");
+		return 1;
+	}
+	dev->register_ip_data_callback(ip_rx);
+	dev->register_sample_callback(sample_rx);
+	dev->register_status_callback(status_rx);
+	dev->register_tx_status_callback(tx_status);
+
+	bench_rx_ip("rx_ipv4", 16, 50000, fill_ipv4);
+	bench_rx_ip("rx_ipv4", 128, 50000, fill_ipv4);
+	bench_rx_ip("rx_ipv4", 1400, 10000, fill_ipv4);
+	bench_rx_ip("rx_compat", 128, 50000, fill_compat);
+
+	// Routed to a per port handler, with other handlers registered alongside it
+	static const uint8_t other[4] = { 10, 0, 0, 1 };
+	dev->register_ip_port_callback(80, stray_rx);
+	dev->register_ip_port_callback(12345, stray_rx, other);
+	dev->register_ip_port_callback(0, stray_rx, other, 1234);
+	dev->register_ip_port_callback(12345, ip_rx);
+	dev->register_ip_data_callback(stray_rx);
+	bench_rx_ip("rx_ipv4 routed", 128, 50000, fill_ipv4);
+	dev->register_ip_port_callback(80, NULL);
+	dev->register_ip_port_callback(12345, NULL, other);
+	dev->register_ip_port_callback(0, NULL, other, 1234);
+	dev->register_ip_port_callback(12345, NULL);
+	dev->register_ip_data_callback(ip_rx);
+
+	dev->register_ip_stream_callback(ip_stream);
+	bench_rx_ip("rx_ipv4 stream", 128, 50000, fill_ipv4);
+	bench_rx_ip("rx_ipv4 stream", 1400, 10000, fill_ipv4);
+	if (stream_bad) printf("  ** %lu checksum failures\n", stream_bad);
+	dev->register_ip_stream_callback(NULL);
+
+	dev->enable_rx_pool(&pool[0][0], sizeof(pool[0]), 4, ip_pool);
+	bench_rx_ip("rx_ipv4 pool", 128, 50000, fill_ipv4);
+	bench_rx_ip("rx_ipv4 pool", 1400, 10000, fill_ipv4);
+	dev->release_rx_block(pool_held);
+	if (dev->rx_pool_free() != 4) printf("  ** %d pool blocks lost\n", 4 - dev->rx_pool_free());
+	dev->enable_rx_pool(NULL, 0, 0, NULL);
+
+	samples = 0;
+	run_rx("io_sample", 50000, fill_sample);
+	if (samples != 50000 || samples_bad) printf("  ** delivered %lu samples, %lu misdecoded\n", samples, samples_bad);
+	bench_sample_store(64000);
+
+	statuses = 0;
+	run_rx("modem_status", 50000, fill_status);
+	if (statuses != 50000) printf("  ** delivered %lu statuses\n", statuses);
+
+	// Idle process() calls, polling ATN and then in ATN interrupt mode, where traffic is
+	// also checked to still be delivered
+	bench_idle("process idle", 1000000);
+	dev->enable_atn_interrupt();
+	bench_idle("process idle atn irq", 1000000);
+	bench_rx_ip("rx_ipv4 atn irq", 128, 50000, fill_ipv4);
+	dev->enable_atn_interrupt(false);
+
+	bench_tx(16, 50000, false, false);
+	bench_tx(128, 50000, false, false);
+	bench_tx(1400, 10000, false, false);
+	bench_tx(128, 50000, true, false);
+	bench_tx(128, 50000, false, true);
+	bench_txv(128, 50000);
+	bench_tx_queued(16, 50000);
+	bench_tx_async(128, 50000);
+	bench_fragments(10000);
+
+	bench_nested_rx();
+	bench_at(50000, false);
+	bench_at_cached(1000000);
+	bench_at(50000, true);
+	bench_at_async(50000, false);
+	bench_at_async(50000, true);
+	bench_fanout();
+	bench_profile(10000);
+	bench_remote_profile();
+
+	// SPI clock calibration, against wiring that carries 2.5Mhz cleanly but no faster
+	sim.reset();
+	sim.reliable_hz = 2500000UL;
+	unsigned long long cal_start = cpu_ns();
+	unsigned long hz = dev->calibrate_spi_clock();
+	double cal_ms = (cpu_ns() - cal_start) / 1e6;
+	printf("calibrate_spi_clock       %lu Hz in %.1f ms, %lu AT queries (wiring clean to %lu Hz)\n", hz, cal_ms, sim.at_commands, sim.reliable_hz);
+	if (hz == 0 || hz > sim.reliable_hz) printf("  ** settled on an unreliable clock\n");
+	sim.reliable_hz = 0;
+	dev->set_spi_clock(XBEE_SPI_MASTER_HZ / SPI_BUS_DIVISOR);
+
+	bench_buffered();
+
+	// Working buffer arena use of the plain XbeeWifi object, per call path
+	static const char *paths[XBEE_PATHS] = { "process", "rx_ip", "at", "transmit", "init" };
+	s_memfootprint fp;
+	xbee.get_memfootprint(&fp);
+	printf("\nXbeeWifi memory: object %u bytes, arena %u bytes (%s)\n", fp.object, fp.arena, fp.arena_allocated ? "allocated" : "provided");
+	printf("%-10s %8s %8s %10s %8s\n", "path", "arena", "stack", "borrows", "failed");
+	for (int i = 0; i < XBEE_PATHS; i++) {
+		s_memstats ms;
+		xbee.get_memstats(i, &ms);
+		printf("%-10s %8u %8u %10u %8u\n", paths[i], ms.arena_peak, ms.stack_peak, ms.borrows, ms.failures);
+	}
+
+	// Driver statistics of the plain XbeeWifi object over the whole run
+	static const char *rx_classes[XBEE_STATS_RX_TYPES] = { "ip", "sample", "modem", "tx status", "at resp", "other" };
+	static const char *tx_classes[XBEE_STATS_TX_TYPES] = { "ip", "at" };
+	s_stats st;
+	xbee.get_stats(&st);
+	printf("\nXbeeWifi statistics\n");
+	for (int i = 0; i < XBEE_STATS_RX_TYPES; i++) {
+		printf("rx %-10s %10u frames %12u bytes\n", rx_classes[i], st.rx_frames[i], st.rx_bytes[i]);
+	}
+	for (int i = 0; i < XBEE_STATS_TX_TYPES; i++) {
+		printf("tx %-10s %10u frames %12u bytes\n", tx_classes[i], st.tx_frames[i], st.tx_bytes[i]);
+	}
+	printf("errors: checksum %u, truncated %u, invalid start %u, flushed %u, unsupported %u, dropped %u, overruns %u\n",
+		st.checksum_errors, st.truncated, st.invalid_start, st.flushed_bytes, st.unsupported, st.rx_dropped, st.buffer_overruns);
+	printf("atn: %u timeouts, %u us waiting for responses; %u SPI bytes\n", st.atn_timeouts, st.atn_wait_us, st.spi_bytes);
+
+	return 0;
+}
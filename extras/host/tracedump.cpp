@@ -0,0 +1,109 @@
+/*
+ * File			tracedump.cpp
+ *
+ * Synopsis		Decoder for the binary trace written by XbeeWifi::dump_trace
+ *
+ * Author		Chris Bearman
+ *
+ * Version		1.0
+ *
+ * License		This software is released under the terms of the Mozilla Public License (MPL) version 2.0
+ * 			Full details of licensing terms can be found in the "LICENSE" file, distributed with this code
+ *
+ * Instructions		make -C extras/host tracedump
+ *			extras/host/tracedump < serial.log
+ *
+ *			Reads a captured serial log, picks out the XT lines written by dump_trace and
+ *			prints one decoded event per line, with the time since the first record and since
+ *			the previous one. Any other lines in the log are ignored
+ */
+#include <XbeeWifi.h>
+#include <stdio.h>
+
+// Name of an API frame type
+static const char *frame_name(uint8_t type)
+{
+	switch(type) {
+		case XBEE_API_FRAME_TX64		: return "TX64";
+		case XBEE_API_FRAME_REMOTE_CMD_REQ	: return "REMOTE_AT";
+		case XBEE_API_FRAME_ATCMD		: return "AT";
+		case XBEE_API_FRAME_ATCMD_QUEUED	: return "AT_QUEUED";
+		case XBEE_API_FRAME_TX_IPV4		: return "TX_IPV4";
+		case XBEE_API_FRAME_RX64_INDICATOR	: return "RX64";
+		case XBEE_API_FRAME_REMOTE_CMD_RESP	: return "REMOTE_AT_RESP";
+		case XBEE_API_FRAME_ATCMD_RESP		: return "AT_RESP";
+		case XBEE_API_FRAME_TX_STATUS		: return "TX_STATUS";
+		case XBEE_API_FRAME_MODEM_STATUS	: return "MODEM_STATUS";
+		case XBEE_API_FRAME_IO_DATA_SAMPLE_RX	: return "IO_SAMPLE";
+		case XBEE_API_FRAME_RX_IPV4		: return "RX_IPV4";
+		default					: return "?";
+	}
+}
+
+// Name of an XBEE_TRACE_RX_FAIL reason
+static const char *fail_name(uint8_t result)
+{
+	switch(result) {
+		case XBEE_TRACE_FAIL_INVALID_START	: return "invalid start byte";
+		case XBEE_TRACE_FAIL_TRUNCATED		: return "truncated";
+		case XBEE_TRACE_FAIL_CHECKSUM		: return "checksum";
+		case XBEE_TRACE_FAIL_UNSUPPORTED	: return "unsupported type";
+		case XBEE_TRACE_FAIL_NO_BUFFER		: return "no buffer";
+		case XBEE_TRACE_FAIL_INVALID		: return "invalid";
+		default					: return "?";
+	}
+}
+
+int main()
+{
+	char line[256];
+	bool first = true;
+	unsigned long origin = 0, last = 0, records = 0;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		unsigned long time_us;
+		unsigned int event, type, len, result;
+		if (sscanf(line, "XT %lx %x %x %x %x", &time_us, &event, &type, &len, &result) != 5) continue;
+		if (first) {
+			origin = last = time_us;
+			first = false;
+		}
+		// The recorded time is 32 bit micros(), so differences wrap cleanly
+		printf("%12.3f ms %+10ld us  ", (uint32_t) (time_us - origin) / 1000.0, (long) (uint32_t) (time_us - last));
+		last = time_us;
+		records++;
+
+		switch(event) {
+			case XBEE_TRACE_RX_FRAME	:
+				printf("rx    %-14s len %u\n", frame_name(type), len);
+				break;
+			case XBEE_TRACE_RX_FAIL		:
+				if (result == XBEE_TRACE_FAIL_INVALID_START) {
+					printf("FAIL  %s, read 0x%02X\n", fail_name(result), type);
+				} else {
+					printf("FAIL  %-14s len %u, %s\n", frame_name(type), len, fail_name(result));
+				}
+				break;
+			case XBEE_TRACE_TX_FRAME	:
+				printf("tx    %-14s len %u, frame id %u\n", frame_name(type), len, result);
+				break;
+			case XBEE_TRACE_TX_STATUS	:
+				printf("txst  frame id %u, status 0x%02X%s\n", type, result, result == XBEE_TX_STATUS_SUCCESS ? " (success)" : "");
+				break;
+			case XBEE_TRACE_MODEM_STATUS	:
+				printf("modem status 0x%02X\n", result);
+				break;
+			case XBEE_TRACE_ATN_TIMEOUT	:
+				printf("FAIL  no ATN within %u ms\n", len);
+				break;
+			case XBEE_TRACE_FLUSH		:
+				printf("flush %u bytes discarded\n", len);
+				break;
+			default				:
+				printf("event 0x%02X type 0x%02X len %u result 0x%02X\n", event, type, len, result);
+				break;
+		}
+	}
+	fprintf(stderr, "%lu records\n", records);
+	return 0;
+}
@@ -0,0 +1,499 @@
+/*
+ * File			xbee_sim.cpp
+ *
+ * Synopsis		Simulated Xbee Wifi module for host (Linux) builds of the library
+ *
+ * Author		Chris Bearman
+ *
+ * Version		1.0
+ *
+ * License		This software is released under the terms of the Mozilla Public License (MPL) version 2.0
+ * 			Full details of licensing terms can be found in the "LICENSE" file, distributed with this code
+ *
+ * Instructions		See xbee_sim.h
+ */
+#include "xbee_sim.h"
+#include <XbeeWifi.h>
+#include <time.h>
+
+// Parser states for frames received from the host
+#define SIM_WAIT_START	0
+#define SIM_LEN_MSB	1
+#define SIM_LEN_LSB	2
+#define SIM_BODY	3
+
+XbeeSim *xbee_sim = NULL;
+
+// Virtual time accumulated through delays and bus clocking
+static unsigned long long virtual_ns = 0;
+
+// Real monotonic time, nanoseconds
+static unsigned long long real_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long xbee_sim_micros()
+{
+	static unsigned long long epoch = real_ns();
+	return (real_ns() - epoch + virtual_ns) / 1000ULL;
+}
+
+// Pack an IP address for use as a map key
+static uint32_t ip_key(const uint8_t *ip)
+{
+	return ((uint32_t) ip[0] << 24) | ((uint32_t) ip[1] << 16) | ((uint32_t) ip[2] << 8) | ip[3];
+}
+
+XbeeSim::XbeeSim(uint8_t cs, uint8_t atn, uint8_t reset) :
+	auto_tx_status(true),
+	tx_status_code(0x00),
+	loopback(false),
+	auto_at_response(true),
+	spi_hz(1000000UL),
+	reliable_hz(0),
+	pin_cs(cs),
+	pin_atn(atn),
+	pin_reset(reset),
+	selected(false),
+	in_reset(false),
+	atn_low(false),
+	atn_isr(NULL),
+	noise(0)
+{
+	this->reset();
+	xbee_sim = this;
+
+	// Some plausible identity values for queries
+	static const uint8_t vr[] = { 0x20, 0x2B };
+	static const uint8_t hv[] = { 0x1F, 0x42 };
+	static const uint8_t sh[] = { 0x00, 0x13, 0xA2, 0x00 };
+	static const uint8_t sl[] = { 0x40, 0x8B, 0x12, 0x34 };
+	static const uint8_t my[] = { 192, 168, 1, 2 };
+	static const uint8_t np[] = { 0x05, 0xDC };
+	static const uint8_t dd[] = { 0x00, 0x0F, 0x00, 0x00 };
+	set_param("VR", vr, sizeof(vr));
+	set_param("HV", hv, sizeof(hv));
+	set_param("SH", sh, sizeof(sh));
+	set_param("SL", sl, sizeof(sl));
+	set_param("MY", my, sizeof(my));
+	set_param("NP", np, sizeof(np));
+	set_param("DD", dd, sizeof(dd));
+}
+
+// Discard all queued data and counters (parameters are kept)
+void XbeeSim::reset()
+{
+	outq.clear();
+	outpos = 0;
+	state = SIM_WAIT_START;
+	inlen = 0;
+	inbuf.clear();
+	frames_in = frames_in_bad = 0;
+	at_commands = at_applies = flash_writes = remote_commands = tx_frames = tx_bytes = 0;
+	bytes_clocked = 0;
+	bus_ns = 0;
+	atn_edges = 0;
+	pin_calls = 0;
+	last_type = 0;
+	last_frame.clear();
+	update_atn();
+}
+
+// Queue an API frame for delivery to the host, adding framing and checksum
+void XbeeSim::queue_frame(uint8_t type, const uint8_t *data, int len)
+{
+	// Compact the queue once everything before outpos has been consumed
+	if (outpos == outq.size()) {
+		outq.clear();
+		outpos = 0;
+	}
+	uint8_t cs = type;
+	outq.push_back(0x7E);
+	outq.push_back((len + 1) >> 8);
+	outq.push_back((len + 1) & 0xFF);
+	outq.push_back(type);
+	for (int i = 0; i < len; i++) {
+		outq.push_back(data[i]);
+		cs += data[i];
+	}
+	outq.push_back(0xFF - cs);
+	update_atn();
+}
+
+// Queue an IPv4 reception frame
+void XbeeSim::queue_rx_ipv4(const uint8_t *ip, uint16_t dest_port, uint16_t source_port, uint8_t protocol, const uint8_t *data, int len)
+{
+	std::vector<uint8_t> f(10 + len);
+	memcpy(&f[0], ip, 4);
+	f[4] = dest_port >> 8;
+	f[5] = dest_port & 0xFF;
+	f[6] = source_port >> 8;
+	f[7] = source_port & 0xFF;
+	f[8] = protocol;
+	f[9] = 0x00;
+	if (len > 0) memcpy(&f[10], data, len);
+	queue_frame(XBEE_API_FRAME_RX_IPV4, &f[0], f.size());
+}
+
+// Queue a compatability mode reception frame
+// The source address is 64 bit, with the IP address placed where the library expects it
+void XbeeSim::queue_rx_compat(const uint8_t *ip, const uint8_t *data, int len)
+{
+	std::vector<uint8_t> f(10 + len);
+	memset(&f[0], 0, 10);
+	memcpy(&f[3], ip, 4);
+	f[8] = 0x28;	// RSSI
+	f[9] = 0x00;	// Options
+	if (len > 0) memcpy(&f[10], data, len);
+	queue_frame(XBEE_API_FRAME_RX64_INDICATOR, &f[0], f.size());
+}
+
+// Queue a modem status frame
+void XbeeSim::queue_modem_status(uint8_t status)
+{
+	queue_frame(XBEE_API_FRAME_MODEM_STATUS, &status, 1);
+}
+
+// Queue an IO sample frame
+void XbeeSim::queue_io_sample(const uint8_t *ip, uint16_t digital_mask, uint8_t analog_mask, uint16_t digital_samples, const uint16_t *analog)
+{
+	std::vector<uint8_t> f(14, 0);
+	memcpy(&f[4], ip, 4);		// 64 bit source, IP in the low four bytes
+	f[8] = 0x28;			// RSSI
+	f[9] = 0x00;			// Options
+	f[10] = 1;			// Sample sets
+	f[11] = digital_mask >> 8;
+	f[12] = digital_mask & 0xFF;
+	f[13] = analog_mask;
+	if (digital_mask) {
+		f.push_back(digital_samples >> 8);
+		f.push_back(digital_samples & 0xFF);
+	}
+	int n = 0;
+	for (int bit = 0; bit < 8; bit++) {
+		if (analog_mask & (1 << bit)) {
+			f.push_back(analog[n] >> 8);
+			f.push_back(analog[n] & 0xFF);
+			n++;
+		}
+	}
+	queue_frame(XBEE_API_FRAME_IO_DATA_SAMPLE_RX, &f[0], f.size());
+}
+
+// Queue an active scan result
+void XbeeSim::queue_scan_result(uint8_t frame_id, uint8_t encryption, uint8_t rssi, const char *ssid)
+{
+	std::vector<uint8_t> f(8, 0);
+	f[0] = frame_id;
+	f[1] = 'A';
+	f[2] = 'S';
+	f[3] = 0x00;
+	f[4] = 0x02;		// Version
+	f[5] = 0x01;		// Channel
+	f[6] = encryption;
+	f[7] = rssi;
+	f.insert(f.end(), ssid, ssid + strlen(ssid));
+	queue_frame(XBEE_API_FRAME_ATCMD_RESP, &f[0], f.size());
+}
+
+// Parameter access
+void XbeeSim::set_param(const char *atxx, const uint8_t *value, int len)
+{
+	params[std::string(atxx, 2)].assign(value, value + len);
+}
+
+void XbeeSim::set_param(const char *atxx, const char *value)
+{
+	set_param(atxx, (const uint8_t *) value, strlen(value));
+}
+
+void XbeeSim::add_remote(const uint8_t *ip)
+{
+	remotes[ip_key(ip)];
+}
+
+void XbeeSim::set_remote_param(const uint8_t *ip, const char *atxx, const uint8_t *value, int len)
+{
+	remotes[ip_key(ip)][std::string(atxx, 2)].assign(value, value + len);
+}
+
+bool XbeeSim::get_param(const char *atxx, std::vector<uint8_t> *value)
+{
+	t_params::iterator it = params.find(std::string(atxx, 2));
+	if (it == params.end()) return false;
+	*value = it->second;
+	return true;
+}
+
+bool XbeeSim::get_remote_param(const uint8_t *ip, const char *atxx, std::vector<uint8_t> *value)
+{
+	std::map<uint32_t, t_params>::iterator node = remotes.find(ip_key(ip));
+	if (node == remotes.end()) return false;
+	t_params::iterator it = node->second.find(std::string(atxx, 2));
+	if (it == node->second.end()) return false;
+	*value = it->second;
+	return true;
+}
+
+// Clock n bytes. Data flows out of the module queue, into the host frame parser
+void XbeeSim::spi_transfer(const uint8_t *tx, uint8_t *rx, int n)
+{
+	if (!tx && state == SIM_WAIT_START && !(reliable_hz && spi_hz > reliable_hz)) {
+		// Host reads clock in zero filler, which the parser ignores between frames, so the
+		// queue is copied out in one go. This keeps the simulator's share of the receive
+		// paths small next to the library's
+		size_t avail = selected ? outq.size() - outpos : 0;
+		if (avail > (size_t) n) avail = n;
+		if (rx) {
+			if (avail) memcpy(rx, &outq[outpos], avail);
+			memset(rx + avail, 0xFF, n - avail);
+		}
+		outpos += avail;
+	} else {
+		for (int i = 0; i < n; i++) {
+			uint8_t out = 0xFF;
+			if (selected && outpos < outq.size()) out = outq[outpos++];
+			if (reliable_hz && spi_hz > reliable_hz && (++noise & 0x3F) == 0) out ^= 0x04;
+			if (rx) rx[i] = out;
+			if (selected) parse(tx ? tx[i] : 0x00);
+		}
+	}
+	bytes_clocked += n;
+	unsigned long long ns = (unsigned long long) n * 8ULL * 1000000000ULL / spi_hz;
+	bus_ns += ns;
+	virtual_ns += ns;
+	update_atn();
+}
+
+// ATN is asserted (low) while the module has data queued for the host
+int XbeeSim::pin_read(uint8_t pin)
+{
+	pin_calls++;
+	if (pin == pin_atn) return outpos < outq.size() ? LOW : HIGH;
+	return HIGH;
+}
+
+// ATN follows the module queue, an attached handler sees each falling edge
+void XbeeSim::update_atn()
+{
+	bool low = outpos < outq.size();
+	if (low && !atn_low) {
+		atn_edges++;
+		if (atn_isr) atn_isr();
+	}
+	atn_low = low;
+}
+
+void XbeeSim::attach_interrupt(uint8_t pin, void (*isr)(void), int mode)
+{
+	if (pin == pin_atn && mode == FALLING) atn_isr = isr;
+}
+
+void XbeeSim::detach_interrupt(uint8_t pin)
+{
+	if (pin == pin_atn) atn_isr = NULL;
+}
+
+// Chip select, and the RESET line. Releasing RESET restarts the module which
+// reports itself with a modem status frame
+void XbeeSim::pin_write(uint8_t pin, uint8_t val)
+{
+	pin_calls++;
+	if (pin == pin_cs) selected = (val == LOW);
+	if (pin == pin_reset && pin != 0xFF) {
+		if (val == LOW) {
+			in_reset = true;
+		} else if (in_reset) {
+			in_reset = false;
+			outq.clear();
+			outpos = 0;
+			state = SIM_WAIT_START;
+			update_atn();
+			queue_modem_status(XBEE_MODEM_STATUS_RESET);
+		}
+	}
+}
+
+// Frame parser for data arriving from the host
+void XbeeSim::parse(uint8_t in)
+{
+	switch(state) {
+		case SIM_WAIT_START	:
+			// Filler bytes clocked during reads are ignored
+			if (in == 0x7E) state = SIM_LEN_MSB;
+			break;
+		case SIM_LEN_MSB	:
+			inlen = ((unsigned int) in) << 8;
+			state = SIM_LEN_LSB;
+			break;
+		case SIM_LEN_LSB	:
+			inlen |= in;
+			inbuf.clear();
+			state = inlen > 0 ? SIM_BODY : SIM_WAIT_START;
+			break;
+		case SIM_BODY		:
+			inbuf.push_back(in);
+			if (inbuf.size() == inlen + 1) {
+				// Type, content and checksum all present
+				uint8_t cs = 0;
+				for (size_t i = 0; i < inbuf.size(); i++) cs += inbuf[i];
+				frames_in++;
+				if (cs != 0xFF) {
+					frames_in_bad++;
+				} else {
+					last_type = inbuf[0];
+					last_frame.assign(inbuf.begin() + 1, inbuf.end() - 1);
+					handle_frame(inbuf[0], &inbuf[1], inlen - 1);
+				}
+				state = SIM_WAIT_START;
+			}
+			break;
+	}
+}
+
+// Apply a local AT command
+// Commands with a parameter set the value (once applied, if queued), commands without return it
+uint8_t XbeeSim::local_at(const char *atxx, const uint8_t *parm, int parmlen, std::vector<uint8_t> *response, bool queued)
+{
+	std::string cmd(atxx, 2);
+	if (cmd == "AC") {
+		at_applies++;
+		for (t_params::iterator it = params_queued.begin(); it != params_queued.end(); ++it) params[it->first] = it->second;
+		params_queued.clear();
+	}
+	if (cmd == "WR") flash_writes++;
+	if (cmd == "AC" || cmd == "WR" || cmd == "FR" || cmd == "NR" || cmd == "RE" || cmd == "AS") return 0x00;
+	if (parmlen > 0) {
+		(queued ? params_queued : params)[cmd].assign(parm, parm + parmlen);
+	} else {
+		t_params::iterator it = params.find(cmd);
+		if (it != params.end()) *response = it->second;
+	}
+	return 0x00;
+}
+
+// Default behaviour for frames from the host
+void XbeeSim::handle_frame(uint8_t type, const uint8_t *data, int len)
+{
+	std::vector<uint8_t> response;
+	switch(type) {
+		case XBEE_API_FRAME_TX_IPV4	:
+		case XBEE_API_FRAME_TX64	:
+			// Non zero frame id requests a TX status response
+			tx_frames++;
+			// Frame id, then 4 (TX64) or 10 (IPv4) bytes of addressing precede the payload
+			tx_bytes += len - (type == XBEE_API_FRAME_TX64 ? 6 : 11);
+			if (auto_tx_status && len > 0 && data[0] != 0) {
+				uint8_t status[2] = { data[0], tx_status_code };
+				queue_frame(XBEE_API_FRAME_TX_STATUS, status, 2);
+			}
+			// Frame id, IP, destination port, source port, protocol, options
+			if (loopback && type == XBEE_API_FRAME_TX_IPV4 && len >= 11) {
+				queue_rx_ipv4(data + 1, (data[5] << 8) | data[6], (data[7] << 8) | data[8], data[9], data + 11, len - 11);
+			}
+			break;
+
+		case XBEE_API_FRAME_ATCMD	:
+		case XBEE_API_FRAME_ATCMD_QUEUED:
+			// Frame id, two character command, parameter
+			if (len < 3) break;
+			at_commands++;
+			{
+				std::vector<uint8_t> value;
+				uint8_t status = local_at((const char *) data + 1, data + 3, len - 3, &value, type == XBEE_API_FRAME_ATCMD_QUEUED);
+				response.assign(data, data + 3);
+				response.push_back(status);
+				response.insert(response.end(), value.begin(), value.end());
+			}
+			// Active scan is answered by separate scan result frames
+			if (auto_at_response && type == XBEE_API_FRAME_ATCMD && data[0] != 0 && !(data[1] == 'A' && data[2] == 'S')) {
+				queue_frame(XBEE_API_FRAME_ATCMD_RESP, &response[0], response.size());
+			}
+			break;
+
+		case XBEE_API_FRAME_REMOTE_CMD_REQ :
+			// Frame id, 4 reserved, IP, options, command, parameter
+			if (len < 12) break;
+			remote_commands++;
+			{
+				std::map<uint32_t, t_params>::iterator node = remotes.find(ip_key(data + 5));
+				if (node == remotes.end() || !auto_at_response) break;	// Nobody home
+				response.assign(data, data + 9);
+				response.push_back(data[10]);
+				response.push_back(data[11]);
+				response.push_back(0x00);
+				std::string cmd((const char *) data + 10, 2);
+				if (len > 12) {
+					node->second[cmd].assign(data + 12, data + len);
+				} else if (node->second.count(cmd)) {
+					std::vector<uint8_t> &v = node->second[cmd];
+					response.insert(response.end(), v.begin(), v.end());
+				}
+				queue_frame(XBEE_API_FRAME_REMOTE_CMD_RESP, &response[0], response.size());
+			}
+			break;
+	}
+}
+
+// Hardware abstraction, as declared in xbee_host.h
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	if (xbee_sim) xbee_sim->pin_write(pin, val);
+}
+
+int digitalRead(uint8_t pin)
+{
+	return xbee_sim ? xbee_sim->pin_read(pin) : HIGH;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode)
+{
+	if (xbee_sim) xbee_sim->attach_interrupt(interrupt, isr, mode);
+}
+
+void detachInterrupt(uint8_t interrupt)
+{
+	if (xbee_sim) xbee_sim->detach_interrupt(interrupt);
+}
+
+unsigned long millis()
+{
+	return (unsigned long) (xbee_sim_micros() / 1000ULL);
+}
+
+unsigned long micros()
+{
+	return (unsigned long) xbee_sim_micros();
+}
+
+void delay(unsigned long ms)
+{
+	virtual_ns += (unsigned long long) ms * 1000000ULL;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	virtual_ns += (unsigned long long) us * 1000ULL;
+}
+
+void xbee_host_spi_clock(unsigned long hz)
+{
+	if (xbee_sim) xbee_sim->spi_hz = hz;
+}
+
+void xbee_host_spi_transfer(const uint8_t *tx, uint8_t *rx, int n)
+{
+	if (xbee_sim) {
+		xbee_sim->spi_transfer(tx, rx, n);
+	} else if (rx) {
+		memset(rx, 0xFF, n);
+	}
+}
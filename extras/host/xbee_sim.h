@@ -0,0 +1,174 @@
+/*
+ * File			xbee_sim.h
+ *
+ * Synopsis		Simulated Xbee Wifi module for host (Linux) builds of the library
+ *
+ * Author		Chris Bearman
+ *
+ * Version		1.0
+ *
+ * License		This software is released under the terms of the Mozilla Public License (MPL) version 2.0
+ * 			Full details of licensing terms can be found in the "LICENSE" file, distributed with this code
+ *
+ * Instructions		Build the library with XBEE_HOST defined and link against xbee_sim.cpp
+ *			The simulator provides the Arduino subset declared in xbee_host.h and the SPI
+ *			transport backend. It models the ATN line and the 0x7E API framing in both directions.
+ *			Local and remote AT commands are answered from simple parameter tables, confirmed
+ *			transmissions receive TX status frames, and a reset through the RESET line produces
+ *			a modem status frame. Received IP data, compatability mode data, IO samples and modem
+ *			status indications can be queued for delivery by the caller.
+ *
+ *			The ATN line can drive an interrupt handler attached with attachInterrupt(), which is
+ *			called on each falling edge as the module queue goes from empty to non empty.
+ *
+ *			Time is partly virtual: delay() and delayMicroseconds() advance the clock without
+ *			sleeping, and clocked SPI bytes are accounted at the simulated bus rate, so that
+ *			benchmarks measure CPU cost rather than wall clock waits.
+ */
+#ifndef __XBEESIM_H__
+#define __XBEESIM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <map>
+#include <string>
+
+class XbeeSim
+{
+	public:
+	// Pins the library will be initialized with
+	XbeeSim(uint8_t cs, uint8_t atn, uint8_t reset = 0xFF);
+
+	// Discard all queued data and counters (parameters are kept)
+	void reset();
+
+	// Set a local AT parameter value as returned by queries
+	void set_param(const char *atxx, const uint8_t *value, int len);
+	void set_param(const char *atxx, const char *value);
+
+	// Add a remote node that will answer remote AT commands, and set its parameters
+	void add_remote(const uint8_t *ip);
+	void set_remote_param(const uint8_t *ip, const char *atxx, const uint8_t *value, int len);
+
+	// Retrieve a (local or remote) parameter value. Returns false if never set
+	bool get_param(const char *atxx, std::vector<uint8_t> *value);
+	bool get_remote_param(const uint8_t *ip, const char *atxx, std::vector<uint8_t> *value);
+
+	// Queue an API frame (module to host). data is the frame content following the type byte
+	void queue_frame(uint8_t type, const uint8_t *data, int len);
+
+	// Queue an IPv4 reception frame (0xB0)
+	void queue_rx_ipv4(const uint8_t *ip, uint16_t dest_port, uint16_t source_port, uint8_t protocol, const uint8_t *data, int len);
+
+	// Queue a compatability mode (0xBEE app service) reception frame (0x80)
+	void queue_rx_compat(const uint8_t *ip, const uint8_t *data, int len);
+
+	// Queue a modem status frame (0x8A)
+	void queue_modem_status(uint8_t status);
+
+	// Queue an IO sample frame (0x8F) carrying a single sample set
+	// Digital samples are included when digital_mask is non zero, followed by
+	// one analog reading per bit set in analog_mask
+	void queue_io_sample(const uint8_t *ip, uint16_t digital_mask, uint8_t analog_mask, uint16_t digital_samples, const uint16_t *analog);
+
+	// Queue an active scan result, as returned in response to ATAS
+	void queue_scan_result(uint8_t frame_id, uint8_t encryption, uint8_t rssi, const char *ssid);
+
+	// Number of bytes still waiting to be read by the host
+	unsigned long pending() const { return outq.size() - outpos; }
+
+	// When true (default), confirmed transmissions receive a TX status frame
+	bool auto_tx_status;
+
+	// Delivery status reported in TX status frames (0 = success)
+	uint8_t tx_status_code;
+
+	// When true, IPv4 transmissions are queued back to the host as receptions from the
+	// address they were sent to, with the ports left as sent (default false)
+	bool loopback;
+
+	// When true (default), local and remote AT commands are answered
+	bool auto_at_response;
+
+	// Simulated SPI clock rate, used for bus time accounting
+	unsigned long spi_hz;
+
+	// Fastest clock the simulated wiring carries cleanly (0 for any). Above it, one byte in
+	// every 64 sent to the host has a bit flipped
+	unsigned long reliable_hz;
+
+	// Counters
+	unsigned long frames_in;	// Complete frames received from host
+	unsigned long frames_in_bad;	// Of which had a bad checksum
+	unsigned long at_commands;	// Local AT commands received (immediate and queued)
+	unsigned long at_applies;	// Of which were AC
+	unsigned long flash_writes;	// Of which were WR
+	unsigned long remote_commands;	// Remote AT commands received
+	unsigned long tx_frames;	// IP transmissions received
+	unsigned long tx_bytes;		// Payload bytes of those transmissions
+	unsigned long bytes_clocked;	// SPI bytes clocked in total
+	unsigned long long bus_ns;	// Simulated time spent clocking the bus
+	unsigned long atn_edges;	// ATN falling edges
+	unsigned long pin_calls;	// digitalRead / digitalWrite calls made by the host
+
+	// Last frame received from the host (type then content)
+	uint8_t last_type;
+	std::vector<uint8_t> last_frame;
+
+	// Hardware abstraction entry points, called through xbee_host.h functions
+	void spi_transfer(const uint8_t *tx, uint8_t *rx, int n);
+	int pin_read(uint8_t pin);
+	void pin_write(uint8_t pin, uint8_t val);
+	void attach_interrupt(uint8_t pin, void (*isr)(void), int mode);
+	void detach_interrupt(uint8_t pin);
+
+	protected:
+	// Called for each complete, valid frame received from the host
+	virtual void handle_frame(uint8_t type, const uint8_t *data, int len);
+
+	// Apply a local AT command, returning the status code and any response data
+	// Values set by queued commands are held until AC applies them
+	uint8_t local_at(const char *atxx, const uint8_t *parm, int parmlen, std::vector<uint8_t> *response, bool queued = false);
+
+	uint8_t pin_cs;
+	uint8_t pin_atn;
+	uint8_t pin_reset;
+	bool selected;
+	bool in_reset;
+
+	// Parameter tables, keyed by the two character command
+	typedef std::map<std::string, std::vector<uint8_t> > t_params;
+	t_params params;
+	t_params params_queued;
+	std::map<uint32_t, t_params> remotes;
+
+	private:
+	// Feed one byte received from the host into the frame parser
+	void parse(uint8_t in);
+
+	// Follow the ATN level after the module queue changes, raising the interrupt on a falling edge
+	void update_atn();
+	bool atn_low;
+	void (*atn_isr)(void);
+
+	// Bytes sent to the host, counted for the reliable_hz noise
+	unsigned long noise;
+
+	// Module to host byte queue
+	std::vector<uint8_t> outq;
+	size_t outpos;
+
+	// Host to module frame parser
+	int state;
+	unsigned int inlen;
+	std::vector<uint8_t> inbuf;
+};
+
+// The active simulator instance, used by the hardware abstraction functions
+extern XbeeSim *xbee_sim;
+
+// Simulated elapsed time in microseconds (real time plus virtual delays and bus time)
+unsigned long long xbee_sim_micros();
+
+#endif // __XBEESIM_H__
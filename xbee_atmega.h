@@ -31,6 +31,8 @@
    According to datasheet the Xbee Wifi unit supports up to 3.5Mhz SPI
    bus.
 
+   This is the divisor used from startup, it may be changed at run time with set_spi_clock
+
 */
 #define SPI_BUS_DIVISOR 8
 
@@ -40,40 +42,105 @@
    Keep this value >=48 bytes as an absolute minimum */
 #define XBEE_BUFSIZE 128
 
-/* Implementation of various speeds, don't mess with this */
-#if SPI_BUS_DIVISOR == 2
-// FCPU/2 (8Mhz typical)
-#define XBEE_SPCR (1 << SPE) | (1 << MSTR)
-#define XBEE_SPSR (1 << SPI2X)
-#elif SPI_BUS_DIVISOR == 4
-// FCPU/4 (4Mhz typical)
-#define XBEE_SPCR (1 << SPE) | (1 << MSTR)
-#define XBEE_SPSR 0x00
-#elif SPI_BUS_DIVISOR == 8
-// FCPU/8 (2Mhz typical)
-#define XBEE_SPCR (1 << SPE) | (1 << MSTR) | (1 << SPR0)
-#define XBEE_SPSR (1 << SPI2X)
-#elif SPI_BUS_DIVISOR == 32
-// FCPU/32 (500Khz typical)
-#define XBEE_SPCR (1 << SPE) | (1 << MSTR) | (1 << SPR1)
-#define XBEE_SPSR (1 << SPI2X)
-#elif SPI_BUS_DIVISOR == 64
-// FCPU/64 (250Khz typical)
-#define XBEE_SPCR (1 << SPE) | (1 << MSTR) | (1 << SPR1)
-#define XBEE_SPSR 0x00
-#elif SPI_BUS_DIVISOR == 128
-// FCPU/128 (125Khz typical)
-#define XBEE_SPCR (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0)
-#define XBEE_SPSR 0x00
-#else 
-// FCPU/16 (1Mhz typical, default)
-#define XBEE_SPCR (1 << SPE) | (1 << MSTR) | (1 << SPR0)
-#define XBEE_SPSR 0x00
+/* Default size of the working buffer arena, from which the receive, AT command and transmit
+   paths borrow their XBEE_BUFSIZE working buffers in turn rather than each placing one on the
+   stack. Reception while an AT command or confirmed transmission is waiting needs two
+   The size, or the arena itself, may also be given to the XbeeWifi constructor */
+#define XBEE_ARENA_SIZE (2 * (XBEE_BUFSIZE + 1))
+
+/* Features that hold tables in DRAM for as long as the XbeeWifi object exists are left out
+   on this platform unless enabled. Uncomment the matching XBEE_ENABLE_xxx to include one
+     XBEE_ENABLE_TX_ASYNC	transmit_async, XBEE_TX_PENDING records
+     XBEE_ENABLE_TX_QUEUE	transmit_queued, XBEE_TX_QUEUES frame buffers
+     XBEE_ENABLE_AT_ASYNC	at_xxx_async, fan-out and remote profile sync, XBEE_AT_PENDING records
+     XBEE_ENABLE_RX_ROUTES	register_ip_port_callback, XBEE_RX_ROUTES handlers
+     XBEE_ENABLE_AT_CACHE	answering at_query from RAM
+     XBEE_ENABLE_SAMPLE_STORE	enable_sample_store
+   get_memfootprint reports what the object holds with the features chosen */
+// #define XBEE_ENABLE_TX_ASYNC
+// #define XBEE_ENABLE_TX_QUEUE
+// #define XBEE_ENABLE_AT_ASYNC
+// #define XBEE_ENABLE_RX_ROUTES
+// #define XBEE_ENABLE_AT_CACHE
+// #define XBEE_ENABLE_SAMPLE_STORE
+#ifndef XBEE_ENABLE_TX_ASYNC
+#define XBEE_OMIT_TX_ASYNC
+#endif
+#ifndef XBEE_ENABLE_TX_QUEUE
+#define XBEE_OMIT_TX_QUEUE
+#endif
+#ifndef XBEE_ENABLE_AT_ASYNC
+#define XBEE_OMIT_AT_ASYNC
+#endif
+#ifndef XBEE_ENABLE_RX_ROUTES
+#define XBEE_OMIT_RX_ROUTES
 #endif
+#ifndef XBEE_ENABLE_AT_CACHE
+#define XBEE_OMIT_AT_CACHE
+#endif
+#ifndef XBEE_ENABLE_SAMPLE_STORE
+#define XBEE_OMIT_SAMPLE_STORE
+#endif
+
+/* Minimum time chip select is held de-asserted between SPI sessions, in microseconds
+   Frames drained together share one session, so this is paid once per drain, not per frame
+   Adjustable at run time with set_spi_guard() */
+#define XBEE_SPI_GUARD_US 100
+
+/* Maximum number of asynchronous transmissions awaiting status at once
+   Each costs 5 bytes of DRAM */
+#define XBEE_TX_PENDING 4
+
+/* Destinations that transmit_queued can merge data for at once, and the largest merged
+   frame. Each costs the frame size plus 16 bytes of DRAM */
+#define XBEE_TX_QUEUES 1
+#define XBEE_TX_QUEUE_BUFSIZE 64
+
+/* Maximum number of asynchronous AT commands queued or awaiting response at once
+   and the largest parameter each may carry. Each costs around 16 bytes of DRAM
+   plus the parameter length */
+#define XBEE_AT_PENDING 2
+#define XBEE_AT_ASYNC_PARMLEN 32
+
+/* Records kept in the trace ring when XBEE_ENABLE_TRACE is defined
+   Each costs 9 bytes of DRAM */
+#define XBEE_TRACE_RECORDS 16
+
+/* Analog channels and ring entries the sample store keeps per source
+   Each source costs around 100 bytes of DRAM plus 2 bytes per entry for each channel, and
+   the digital lines */
+#define XBEE_SAMPLE_CHANNELS 4
+#define XBEE_SAMPLE_HISTORY 8
+
+/* Maximum number of per port / per peer IP data handlers
+   Each costs 11 bytes of DRAM */
+#define XBEE_RX_ROUTES 4
+
+/* Clock the SPI divisor applies to, and the fastest rate the Xbee supports (3.5Mhz)
+   set_spi_clock and calibrate_spi_clock choose a divisor at run time from these */
+#define XBEE_SPI_MASTER_HZ F_CPU
+#define XBEE_SPI_MAX_HZ 3500000UL
 
 /* Delay for post CS assert and pre CS retract */
 #define NOP_COUNT 1
 
+/* Constant tables (and optionally transmitted data) live in program memory
+   on this platform and must be read back through the pgmspace functions */
+#define XBEE_PROGMEM PROGMEM
+#define XBEE_PGM_COPY(dst, src, len) memcpy_P((dst), (src), (len))
+
+/* Direct pin access for the chip select and ATN lines
+   The port registers and bit mask of a pin are looked up once and kept. Writes are made
+   with interrupts held off, since other pins on the same port may be changed from interrupts */
+typedef volatile uint8_t *xbee_port_t;
+typedef uint8_t xbee_mask_t;
+#define XBEE_PIN_OUT(pin) portOutputRegister(digitalPinToPort(pin))
+#define XBEE_PIN_IN(pin) portInputRegister(digitalPinToPort(pin))
+#define XBEE_PIN_MASK(pin) digitalPinToBitMask(pin)
+#define XBEE_PORT_SET(port, mask) do { uint8_t sreg = SREG; cli(); *(port) |= (mask); SREG = sreg; } while (0)
+#define XBEE_PORT_CLEAR(port, mask) do { uint8_t sreg = SREG; cli(); *(port) &= ~(mask); SREG = sreg; } while (0)
+#define XBEE_PORT_READ(port, mask) ((*(port) & (mask)) != 0)
+
 /* For assistance with debugging, the F(xxx) macro assists in embedding
    strings in progmem  */
 class __FlashStringHelper;
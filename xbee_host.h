@@ -0,0 +1,137 @@
+/*
+ * File			xbee_host.h
+ *
+ * Synopsis		Support macros for host (Linux) builds running against a simulated Xbee
+ *
+ * Author		Chris Bearman
+ *
+ * Version		1.0
+ *
+ * License		This software is released under the terms of the Mozilla Public License (MPL) version 2.0
+ * 			Full details of licensing terms can be found in the "LICENSE" file, distributed with this code
+ *
+ * Instructions		Selected by defining XBEE_HOST when compiling the library on a desktop machine
+ *			There is no Arduino core in this case, so the small subset of the Arduino API used
+ *			by the library is declared here and must be provided by the host harness, along with
+ *			the SPI transport backend. See extras/host for the simulated module that does this.
+ */
+#ifndef __XBEEHOST_H__
+#define __XBEEHOST_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Define ARCH_HOST which will be used elsewhere when instructions
+   specific to the host build are needed */
+#define ARCH_HOST
+
+/* Working buffer size. Memory is plentiful, so match the Due */
+#define XBEE_BUFSIZE 1472
+
+/* Default size of the working buffer arena, shared in turn by the paths needing an
+   XBEE_BUFSIZE buffer. The size, or the arena itself, may also be given to the constructor */
+#define XBEE_ARENA_SIZE (2 * (XBEE_BUFSIZE + 1))
+
+/* The simulator needs no chip select guard time */
+#define XBEE_SPI_GUARD_US 0
+
+/* Maximum number of asynchronous transmissions awaiting status at once */
+#define XBEE_TX_PENDING 8
+
+/* Destinations that transmit_queued can merge data for at once, and the largest merged frame */
+#define XBEE_TX_QUEUES 4
+#define XBEE_TX_QUEUE_BUFSIZE 1400
+
+/* Maximum number of asynchronous AT commands queued or awaiting response at once
+   and the largest parameter each may carry */
+#define XBEE_AT_PENDING 8
+#define XBEE_AT_ASYNC_PARMLEN 64
+
+/* Records kept in the trace ring when XBEE_ENABLE_TRACE is defined */
+#define XBEE_TRACE_RECORDS 128
+
+/* Analog channels and ring entries the sample store keeps per source */
+#define XBEE_SAMPLE_CHANNELS 8
+#define XBEE_SAMPLE_HISTORY 64
+
+/* Maximum number of per port / per peer IP data handlers */
+#define XBEE_RX_ROUTES 8
+
+/* The SPI clock is modelled on the Due, a divisor (1..255) of an 84Mhz master clock */
+#define SPI_BUS_DIVISOR 84u
+#define XBEE_SPI_MASTER_HZ 84000000UL
+#define XBEE_SPI_MAX_HZ 3500000UL
+
+/* No chip select settle time is needed against the simulator */
+#define NOP_COUNT 0
+
+/* No progmem on the host */
+#define F(str) (str)
+#define XBEE_PROGMEM
+#define XBEE_PGM_COPY(dst, src, len) memcpy((dst), (src), (len))
+
+/* There are no ports to access directly, pins always go through digitalWrite / digitalRead
+   so that the simulated module sees them */
+#define XBEE_NO_DIRECT_PINS
+
+/* Subset of the Arduino API used by the library */
+#define LOW		0x0
+#define HIGH		0x1
+#define INPUT		0x0
+#define OUTPUT		0x1
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+#define FALLING		0x2
+#define digitalPinToInterrupt(p)	(p)
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+
+/* Minimal Print / Stream base classes, enough for classes implementing the Stream interface
+   and for code consuming them through it */
+class Print
+{
+	public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buf, size_t size)
+	{
+		size_t n = 0;
+		while (size--) {
+			if (write(*buf++)) n++;
+			else break;
+		}
+		return n;
+	}
+	virtual void flush() {}
+};
+
+class Stream : public Print
+{
+	public:
+	Stream() : _timeout(1000) {}
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	void setTimeout(unsigned long timeout) { _timeout = timeout; }
+
+	protected:
+	unsigned long _timeout;
+};
+
+/* SPI transport backend
+   Clocks n bytes full duplex. tx may be NULL (zeros are sent), rx may be NULL (input discarded) */
+void xbee_host_spi_transfer(const uint8_t *tx, uint8_t *rx, int n);
+
+/* Tells the backend the SPI clock rate now in use */
+void xbee_host_spi_clock(unsigned long hz);
+
+#endif // __XBEEHOST_H__
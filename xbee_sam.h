@@ -27,9 +27,16 @@
    For example, with a 84Mhz clock, a value of 84 gives a 1Mhz clock
 
    According to datasheet the Xbee Wifi unit supports up to 3.5Mhz SPI
-   bus which would equate to a divisor of 24 */
+   bus which would equate to a divisor of 24
+
+   This is the divisor used from startup, it may be changed at run time with set_spi_clock */
 #define SPI_BUS_DIVISOR 84u
 
+/* Clock the SPI divisor applies to, and the fastest rate the Xbee supports
+   set_spi_clock and calibrate_spi_clock choose a divisor at run time from these */
+#define XBEE_SPI_MASTER_HZ F_CPU
+#define XBEE_SPI_MAX_HZ 3500000UL
+
 /* The Arduino DUE supports four chip selects, three of which are on real pins
    the fourth of which is not available. These are:
 
@@ -53,10 +60,57 @@
    memory on this platform */
 #define XBEE_BUFSIZE 1472
 
+/* Default size of the working buffer arena, shared in turn by the paths needing an
+   XBEE_BUFSIZE buffer. The size, or the arena itself, may also be given to the constructor */
+#define XBEE_ARENA_SIZE (2 * (XBEE_BUFSIZE + 1))
+
+/* Minimum time chip select is held de-asserted between SPI sessions, in microseconds
+   Adjustable at run time with set_spi_guard() */
+#define XBEE_SPI_GUARD_US 100
+
+/* Maximum number of asynchronous transmissions awaiting status at once */
+#define XBEE_TX_PENDING 8
+
+/* Destinations that transmit_queued can merge data for at once, and the largest merged frame */
+#define XBEE_TX_QUEUES 4
+#define XBEE_TX_QUEUE_BUFSIZE 1400
+
+/* Maximum number of asynchronous AT commands queued or awaiting response at once
+   and the largest parameter each may carry */
+#define XBEE_AT_PENDING 8
+#define XBEE_AT_ASYNC_PARMLEN 64
+
+/* Records kept in the trace ring when XBEE_ENABLE_TRACE is defined */
+#define XBEE_TRACE_RECORDS 128
+
+/* Analog channels and ring entries the sample store keeps per source */
+#define XBEE_SAMPLE_CHANNELS 8
+#define XBEE_SAMPLE_HISTORY 64
+
+/* Maximum number of per port / per peer IP data handlers */
+#define XBEE_RX_ROUTES 8
+
 /* Insert a NOP loop of this many iterations after asserting and prior to clearing CS
    Needed for stability at higher SPI clock frequencies */
 #define NOP_COUNT 1
 
+/* Flash is memory mapped on this platform, so constant tables are simply const
+   and need no special access */
+#define XBEE_PROGMEM
+#define XBEE_PGM_COPY(dst, src, len) memcpy((dst), (src), (len))
+
+/* Direct pin access for the chip select and ATN lines
+   The PIO controller and bit mask of a pin are looked up once and kept. The set / clear
+   registers make writes atomic without any further care */
+typedef Pio *xbee_port_t;
+typedef uint32_t xbee_mask_t;
+#define XBEE_PIN_OUT(pin) (g_APinDescription[pin].pPort)
+#define XBEE_PIN_IN(pin) (g_APinDescription[pin].pPort)
+#define XBEE_PIN_MASK(pin) (g_APinDescription[pin].ulPin)
+#define XBEE_PORT_SET(port, mask) ((port)->PIO_SODR = (mask))
+#define XBEE_PORT_CLEAR(port, mask) ((port)->PIO_CODR = (mask))
+#define XBEE_PORT_READ(port, mask) (((port)->PIO_PDSR & (mask)) != 0)
+
 /* For assistance with debugging, the F(xxx) macro assists in embedding
    strings in progmem.. But we don't do this on the SAM so the F(xxx) macro
    just does nothing except pass it's content straight through */